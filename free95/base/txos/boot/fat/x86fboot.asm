@@ -102,7 +102,7 @@ gdt_descriptor:
 [BITS 32]
 load32:
 	mov eax, 1
-	mov ecx, 100
+	mov ecx, 199 ; Everything up to the end of the reserved sectors
 	mov edi, 0x0100000
 	call ata_lba_read
 	jmp CODE_SEG:0x0100000
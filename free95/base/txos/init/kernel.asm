@@ -47,18 +47,22 @@ _start:
 
     mov al, 0x20 ; Interrupt 0x20 is where master ISR should start
     out 0x21, al
-    mov al, 0x28 ; Slave ISR vector offset
+    mov al, 0x70 ; Slave ISR vector offset, 0x28 would put IRQ14 on the 0x2E system call gate
     out 0xA1, al
     mov al, 00000100b ; Tell master PIC that there is a slave at IRQ2 (00000100b = 4)
     out 0x21, al
     mov al, 00000010b ; Tell slave PIC its cascade identity (00000010b = 2)
     out 0xA1, al
 
-    mov al, 00000001b
+    mov al, 00000001b ; 8086 mode for both
     out 0x21, al
     out 0xA1, al
     ; End remap
 
+    ; OCW1, only IRQ14, the primary ATA channel, is handled on the slave
+    mov al, 10111111b
+    out 0xA1, al
+
     call kernel_main
 
     jmp $
@@ -25,6 +25,7 @@ Abstract:
 #include "../ke/io/io.h"
 #include "../ke/memory/heap/kheap.h"
 #include "../ke/memory/paging/paging.h"
+#include "../ke/memory/frame/frame.h"
 #include "../ke/memory/memory.h"
 #include "../ke/disk/disk.h"
 #include "../ke/fs/pparser.h"
@@ -34,8 +35,11 @@ Abstract:
 #include "../ke/gdt/gdt.h"
 #include "../ke/config.h"
 #include "../ke/task/tss.h"
+#include "../ke/task/task.h"
 #include "../ke/base.h"
 #include "../ke/ntdll.h"
+#include "../ke/sync/sync.h"
+#include "../ke/smp/smp.h"
 #include "loader.h"
 
 static char copyright[] =
@@ -184,11 +188,114 @@ int IoTransEmpty()
    return insb(PORT + 5) & 0x20;
 }
 
+int IoSerialReceive()
+{
+   return insb(PORT + 5) & 1;
+}
+
+// Bytes on their way through COM1 once it is interrupt driven, the indexes only grow
+static char DbgTxBuffer[FREE95_SERIAL_BUFFER_SIZE];
+static volatile uint32_t DbgTxHead = 0;
+static volatile uint32_t DbgTxTail = 0;
+static char DbgRxBuffer[FREE95_SERIAL_BUFFER_SIZE];
+static volatile uint32_t DbgRxHead = 0;
+static volatile uint32_t DbgRxTail = 0;
+
+// Signaled when the transmit buffer has room again and when bytes were received
+static KEVENT DbgTxEvent;
+static KEVENT DbgRxEvent;
+static int DbgInterruptsEnabled = 0;
+
+/**
+ * Moves buffered bytes into the 16 byte transmit FIFO once it is empty.
+ * The transmitter interrupt stays enabled while bytes are left.
+ * Runs with interrupts disabled.
+ */
+static void DbgTransmit()
+{
+   if (IoTransEmpty())
+   {
+      for (int i = 0; i < 16 && DbgTxTail != DbgTxHead; i++)
+      {
+         outb(PORT, DbgTxBuffer[DbgTxTail % FREE95_SERIAL_BUFFER_SIZE]);
+         DbgTxTail++;
+      }
+   }
+
+   outb(PORT + 1, DbgTxTail != DbgTxHead ? 0x03 : 0x01);
+}
+
+/**
+ * Called from IRQ4 once the IDT is set up. Until then DbgPutc() and
+ * DbgGetc() poll the line status.
+ */
+void DbgEnableInterrupts()
+{
+   KeInitializeEvent(&DbgTxEvent, SynchronizationEvent, FALSE);
+   KeInitializeEvent(&DbgRxEvent, SynchronizationEvent, FALSE);
+   DbgInterruptsEnabled = 1;
+
+   // Received data interrupts only, DbgTransmit() adds the transmitter one when there is something to send
+   outb(PORT + 1, 0x01);
+}
+
+void DbgInterrupt()
+{
+   // Reading the identification register acknowledges a transmitter interrupt
+   insb(PORT + 2);
+
+   int received = 0;
+   while (IoSerialReceive())
+   {
+      char c = insb(PORT);
+      if (DbgRxHead - DbgRxTail < FREE95_SERIAL_BUFFER_SIZE)
+      {
+         DbgRxBuffer[DbgRxHead % FREE95_SERIAL_BUFFER_SIZE] = c;
+         DbgRxHead++;
+         received = 1;
+      }
+   }
+
+   if (received)
+   {
+      KeSetEvent(&DbgRxEvent, 0, FALSE);
+   }
+
+   DbgTransmit();
+   if (DbgTxHead - DbgTxTail < FREE95_SERIAL_BUFFER_SIZE)
+   {
+      KeSetEvent(&DbgTxEvent, 0, FALSE);
+   }
+}
+
 void DbgPutc(char a)
 {
-   while (IoTransEmpty() == 0);
+   if (!DbgInterruptsEnabled)
+   {
+      while (IoTransEmpty() == 0);
+
+      outb(PORT, a);
+      return;
+   }
 
-   outb(PORT, a);
+   ULONG flags = KeDisableInterrupts();
+   while (DbgTxHead - DbgTxTail == FREE95_SERIAL_BUFFER_SIZE)
+   {
+      if (KeCanWait())
+      {
+         KeWaitForSingleObject(&DbgTxEvent, 0);
+         continue;
+      }
+
+      // Interrupt handlers cannot sleep, they push the buffer out themselves
+      while (IoTransEmpty() == 0);
+      DbgTransmit();
+   }
+
+   DbgTxBuffer[DbgTxHead % FREE95_SERIAL_BUFFER_SIZE] = a;
+   DbgTxHead++;
+   DbgTransmit();
+   KeRestoreInterrupts(flags);
 }
 
 #define MAX_DBGPRINT_BUFFER 1024
@@ -272,16 +379,35 @@ void DbgPrint(const char *format, ...)
 }
 
 
-int IoSerialReceive()
-{
-   return insb(PORT + 5) & 1;
-}
-
 char DbgGetc()
 {
-   while (IoSerialReceive() == 0);
+   if (!DbgInterruptsEnabled || !KeCanWait())
+   {
+      ULONG flags = KeDisableInterrupts();
+      if (DbgRxTail != DbgRxHead)
+      {
+         char c = DbgRxBuffer[DbgRxTail % FREE95_SERIAL_BUFFER_SIZE];
+         DbgRxTail++;
+         KeRestoreInterrupts(flags);
+         return c;
+      }
+      KeRestoreInterrupts(flags);
+
+      while (IoSerialReceive() == 0);
+
+      return insb(PORT);
+   }
 
-   return insb(PORT);
+   ULONG flags = KeDisableInterrupts();
+   while (DbgRxTail == DbgRxHead)
+   {
+      KeWaitForSingleObject(&DbgRxEvent, 0);
+   }
+
+   char c = DbgRxBuffer[DbgRxTail % FREE95_SERIAL_BUFFER_SIZE];
+   DbgRxTail++;
+   KeRestoreInterrupts(flags);
+   return c;
 }
 
 char *strstr(const char *haystack, const char *needle)
@@ -469,6 +595,7 @@ static char HelpMsg[] =
     "\nList of commands\n"
     "help - Display this message\n"
     "cls - Clear the screen\n"
+    "start - Run an executable without waiting for it to finish\n"
     "If you do not see a command on this list, it is treated as an executable or batch script.\n";
 
 void ClearScreen()
@@ -493,6 +620,31 @@ void NsExec(char *ex_buffer, int isBat)
 
         exec = 0;
     }
+    else if (strncmp(ex_buffer, "start ", 6) == 0)
+    {
+        PrintString("\n");
+
+        NTSTATUS syscallResult;
+
+        asm volatile (
+                "movl $0x05, %%eax\n\t"
+                "movl %1, %%ebx\n\t"
+                "int $0x2e\n\t"
+                "mov %%eax, %0\n"
+                : "=r" (syscallResult)
+                : "r"(ex_buffer + 6)
+                : "%eax", "%ebx"
+        );
+
+        if (syscallResult != STATUS_SUCCESS)
+        {
+            PrintString("'");
+            PrintString(ex_buffer + 6);
+            PrintString("' is not recognized as an internal or external command, operable program or batch file.\n");
+        }
+
+        exec = 0;
+    }
     else if (ex_buffer[0] != '\0')
     {
         PrintString("\n");
@@ -516,6 +668,16 @@ void NsExec(char *ex_buffer, int isBat)
             if (syscallResult != NULL)
             {
                 ((MAIN)syscallResult)(1, NULL);
+
+                // The image is done, its pages, file and address range are released
+                asm volatile (
+                        "movl $0x09, %%eax\n\t"
+                        "movl %0, %%ebx\n\t"
+                        "int $0x2e\n"
+                        :
+                        : "r"(syscallResult)
+                        : "%eax", "%ebx"
+                );
             }
             else
             {
@@ -595,6 +757,19 @@ void KiUserInit()
         }
 
         memcpy(fb, buffer, w  * h * 32 / 8);
+
+        // Nothing to run, sleep until a key comes in or output from other tasks is due for a redraw
+        if (!exec)
+        {
+            ULONG timeout = FREE95_SHELL_REFRESH_MS;
+            asm volatile (
+                    "movl $0x08, %%eax\n\t"
+                    "int $0x2e\n"
+                    :
+                    : "b"(&timeout)
+                    : "%eax", "memory"
+            );
+        }
     }
 }
 
@@ -794,7 +969,12 @@ void LoadPsfFont(const char *path)
 
 	if (fd)
 	{
-		fread(fontdata, 5900, 1, fd);
+		struct file_stat stat;
+		if (fstat(fd, &stat) == 0)
+		{
+			fread(fontdata, stat.filesize < sizeof(fontdata) ? stat.filesize : sizeof(fontdata), 1, fd);
+		}
+		fclose(fd);
     }
     else
     {
@@ -881,15 +1061,29 @@ void kernel_main()
 
     DbgPrint("GDT Initialized\n\r");
 
+	memory_init();
+
+	DbgPrint("Memory Services Initialized\n\r");
+
 	kheap_init();
 
 	DbgPrint("Kernel Heap Initialized\n\r");
 
+	if (frame_init() < 0)
+	{
+		DbgPrint("Failed to initialize the Frame Allocator\n\r");
+	}
+	else
+	{
+		DbgPrint("Frame Allocator Initialized\n\r");
+	}
+
 	fs_init();
 
 	DbgPrint("Filesystem Initialized\n\r");
 
     idt_init();
+    DbgEnableInterrupts();
 
     DbgPrint("IDT Initialized\n\r");
 
@@ -900,6 +1094,15 @@ void kernel_main()
     
     DbgPrint("TSS Initialized\n\r");
 
+    paging_init();
+
+    // Maps the local APIC, which has to happen before the first directory is made
+    int cpus = smp_init();
+    if (cpus > 0)
+    {
+        DbgPrint("Found %d CPUs\n\r", cpus);
+    }
+
     kernel_chunk = paging_new_4gb(PAGING_IS_WRITEABLE | PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL);
     
     paging_switch(paging_4gb_chunk_get_directory(kernel_chunk));
@@ -932,8 +1135,15 @@ void kernel_main()
 	{
 		DbgPrint("Boot config file exists\n\r");
 		char buf[512];
-		fread(buf, 511, 1, fd);
-		buf[500] = 0x00;
+		struct file_stat stat;
+		uint32_t size = 0;
+		if (fstat(fd, &stat) == 0)
+		{
+			size = stat.filesize < sizeof(buf) - 1 ? stat.filesize : sizeof(buf) - 1;
+			fread(buf, size, 1, fd);
+		}
+		buf[size] = 0x00;
+		fclose(fd);
 		DbgPrint("\nRead boot.ini:\n");
 		DbgPrint(buf);
 
@@ -979,6 +1189,7 @@ void kernel_main()
 
 	buffer = (uint32_t*)kmalloc(w  * h * 32 / 8);
 	fb = (uint32_t*)0xFD000000;
+	paging_identity_map(fb, (char*)fb + (w * h * 32 / 8));
 
 	if (!buffer)
 	{
@@ -994,5 +1205,15 @@ void kernel_main()
 
     LoadPsfFont("0:/font.psf");
 
+    if (task_scheduler_init(kernel_chunk) < 0)
+    {
+        DbgPrint("Failed to initialize the Scheduler\n\r");
+    }
+    else
+    {
+        DbgPrint("Scheduler Initialized\n\r");
+        DbgPrint("%d CPUs running\n\r", smp_start());
+    }
+
     jump_usermode();
 }
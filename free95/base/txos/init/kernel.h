@@ -22,6 +22,8 @@ void terminal_writechar(char c, char colour);
 void snprintf(char *buffer, size_t size, const char *format, ...);
 void print(const char* str);
 void DbgPutc(char a);
+void DbgEnableInterrupts();
+void DbgInterrupt();
 void DbgPrint(const char *format, ...);
 void DbgLog(const char *msg, int type);
 void SetExecBuffer(char *b);
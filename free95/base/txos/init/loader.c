@@ -17,6 +17,7 @@ Abstract:
 --*/
 
 #include "loader.h"
+#include "../ke/task/task.h"
 
 typedef struct _IMAGE_DOS_HEADER {  // DOS .EXE header
     uint16_t e_magic;		// must contain "MZ"
@@ -187,32 +188,185 @@ WINBOOL LdrProcessPe(LPVOID pBufImageFile, PPEImageFileProcessed pPeImageFilePro
     return TRUE;
 }
 
-void LdrAllocMemory(DWORD SizeOfImage, LPVOID *pBufInMemPE)
+typedef struct _LDR_IMAGE
 {
-    DbgPrint("LdrAllocMemory() called with params:\nSizeOfImage=%d\npBufInMemPE=%d\n", SizeOfImage, pBufInMemPE);
+    // Next image at a higher address
+    struct _LDR_IMAGE* Next;
 
-    *pBufInMemPE = kmalloc(SizeOfImage);
+    // The task that runs the image, its pages are in the task's address space
+    struct task* Owner;
 
-    if (*pBufInMemPE == NULL)
+    // The image file stays open, pages are read from it when they are first touched
+    int FileHandle;
+
+    // Held by the loaded image and by every page fault reading from it, the last one frees it
+    ULONG References;
+
+    // Where the image was placed, the size of its range and how far that is from its preferred base
+    ULONG Base;
+    ULONG Size;
+    DWORD64 RelocOffset;
+
+    PEImageFileProcessed Pe;
+
+    // Headers and base relocations are read when the image is loaded
+    LPVOID Headers;
+    DWORD SizeOfHeaders;
+    LPVOID Relocations;
+    DWORD SizeOfRelocations;
+} LDR_IMAGE, *PLDR_IMAGE;
+
+// Loaded images sorted by base, the gaps between them are free address space
+static PLDR_IMAGE LdrImages = NULL;
+
+WINBOOL LdrReadFile(int fd, DWORD Offset, LPVOID Buffer, DWORD Length)
+{
+    if (Length == 0)
     {
-        DbgLog("LdrAllocMemory(): Failed to allocate memory", LOG_ERROR);
+        return TRUE;
     }
-    else
+
+    // Page faults of other tasks read the same descriptor, the position is set with the read
+    return fpread(Buffer, Length, 1, fd, Offset) >= 0;
+}
+
+/**
+ * Places the image in the first gap that fits it and links it into
+ * LdrImages, nothing is mapped until the image is touched. The range is
+ * free again once the image is unlinked.
+ */
+WINBOOL LdrReserveImage(PLDR_IMAGE Image)
+{
+    DbgPrint("LdrReserveImage() called with params:\nSizeOfImage=%d\n", Image->Pe.SizeOfImage);
+
+    ULONG Size = (Image->Pe.SizeOfImage + FREE95_IMAGE_ALIGNMENT - 1) & ~(FREE95_IMAGE_ALIGNMENT - 1);
+    ULONG Base = FREE95_IMAGE_VIRTUAL_ADDRESS;
+    PLDR_IMAGE* Link = &LdrImages;
+    while (*Link && (*Link)->Base - Base < Size)
     {
-        DbgLog("LdrAllocMemory(): Allocated memory successfully", LOG_SUCCESS);
+        Base = (*Link)->Base + (*Link)->Size;
+        Link = &(*Link)->Next;
     }
+
+    if (Size == 0 || Size > (FREE95_IMAGE_VIRTUAL_ADDRESS + FREE95_IMAGE_VIRTUAL_SIZE) - Base)
+    {
+        DbgLog("LdrReserveImage(): No room left for the image", LOG_ERROR);
+        return FALSE;
+    }
+
+    Image->Base = Base;
+    Image->Size = Size;
+    Image->Next = *Link;
+    *Link = Image;
+    return TRUE;
 }
 
-void LdrCpySections(PPEImageFileProcessed pPeImageFileProcessed, LPVOID pBufImageFile, LPVOID pBufInMemPE)
+static VOID LdrUnlinkImage(PLDR_IMAGE Image)
 {
-    DbgPrint("LdrCpySections() called with params:\npPeImageFileProcessed=0x%x\npBufImageFile=0x%x\n", pPeImageFileProcessed, pBufImageFile);
+    PLDR_IMAGE* Link = &LdrImages;
+    while (*Link && *Link != Image)
+    {
+        Link = &(*Link)->Next;
+    }
 
-    for (int i = 0; i < pPeImageFileProcessed->NumOfSections; i++)
+    if (*Link)
+    {
+        *Link = Image->Next;
+    }
+}
+
+static PLDR_IMAGE LdrFindImage(ULONG Address)
+{
+    PLDR_IMAGE Image = LdrImages;
+    while (Image && (Address < Image->Base || Address >= Image->Base + Image->Size))
     {
-        IMAGE_SECTION_HEADER SectionHeader = pPeImageFileProcessed->SectionHeaderFirst[i];
+        Image = Image->Next;
+    }
 
-        memcpy((void*)(DWORD64)pBufInMemPE + SectionHeader.VirtualAddress, (void*)(DWORD64)pBufImageFile + SectionHeader.PointerToRawData, SectionHeader.SizeOfRawData);
+    return Image;
+}
+
+static VOID LdrDereferenceImage(PLDR_IMAGE Image)
+{
+    if (--Image->References)
+    {
+        return;
     }
+
+    fclose(Image->FileHandle);
+    kfree(Image->Relocations);
+    kfree(Image->Headers);
+    kfree(Image);
+}
+
+/**
+ * Drops the pages the image has in its owner's address space and gives
+ * its range back, the file is closed once no page fault reads from it.
+ */
+static VOID LdrUnloadImage(PLDR_IMAGE Image)
+{
+    LdrUnlinkImage(Image);
+    if (Image->Owner && Image->Owner->page_directory)
+    {
+        paging_unmap_range(Image->Owner->page_directory->directory_entry, (void*)Image->Base, Image->Size / PAGING_PAGE_SIZE);
+    }
+
+    LdrDereferenceImage(Image);
+}
+
+// Pages are writeable when a writeable section covers part of them, headers are read-only
+static WINBOOL LdrIsPageWriteable(PLDR_IMAGE Image, DWORD PageRva)
+{
+    for (int i = 0; i < Image->Pe.NumOfSections; i++)
+    {
+        PIMAGE_SECTION_HEADER SectionHeader = &Image->Pe.SectionHeaderFirst[i];
+        DWORD Size = SectionHeader->Misc.VirtualSize > SectionHeader->SizeOfRawData ? SectionHeader->Misc.VirtualSize : SectionHeader->SizeOfRawData;
+        if ((SectionHeader->Characteristics & IMAGE_SCN_MEM_WRITE) &&
+            SectionHeader->VirtualAddress < PageRva + PAGING_PAGE_SIZE && SectionHeader->VirtualAddress + Size > PageRva)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * Reads a range of the image as it appears in memory before relocation
+ */
+WINBOOL LdrReadImage(PLDR_IMAGE Image, DWORD Rva, LPVOID Buffer, DWORD Length)
+{
+    memset(Buffer, 0, Length);
+
+    if (Rva < Image->SizeOfHeaders)
+    {
+        DWORD Count = Image->SizeOfHeaders - Rva;
+        memcpy(Buffer, ADD_OFFSET_TO_POINTER(Image->Headers, Rva), Count < Length ? Count : Length);
+    }
+
+    for (int i = 0; i < Image->Pe.NumOfSections; i++)
+    {
+        PIMAGE_SECTION_HEADER SectionHeader = &Image->Pe.SectionHeaderFirst[i];
+        DWORD Start = Rva > SectionHeader->VirtualAddress ? Rva : SectionHeader->VirtualAddress;
+        DWORD End = SectionHeader->VirtualAddress + SectionHeader->SizeOfRawData;
+        if (End > Rva + Length)
+        {
+            End = Rva + Length;
+        }
+
+        if (Start >= End)
+        {
+            continue;
+        }
+
+        if (!LdrReadFile(Image->FileHandle, SectionHeader->PointerToRawData + (Start - SectionHeader->VirtualAddress),
+                         ADD_OFFSET_TO_POINTER(Buffer, Start - Rva), End - Start))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
 }
 
 typedef struct _IMAGE_BASE_RELOCATION_ENTRY
@@ -227,46 +381,95 @@ typedef struct _IMAGE_BASE_RELOCATION {
     // WORD TypeOffset[]; // An array of relocation entries
 } IMAGE_BASE_RELOCATION, *PIMAGE_BASE_RELOCATION;
 
-void LdrRelocMemory(PPEImageFileProcessed pPeImageFileProcessed, LPVOID pBufInMemPE)
+/**
+ * Applies one base relocation to the part of it that lies in the page,
+ * fields that cross into a neighbouring page are read back from the file.
+ */
+void LdrRelocEntry(PLDR_IMAGE Image, WORD Type, DWORD Rva, DWORD PageRva, BYTE* Page)
 {
-    DbgPrint("LdrRelocMemory() called\n");
+    DWORD Width = 0;
+    switch (Type)
+    {
+        case IMAGE_REL_BASED_HIGH:
+        case IMAGE_REL_BASED_LOW:
+            Width = sizeof(WORD);
+            break;
+        case IMAGE_REL_BASED_HIGHLOW:
+            Width = sizeof(DWORD);
+            break;
+        case IMAGE_REL_BASED_DIR32:
+            Width = sizeof(DWORD64);
+            break;
+        case IMAGE_REL_BASED_ABSOLUTE: // The base relocation is skipped. This type can be used to pad a block.
+        default:
+            return;
+    }
 
-    PIMAGE_BASE_RELOCATION pImageBaseRelocation = (PIMAGE_BASE_RELOCATION)((DWORD64)pBufInMemPE + pPeImageFileProcessed->pDataDirectoryReloc->VirtualAddress);
-    DWORD NumImageBaseRelocationEntry = 0;
-    PIMAGE_BASE_RELOCATION_ENTRY pImageBaseRelocationEntry = 0;
-    DWORD64 relocOffset = (DWORD64)pBufInMemPE - pPeImageFileProcessed->ImageBase;
-    DWORD64 relocAt = 0;
+    if (Rva + Width <= PageRva || Rva >= PageRva + PAGING_PAGE_SIZE)
+    {
+        return;
+    }
 
-    // For each Base Relocation Block
-    while (pImageBaseRelocation->VirtualAddress != 0)
+    BYTE Value[sizeof(DWORD64) > sizeof(DWORD) ? sizeof(DWORD64) : sizeof(DWORD)];
+    if (Rva >= PageRva && Rva + Width <= PageRva + PAGING_PAGE_SIZE)
+    {
+        memcpy(Value, Page + (Rva - PageRva), Width);
+    }
+    else if (!LdrReadImage(Image, Rva, Value, Width))
     {
-        NumImageBaseRelocationEntry = (pImageBaseRelocation->SizeOfBlock - sizeof(IMAGE_BASE_RELOCATION)) / sizeof(IMAGE_BASE_RELOCATION_ENTRY);
-        pImageBaseRelocationEntry = (PIMAGE_BASE_RELOCATION_ENTRY)((DWORD64)pImageBaseRelocation + sizeof(IMAGE_BASE_RELOCATION));
-        relocAt = 0;
+        return;
+    }
+
+    switch (Type)
+    {
+        case IMAGE_REL_BASED_HIGH: // The base relocation adds the high 16 bits of the difference to the 16-bit field at offset. The 16-bit field represents the high value of a 32-bit word.
+            *(PWORD)Value += HIWORD(Image->RelocOffset);
+            break;
+        case IMAGE_REL_BASED_LOW: // The base relocation adds the low 16 bits of the difference to the 16-bit field at offset. The 16-bit field represents the low half of a 32-bit word.
+            *(PWORD)Value += LOWORD(Image->RelocOffset);
+            break;
+        case IMAGE_REL_BASED_HIGHLOW: // The base relocation applies all 32 bits of the difference to the 32-bit field at offset.
+            *(PDWORD)Value += (DWORD)Image->RelocOffset;
+            break;
+        case IMAGE_REL_BASED_DIR32:
+            *(PDWORD64)Value += Image->RelocOffset;
+            break;
+    }
+
+    for (DWORD i = 0; i < Width; i++)
+    {
+        if (Rva + i >= PageRva && Rva + i < PageRva + PAGING_PAGE_SIZE)
+        {
+            Page[Rva + i - PageRva] = Value[i];
+        }
+    }
+}
+
+void LdrRelocPage(PLDR_IMAGE Image, DWORD PageRva, BYTE* Page)
+{
+    if (!Image->RelocOffset || !Image->Relocations)
+    {
+        return;
+    }
+
+    PIMAGE_BASE_RELOCATION pImageBaseRelocation = (PIMAGE_BASE_RELOCATION)Image->Relocations;
+    LPVOID RelocationsEnd = ADD_OFFSET_TO_POINTER(Image->Relocations, Image->SizeOfRelocations);
 
-        // For each Base Relocation Block Entry
-        for (int i = 0; i < NumImageBaseRelocationEntry; i++)
+    // For each Base Relocation Block
+    while ((LPVOID)(pImageBaseRelocation + 1) <= RelocationsEnd && pImageBaseRelocation->VirtualAddress != 0 &&
+           pImageBaseRelocation->SizeOfBlock >= sizeof(IMAGE_BASE_RELOCATION))
+    {
+        // A block covers one page, its last fields may reach into the next one
+        DWORD BlockRva = pImageBaseRelocation->VirtualAddress;
+        if (BlockRva < PageRva + PAGING_PAGE_SIZE && BlockRva + PAGING_PAGE_SIZE + sizeof(DWORD64) > PageRva)
         {
-            relocAt = (DWORD64)ADD_OFFSET_TO_POINTER(pBufInMemPE, pImageBaseRelocation->VirtualAddress + pImageBaseRelocationEntry[i].Offset);
+            DWORD NumImageBaseRelocationEntry = (pImageBaseRelocation->SizeOfBlock - sizeof(IMAGE_BASE_RELOCATION)) / sizeof(IMAGE_BASE_RELOCATION_ENTRY);
+            PIMAGE_BASE_RELOCATION_ENTRY pImageBaseRelocationEntry = (PIMAGE_BASE_RELOCATION_ENTRY)(pImageBaseRelocation + 1);
 
-            switch (pImageBaseRelocationEntry[i].Type)
+            // For each Base Relocation Block Entry
+            for (DWORD i = 0; i < NumImageBaseRelocationEntry; i++)
             {
-                case IMAGE_REL_BASED_HIGH: // The base relocation adds the high 16 bits of the difference to the 16-bit field at offset. The 16-bit field represents the high value of a 32-bit word.
-                    *(PWORD)relocAt += HIWORD(relocOffset);
-                    break;
-                case IMAGE_REL_BASED_LOW: // The base relocation adds the low 16 bits of the difference to the 16-bit field at offset. The 16-bit field represents the low half of a 32-bit word.
-                    *(PWORD)relocAt += LOWORD(relocOffset);
-                    break;
-                case IMAGE_REL_BASED_HIGHLOW: // The base relocation applies all 32 bits of the difference to the 32-bit field at offset.
-                    *(PDWORD)relocAt += (DWORD)relocOffset;
-                    break;
-                case IMAGE_REL_BASED_DIR32: // The base relocation applies the difference to the 64-bit field at offset.
-                    DbgPrint("Yes!\n");
-                    *(PDWORD64)relocAt += relocOffset;
-                    break;
-                case IMAGE_REL_BASED_ABSOLUTE: // The base relocation is skipped. This type can be used to pad a block.
-                default:
-                    break;
+                LdrRelocEntry(Image, pImageBaseRelocationEntry[i].Type, BlockRva + pImageBaseRelocationEntry[i].Offset, PageRva, Page);
             }
         }
 
@@ -275,6 +478,175 @@ void LdrRelocMemory(PPEImageFileProcessed pPeImageFileProcessed, LPVOID pBufInMe
     }
 }
 
+/**
+ * Translates an RVA to the file offset of the section data that holds it
+ */
+WINBOOL LdrRvaToFileOffset(PPEImageFileProcessed pPeImageFileProcessed, DWORD Rva, DWORD* Offset)
+{
+    for (int i = 0; i < pPeImageFileProcessed->NumOfSections; i++)
+    {
+        PIMAGE_SECTION_HEADER SectionHeader = &pPeImageFileProcessed->SectionHeaderFirst[i];
+        if (Rva >= SectionHeader->VirtualAddress && Rva < SectionHeader->VirtualAddress + SectionHeader->SizeOfRawData)
+        {
+            *Offset = SectionHeader->PointerToRawData + (Rva - SectionHeader->VirtualAddress);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * Reads the headers and relocations of the image and reserves its address range
+ */
+PLDR_IMAGE LdrMapImage(int fd)
+{
+    IMAGE_DOS_HEADER DosHeader;
+    IMAGE_NT_HEADERS NtHeaders;
+    PLDR_IMAGE Image = NULL;
+    struct file_stat Stat;
+
+    if (fstat(fd, &Stat) < 0 || Stat.filesize < sizeof(DosHeader))
+    {
+        DbgLog("LdrMapImage(): File is too small to be a PE File", LOG_ERROR);
+        goto fail;
+    }
+
+    if (!LdrReadFile(fd, 0, &DosHeader, sizeof(DosHeader)) ||
+        DosHeader.e_lfanew + sizeof(NtHeaders) > Stat.filesize ||
+        !LdrReadFile(fd, DosHeader.e_lfanew, &NtHeaders, sizeof(NtHeaders)))
+    {
+        DbgLog("LdrMapImage(): Could not read the PE headers", LOG_ERROR);
+        goto fail;
+    }
+
+    Image = kzalloc(sizeof(LDR_IMAGE));
+    if (!Image)
+    {
+        goto fail;
+    }
+
+    Image->FileHandle = fd;
+    Image->References = 1;
+    Image->SizeOfHeaders = NtHeaders.OptionalHeader.SizeOfHeaders;
+    if (DosHeader.e_lfanew + sizeof(NtHeaders) > Image->SizeOfHeaders || Image->SizeOfHeaders > Stat.filesize)
+    {
+        DbgLog("LdrMapImage(): pBufImageFile is not a valid PE File", LOG_ERROR);
+        goto fail;
+    }
+    Image->Headers = kmalloc(Image->SizeOfHeaders);
+    if (!Image->Headers || !LdrReadFile(fd, 0, Image->Headers, Image->SizeOfHeaders))
+    {
+        goto fail;
+    }
+
+    if (!LdrProcessPe(Image->Headers, &Image->Pe))
+    {
+        DbgLog("LdrMapImage(): Could not successfully process PE File\n", LOG_ERROR);
+        goto fail;
+    }
+
+    // The range is taken right away, reading the file may let another task load an image
+    if (!LdrReserveImage(Image))
+    {
+        goto fail;
+    }
+    Image->RelocOffset = (DWORD64)Image->Base - Image->Pe.ImageBase;
+
+    // Relocations are needed for every page, so they are kept in memory
+    DWORD RelocOffset = 0;
+    Image->SizeOfRelocations = Image->Pe.pDataDirectoryReloc->Size;
+    if (Image->RelocOffset && Image->SizeOfRelocations)
+    {
+        Image->Relocations = kmalloc(Image->SizeOfRelocations);
+        if (!Image->Relocations ||
+            !LdrRvaToFileOffset(&Image->Pe, Image->Pe.pDataDirectoryReloc->VirtualAddress, &RelocOffset) ||
+            !LdrReadFile(fd, RelocOffset, Image->Relocations, Image->SizeOfRelocations))
+        {
+            DbgLog("LdrMapImage(): Could not read the base relocations", LOG_ERROR);
+            goto fail;
+        }
+    }
+
+    return Image;
+
+fail:
+    if (Image)
+    {
+        LdrUnlinkImage(Image);
+        kfree(Image->Relocations);
+        kfree(Image->Headers);
+        kfree(Image);
+    }
+    return NULL;
+}
+
+/**
+ * Called for page faults, loads the page if the address is inside a mapped image
+ */
+NTSTATUS LdrHandlePageFault(ULONG Address, ULONG ErrorCode)
+{
+    if (ErrorCode & PAGING_FAULT_PRESENT)
+    {
+        return STATUS_ACCESS_VIOLATION;
+    }
+
+    // Only the address space the image was loaded into has its pages
+    uint32_t* Directory = paging_current_directory();
+    PLDR_IMAGE Image = LdrFindImage(Address);
+    if (!Image || Address >= Image->Base + Image->Pe.SizeOfImage || !Image->Owner ||
+        !Image->Owner->page_directory || Image->Owner->page_directory->directory_entry != Directory)
+    {
+        return STATUS_ACCESS_VIOLATION;
+    }
+
+    NTSTATUS Status = STATUS_SUCCESS;
+    DWORD PageRva = (Address - Image->Base) & ~(PAGING_PAGE_SIZE - 1);
+    LPVOID Virtual = (LPVOID)(Image->Base + PageRva);
+    BYTE* Page = frame_alloc(PAGING_PAGE_SIZE);
+    if (!Page)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    // Reading sleeps without the kernel lock, the image may be unloaded or the page mapped meanwhile
+    Image->References++;
+    if (!LdrReadImage(Image, PageRva, Page, PAGING_PAGE_SIZE))
+    {
+        Status = STATUS_ACCESS_VIOLATION;
+        goto out;
+    }
+    LdrRelocPage(Image, PageRva, Page);
+
+    if (LdrFindImage(Address) != Image || (paging_get(Directory, Virtual) & PAGING_IS_PRESENT))
+    {
+        // Restarting the instruction faults again if the page went away with the image
+        goto out;
+    }
+
+    // The page belongs to the faulting address space and is released with it
+    uint32_t Flags = PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL | PAGING_IS_COPIED;
+    if (LdrIsPageWriteable(Image, PageRva))
+    {
+        Flags |= PAGING_IS_WRITEABLE;
+    }
+
+    if (paging_set(Directory, Virtual, (uint32_t)Page | Flags) < 0)
+    {
+        Status = STATUS_NO_MEMORY;
+        goto out;
+    }
+    Page = NULL;
+
+out:
+    if (Page)
+    {
+        frame_free(Page);
+    }
+    LdrDereferenceImage(Image);
+    return Status;
+}
+
 void join_paths(const char* str1, const char* str2, char* result, size_t result_size)
 {
     // Calculate the lengths of the input strings
@@ -297,7 +669,7 @@ void join_paths(const char* str1, const char* str2, char* result, size_t result_
     }
 }
 
-LPVOID LdrLoadPe(const LPSTR path)
+static PLDR_IMAGE LdrLoadImage(const LPSTR path)
 {
     DbgPrint("LdrLoadPe() called with params:\npath=%s\n", path);
 
@@ -312,22 +684,19 @@ LPVOID LdrLoadPe(const LPSTR path)
 
 	if (fd)
 	{
-		char pBufImageFile[6200];
-		fread(pBufImageFile, 6199, 1, fd);
-
-        PPEImageFileProcessed processedFile = NULL;
-
-        if(LdrProcessPe(pBufImageFile, processedFile))
+        PLDR_IMAGE Image = LdrMapImage(fd);
+        if (Image)
         {
             DbgLog("LdrLoadPe(): Successfully processed PE File\n", LOG_SUCCESS);
         }
         else
         {
             DbgLog("LdrLoadPe(): Could not successfully process PE File\n", LOG_ERROR);
+            fclose(fd);
             return NULL;
         }
 
-        if (processedFile->IsDll)
+        if (Image->Pe.IsDll)
         {
             DbgLog("LdrLoadPe(): File is a Dynamic Link Library", LOG_INFO);
         }
@@ -336,22 +705,87 @@ LPVOID LdrLoadPe(const LPSTR path)
             DbgLog("LdrLoadPe(): File is an Executable", LOG_INFO);
         }
 
-        DWORD64 pBufInMemPE = 0;
-        LdrAllocMemory(processedFile->SizeOfImage, (LPVOID)&pBufInMemPE);
+        return Image;
+    }
+    else
+    {
+        DbgLog("LdrLoadPe(): Failed to open PE File", LOG_FAIL);
+        return NULL;
+    }
+}
 
-        LdrCpySections(processedFile, pBufImageFile, (LPVOID)pBufInMemPE);
+/**
+ * Loads the image for the calling task, which runs its entry point itself
+ * and unloads it with LdrUnloadPe() once the entry point returns.
+ */
+LPVOID LdrLoadPe(const LPSTR path)
+{
+    PLDR_IMAGE Image = LdrLoadImage(path);
+    if (!Image)
+    {
+        return NULL;
+    }
+    Image->Owner = task_current();
+
+    // Sections are read when their pages are first touched
+    return ADD_OFFSET_TO_POINTER(Image->Base, Image->Pe.AddressOfEntryPointOffset);
+}
+
+/**
+ * Unloads the image of the calling task that contains Address.
+ */
+NTSTATUS LdrUnloadPe(LPVOID Address)
+{
+    PLDR_IMAGE Image = LdrFindImage((ULONG)Address);
+    if (!Image || Image->Owner != task_current())
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
 
-        LdrRelocMemory(processedFile, (LPVOID)pBufInMemPE);
+    LdrUnloadImage(Image);
+    return STATUS_SUCCESS;
+}
 
-        LPVOID pEntry = ADD_OFFSET_TO_POINTER(pBufInMemPE, processedFile->AddressOfEntryPointOffset);
+/**
+ * Unloads every image the task owns, called when it exits.
+ */
+VOID LdrReleaseTask(struct task* Task)
+{
+    PLDR_IMAGE Image = LdrImages;
+    while (Image)
+    {
+        PLDR_IMAGE Next = Image->Next;
+        if (Image->Owner == Task)
+        {
+            LdrUnloadImage(Image);
+        }
+        Image = Next;
+    }
+}
 
-        return pEntry;
+/**
+ * Loads the image like LdrLoadPe() and runs its entry point in a thread
+ * of its own, the caller does not wait for it to finish.
+ */
+NTSTATUS LdrStartPe(const LPSTR path)
+{
+    PLDR_IMAGE Image = LdrLoadImage(path);
+    if (!Image)
+    {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
     }
-    else
+
+    struct task* task = task_new_thread(ADD_OFFSET_TO_POINTER(Image->Base, Image->Pe.AddressOfEntryPointOffset), 1, NULL);
+    if (ISERR(task))
     {
-        DbgLog("LdrLoadPe(): Failed to open PE File", LOG_FAIL);
-        return NULL;
+        DbgLog("LdrStartPe(): Could not create a thread for the image", LOG_FAIL);
+        LdrUnloadImage(Image);
+        return STATUS_NO_MEMORY;
     }
+
+    // The thread cannot exit before this, that takes the kernel lock the caller holds
+    Image->Owner = task;
+    return STATUS_SUCCESS;
 }
 
 NTSTATUS LdrExecBat(const char *path)
@@ -370,7 +804,15 @@ NTSTATUS LdrExecBat(const char *path)
 	if (fd)
 	{
 		char data[100];
-		fread(data, 99, 1, fd);
+		struct file_stat stat;
+		uint32_t size = 0;
+		if (fstat(fd, &stat) == 0)
+		{
+			size = stat.filesize < sizeof(data) - 1 ? stat.filesize : sizeof(data) - 1;
+			fread(data, size, 1, fd);
+		}
+		data[size] = 0x00;
+		fclose(fd);
 
         char *line = strtok(data, "\r\n");  // Tokenize by newlines (\r\n or \n)
         while (line != NULL) {
@@ -9,6 +9,7 @@
 #include "../ke/base.h"
 #include "../ke/memory/heap/kheap.h"
 #include "../ke/memory/paging/paging.h"
+#include "../ke/memory/frame/frame.h"
 #include "../ke/memory/memory.h"
 #include "../ke/disk/disk.h"
 #include "../ke/fs/pparser.h"
@@ -33,6 +34,7 @@
 #define IMAGE_REL_BASED_HIGHLOW 3
 #define IMAGE_REL_BASED_DIR64 10
 #define IMAGE_REL_BASED_DIR32 6
+#define IMAGE_SCN_MEM_WRITE 0x80000000
 
 #define HIWORD(l) ((WORD)((DWORD)(l) >> 16))
 #define LOWORD(l) ((WORD)((DWORD)(l) & 0xFFFF))
@@ -42,7 +44,13 @@ typedef unsigned long DWORD64;
 typedef DWORD64 DWORD_PTR;
 typedef DWORD64* PDWORD64;
 
+struct task;
+
 LPVOID LdrLoadPe(const LPSTR path);
+NTSTATUS LdrStartPe(const LPSTR path);
+NTSTATUS LdrUnloadPe(LPVOID Address);
+VOID LdrReleaseTask(struct task* Task);
+NTSTATUS LdrHandlePageFault(ULONG Address, ULONG ErrorCode);
 NTSTATUS LdrExecBat(const char *path);
 
 #endif
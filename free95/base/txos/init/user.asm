@@ -1,4 +1,5 @@
 global jump_usermode
+global KiThreadExit
 extern KiUserInit
 jump_usermode:
 	mov ax, (4 * 8) | 3 ; ring 3 data with bottom 2 bits set for ring 3
@@ -15,3 +16,9 @@ jump_usermode:
 	push (3 * 8) | 3 ; code selector (ring 3 code with bottom 2 bits set for ring 3)
 	push KiUserInit ; instruction address to return to
 	iret
+
+; Threads return here from their entry point and end themselves
+KiThreadExit:
+	mov eax, 0x06
+	int 0x2e
+	jmp $
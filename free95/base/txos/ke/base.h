@@ -229,9 +229,13 @@ typedef enum _SHUTDOWN_ACTION
 } SHUTDOWN_ACTION, *PSHUTDOWN_ACTION;
 
 #define STATUS_SUCCESS 0x00000000
+#define STATUS_TIMEOUT ((NTSTATUS)0x00000102L)
 #define STATUS_OBJECT_NAME_NOT_FOUND 0xC0000034
 #define STATUS_INVALID_SYSTEM_SERVICE 0xC000001C
 #define STATUS_NOT_SUPPORTED ((NTSTATUS)0xC00000BBL)
 #define STATUS_INVALID_PARAMETER ((NTSTATUS)0xC000000DL)
+#define STATUS_ACCESS_VIOLATION ((NTSTATUS)0xC0000005L)
+#define STATUS_NO_MEMORY ((NTSTATUS)0xC0000017L)
+#define STATUS_INVALID_IMAGE_FORMAT ((NTSTATUS)0xC000007BL)
 
 #endif
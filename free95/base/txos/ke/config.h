@@ -6,30 +6,113 @@
 #define KERNEL_DATA_SELECTOR 0x10
 #define FREE95_TOTAL_INTERRUPTS 512
 
-/* 100MB heap size */
+/* 100MB heap size, the addresses can be overridden by the hosted heap benchmark */
 #define FREE95_HEAP_SIZE_BYTES 104857600
 #define FREE95_HEAP_BLOCK_SIZE 4096
+#ifndef FREE95_HEAP_ADDRESS
 #define FREE95_HEAP_ADDRESS 0x01000000
+#endif
+#ifndef FREE95_HEAP_TABLE_ADDRESS
 #define FREE95_HEAP_TABLE_ADDRESS 0x00007E00
+#endif
+
+/* Identity mapped by the tables every address space shares */
+#define FREE95_KERNEL_IDENTITY_END (FREE95_HEAP_ADDRESS + FREE95_HEAP_SIZE_BYTES)
+
+/* Ranges with more pages than this flush the whole TLB instead of using invlpg */
+#define FREE95_PAGING_INVLPG_THRESHOLD 32
+
+/* Physical frames, managed above the kernel heap up to this address */
+#define FREE95_FRAME_MEMORY_LIMIT 0x80000000
+#define FREE95_FRAME_MAX_ORDER 10
+/* Taken from the kernel heap when there is less memory than this above it */
+#define FREE95_FRAME_MIN_BYTES 0x800000
+
+/* Slab caches for small kernel objects, 16 to 2048 bytes in powers of two */
+#define FREE95_SLAB_MIN_OBJECT_SIZE 16
+#define FREE95_SLAB_MAX_OBJECT_SIZE 2048
+#define FREE95_SLAB_TOTAL_CLASSES 8
+#define FREE95_SLAB_MIN_OBJECTS 8
+#define FREE95_SLAB_MAX_EMPTY 1
+
+/* memcpy below this size skips the SSE2 loop */
+#define FREE95_MEMORY_SSE_THRESHOLD 256
 
 #define FREE95_SECTOR_SIZE 512
+/* The ATA sector count register allows up to 256 sectors per command */
+#define FREE95_DISK_MAX_SECTORS_PER_COMMAND 256
+/* Use bus master DMA when a PCI IDE controller supports it */
+#define FREE95_DISK_USE_DMA 1
+/* Runs of uncached sectors DiskReadBlk queues before waiting for them */
+#define FREE95_DISK_QUEUE_DEPTH 8
+/* Read-ahead requests that can be in flight at once, and the sectors each one reads */
+#define FREE95_DISK_PREFETCH_SLOTS 4
+#define FREE95_DISK_PREFETCH_SECTORS 128
+
+/* Sectors kept by the disk block cache, the bucket count must be a power of two */
+#define FREE95_BLOCK_CACHE_SECTORS 2048
+#define FREE95_BLOCK_CACHE_BUCKETS 512
+/* Runs of at least this many sectors read by DiskReadBlk bypass the cache */
+#define FREE95_BLOCK_CACHE_MAX_RUN 64
+/* Dirty sectors DiskWriteBlk lets build up before it writes them back, and how many are written per batch */
+#define FREE95_BLOCK_CACHE_DIRTY_LIMIT 1024
+#define FREE95_BLOCK_CACHE_FLUSH_BATCH 256
 
 #define FREE95_MAX_PATH 108
 
 #define FREE95_MAX_FILESYSTEMS 12
 #define FREE95_MAX_FILE_DESCRIPTORS 512
+/* Resolved paths remembered by fopen, including paths that do not exist */
+#define FREE95_DENTRY_CACHE_SIZE 64
+/* Largest read-ahead window of a sequentially read file, in bytes */
+#define FREE95_FS_READAHEAD_MAX 0x10000
+/* Bytes a file descriptor buffers past the end of its clusters before it allocates clusters for them */
+#define FREE95_FS_WRITE_BUFFER_MAX 0x10000
 
-#define FREE95_TOTAL_GDT_SEGMENTS 6
+/* CPUs started on SMP machines, each one has a TSS segment at the end of the GDT */
+#define FREE95_MAX_CPUS 8
+#define FREE95_TOTAL_GDT_SEGMENTS (5 + FREE95_MAX_CPUS)
 
 #define FREE95_PROGRAM_VIRTUAL_ADDRESS 0x400000
 #define FREE95_USER_PROGRAM_STACK_SIZE 1024 * 16
 #define FREE95_PROGRAM_VIRTUAL_STACK_ADDRESS_START 0x3FF000
 #define FREE95_PROGRAM_VIRTUAL_STACK_ADDRESS_END FREE95_PROGRAM_VIRTUAL_ADDRESS_START - FREE95_USER_PROGRAM_STACK_SIZE
 
+/* PE images are placed here and read from their file when a page is first touched */
+#define FREE95_IMAGE_VIRTUAL_ADDRESS 0xA0000000
+#define FREE95_IMAGE_VIRTUAL_SIZE 0x10000000
+#define FREE95_IMAGE_ALIGNMENT 0x10000
+
 #define FREE95_MAX_PROGRAM_ALLOCATIONS 1024
 #define FREE95_MAX_PROCESSES 12
 
 #define USER_DATA_SEGMENT 0x23
 #define USER_CODE_SEGMENT 0x1b
 
+/* Timer interrupts per second, and how many of them a task runs before the next ready task gets the CPU */
+#define FREE95_SCHED_HZ 100
+#define FREE95_SCHED_QUANTUM 2
+/* Priorities run from 0 to 31 like NT, 16 and above are realtime and never boosted */
+#define FREE95_PRIORITY_LEVELS 32
+#define FREE95_PRIORITY_NORMAL 8
+#define FREE95_PRIORITY_REALTIME 16
+/* Priority boosts for finished disk requests and keyboard input */
+#define FREE95_PRIORITY_BOOST_DISK 1
+#define FREE95_PRIORITY_BOOST_KEYBOARD 6
+/* Every task has its own kernel stack, interrupts and system calls from ring 3 run on it */
+#define FREE95_TASK_KERNEL_STACK_SIZE 1024 * 16
+/* Real mode code the other CPUs start in, it has to be page aligned and below 1MB */
+#define FREE95_SMP_TRAMPOLINE_ADDRESS 0x70000
+/* Stack a CPU starts on before it switches to its idle task */
+#define FREE95_SMP_BOOT_STACK_SIZE 4096
+/* PIT ticks the local APIC timer is measured against */
+#define FREE95_SMP_CALIBRATION_TICKS 10
+/* Interrupt vectors of the local APIC timer and of its spurious interrupts */
+#define FREE95_APIC_TIMER_VECTOR 0x40
+#define FREE95_APIC_SPURIOUS_VECTOR 0xFF
+/* Bytes buffered in each direction of the COM1 debug port */
+#define FREE95_SERIAL_BUFFER_SIZE 1024
+/* The shell redraws at least this often in milliseconds while it waits for keys */
+#define FREE95_SHELL_REFRESH_MS 50
+
 #endif
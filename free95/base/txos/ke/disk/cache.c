@@ -0,0 +1,367 @@
+/*++
+
+Free95 20x/TX Kernel
+
+You may only use this code if you agree to the terms of the Free95 Source Code License agreement (GNU GPL v3) (see LICENSE).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    cache.c
+
+Abstract:
+
+    This module implements the disk block cache.
+    Sectors read through DiskReadBlk() are kept in a fixed pool, found
+    through a hash table keyed by disk and LBA and evicted in LRU order.
+    Sectors written through DiskWriteBlk() stay dirty in the pool and
+    are not evicted until diskcache_flush() writes them back.
+
+--*/
+
+#include "cache.h"
+#include "../config.h"
+#include "../status.h"
+#include "../memory/memory.h"
+#include "../memory/heap/kheap.h"
+
+static struct disk_cache_entry* diskcache_entries = 0;
+static char* diskcache_data = 0;
+static uint32_t diskcache_buckets[FREE95_BLOCK_CACHE_BUCKETS];
+static uint32_t diskcache_lru_head = DISKCACHE_NONE;
+static uint32_t diskcache_lru_tail = DISKCACHE_NONE;
+static struct disk_cache_stats diskcache_stats;
+
+static uint32_t diskcache_hash(int disk_id, unsigned int lba)
+{
+    return ((lba * 0x9E3779B1) ^ disk_id) & (FREE95_BLOCK_CACHE_BUCKETS - 1);
+}
+
+static void diskcache_lru_remove(uint32_t index)
+{
+    struct disk_cache_entry* entry = &diskcache_entries[index];
+    if (entry->lru_prev != DISKCACHE_NONE)
+    {
+        diskcache_entries[entry->lru_prev].lru_next = entry->lru_next;
+    }
+    else
+    {
+        diskcache_lru_head = entry->lru_next;
+    }
+
+    if (entry->lru_next != DISKCACHE_NONE)
+    {
+        diskcache_entries[entry->lru_next].lru_prev = entry->lru_prev;
+    }
+    else
+    {
+        diskcache_lru_tail = entry->lru_prev;
+    }
+}
+
+static void diskcache_lru_push(uint32_t index)
+{
+    struct disk_cache_entry* entry = &diskcache_entries[index];
+    entry->lru_prev = DISKCACHE_NONE;
+    entry->lru_next = diskcache_lru_head;
+    if (diskcache_lru_head != DISKCACHE_NONE)
+    {
+        diskcache_entries[diskcache_lru_head].lru_prev = index;
+    }
+    else
+    {
+        diskcache_lru_tail = index;
+    }
+    diskcache_lru_head = index;
+}
+
+static void diskcache_lru_append(uint32_t index)
+{
+    struct disk_cache_entry* entry = &diskcache_entries[index];
+    entry->lru_next = DISKCACHE_NONE;
+    entry->lru_prev = diskcache_lru_tail;
+    if (diskcache_lru_tail != DISKCACHE_NONE)
+    {
+        diskcache_entries[diskcache_lru_tail].lru_next = index;
+    }
+    else
+    {
+        diskcache_lru_head = index;
+    }
+    diskcache_lru_tail = index;
+}
+
+static void diskcache_hash_remove(uint32_t index)
+{
+    struct disk_cache_entry* entry = &diskcache_entries[index];
+    uint32_t* link = &diskcache_buckets[diskcache_hash(entry->disk_id, entry->lba)];
+    while (*link != DISKCACHE_NONE)
+    {
+        if (*link == index)
+        {
+            *link = entry->hash_next;
+            break;
+        }
+        link = &diskcache_entries[*link].hash_next;
+    }
+
+    entry->valid = false;
+}
+
+static uint32_t diskcache_find(int disk_id, unsigned int lba)
+{
+    if (!diskcache_entries)
+    {
+        return DISKCACHE_NONE;
+    }
+
+    uint32_t index = diskcache_buckets[diskcache_hash(disk_id, lba)];
+    while (index != DISKCACHE_NONE)
+    {
+        struct disk_cache_entry* entry = &diskcache_entries[index];
+        if (entry->lba == lba && entry->disk_id == disk_id)
+        {
+            break;
+        }
+        index = entry->hash_next;
+    }
+
+    return index;
+}
+
+int diskcache_init()
+{
+    int res = 0;
+    diskcache_entries = kzalloc(FREE95_BLOCK_CACHE_SECTORS * sizeof(struct disk_cache_entry));
+    diskcache_data = kmalloc(FREE95_BLOCK_CACHE_SECTORS * FREE95_SECTOR_SIZE);
+    if (!diskcache_entries || !diskcache_data)
+    {
+        kfree(diskcache_entries);
+        kfree(diskcache_data);
+        diskcache_entries = 0;
+        diskcache_data = 0;
+        res = -ENOMEM;
+        goto out;
+    }
+
+    for (int i = 0; i < FREE95_BLOCK_CACHE_BUCKETS; i++)
+    {
+        diskcache_buckets[i] = DISKCACHE_NONE;
+    }
+
+    // Every entry starts out unused at the cold end of the LRU list
+    for (uint32_t i = 0; i < FREE95_BLOCK_CACHE_SECTORS; i++)
+    {
+        diskcache_lru_append(i);
+    }
+
+    memset(&diskcache_stats, 0, sizeof(diskcache_stats));
+out:
+    return res;
+}
+
+/**
+ * Copies the sector into buf and returns true if it is cached
+ */
+bool diskcache_read(struct disk* disk, unsigned int lba, void* buf)
+{
+    uint32_t index = diskcache_find(disk->id, lba);
+    if (index == DISKCACHE_NONE)
+    {
+        diskcache_stats.misses++;
+        return false;
+    }
+
+    diskcache_lru_remove(index);
+    diskcache_lru_push(index);
+    memcpy(buf, diskcache_data + (index * FREE95_SECTOR_SIZE), FREE95_SECTOR_SIZE);
+    diskcache_stats.hits++;
+    return true;
+}
+
+bool diskcache_contains(struct disk* disk, unsigned int lba)
+{
+    return diskcache_find(disk->id, lba) != DISKCACHE_NONE;
+}
+
+/**
+ * Returns the entry holding the sector, reusing the least recently used
+ * clean entry if it is not cached. Fails when every entry is dirty.
+ */
+static uint32_t diskcache_claim(struct disk* disk, unsigned int lba)
+{
+    if (!diskcache_entries)
+    {
+        return DISKCACHE_NONE;
+    }
+
+    uint32_t index = diskcache_find(disk->id, lba);
+    if (index != DISKCACHE_NONE)
+    {
+        return index;
+    }
+
+    // Dirty entries are pinned until they are written back
+    index = diskcache_lru_tail;
+    while (index != DISKCACHE_NONE && diskcache_entries[index].dirty)
+    {
+        index = diskcache_entries[index].lru_prev;
+    }
+
+    if (index == DISKCACHE_NONE)
+    {
+        return DISKCACHE_NONE;
+    }
+
+    struct disk_cache_entry* entry = &diskcache_entries[index];
+    if (entry->valid)
+    {
+        diskcache_hash_remove(index);
+        diskcache_stats.evictions++;
+    }
+
+    uint32_t bucket = diskcache_hash(disk->id, lba);
+    entry->disk_id = disk->id;
+    entry->lba = lba;
+    entry->valid = true;
+    entry->hash_next = diskcache_buckets[bucket];
+    diskcache_buckets[bucket] = index;
+    return index;
+}
+
+void diskcache_insert(struct disk* disk, unsigned int lba, void* buf)
+{
+    uint32_t index = diskcache_claim(disk, lba);
+    if (index == DISKCACHE_NONE)
+    {
+        return;
+    }
+
+    diskcache_lru_remove(index);
+    diskcache_lru_push(index);
+
+    // Data read from the disk is older than a write that has not reached it
+    if (diskcache_entries[index].dirty)
+    {
+        return;
+    }
+    memcpy(diskcache_data + (index * FREE95_SECTOR_SIZE), buf, FREE95_SECTOR_SIZE);
+}
+
+/**
+ * Stores a written sector, returns false when the cache is full of dirty
+ * sectors and the caller has to write it through.
+ */
+bool diskcache_write(struct disk* disk, unsigned int lba, void* buf)
+{
+    uint32_t index = diskcache_claim(disk, lba);
+    if (index == DISKCACHE_NONE)
+    {
+        return false;
+    }
+
+    struct disk_cache_entry* entry = &diskcache_entries[index];
+    if (!entry->dirty)
+    {
+        entry->dirty = true;
+        diskcache_stats.dirty++;
+    }
+
+    diskcache_lru_remove(index);
+    diskcache_lru_push(index);
+    memcpy(diskcache_data + (index * FREE95_SECTOR_SIZE), buf, FREE95_SECTOR_SIZE);
+    return true;
+}
+
+uint32_t diskcache_get_dirty_count()
+{
+    return diskcache_stats.dirty;
+}
+
+/**
+ * Writes the dirty sectors of the disk back. Every sector is its own
+ * request, the queue sorts them and merges neighbours into one command.
+ */
+int diskcache_flush(struct disk* disk)
+{
+    int res = 0;
+    if (!diskcache_entries || diskcache_stats.dirty == 0)
+    {
+        goto out;
+    }
+
+    struct disk_request* requests = kzalloc(FREE95_BLOCK_CACHE_FLUSH_BATCH * sizeof(struct disk_request));
+    uint32_t* indexes = kmalloc(FREE95_BLOCK_CACHE_FLUSH_BATCH * sizeof(uint32_t));
+    if (!requests || !indexes)
+    {
+        kfree(requests);
+        kfree(indexes);
+        res = -ENOMEM;
+        goto out;
+    }
+
+    uint32_t index = 0;
+    while (index < FREE95_BLOCK_CACHE_SECTORS)
+    {
+        int queued = 0;
+        for (; index < FREE95_BLOCK_CACHE_SECTORS && queued < FREE95_BLOCK_CACHE_FLUSH_BATCH; index++)
+        {
+            struct disk_cache_entry* entry = &diskcache_entries[index];
+            if (!entry->dirty || entry->disk_id != disk->id)
+            {
+                continue;
+            }
+
+            struct disk_request* request = &requests[queued];
+            memset(request, 0, sizeof(struct disk_request));
+            request->lba = entry->lba;
+            request->total = 1;
+            request->buf = diskcache_data + (index * FREE95_SECTOR_SIZE);
+            request->write = true;
+            indexes[queued++] = index;
+            DiskSubmit(request);
+        }
+
+        for (int i = 0; i < queued; i++)
+        {
+            if (DiskWait(&requests[i]) < 0)
+            {
+                res = -EIO;
+                continue;
+            }
+
+            diskcache_entries[indexes[i]].dirty = false;
+            diskcache_stats.dirty--;
+        }
+    }
+
+    kfree(requests);
+    kfree(indexes);
+out:
+    return res;
+}
+
+void diskcache_invalidate(struct disk* disk, unsigned int lba)
+{
+    uint32_t index = diskcache_find(disk->id, lba);
+    if (index == DISKCACHE_NONE)
+    {
+        return;
+    }
+
+    if (diskcache_entries[index].dirty)
+    {
+        diskcache_entries[index].dirty = false;
+        diskcache_stats.dirty--;
+    }
+
+    diskcache_hash_remove(index);
+    diskcache_lru_remove(index);
+    diskcache_lru_append(index);
+}
+
+void diskcache_get_stats(struct disk_cache_stats* stats)
+{
+    *stats = diskcache_stats;
+}
@@ -0,0 +1,45 @@
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include "disk.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DISKCACHE_NONE 0xFFFFFFFF
+
+struct disk_cache_entry
+{
+    // Disk id and sector, valid while the entry is in a hash chain
+    int disk_id;
+    unsigned int lba;
+    bool valid;
+    // Written but not on the disk yet, dirty entries are never evicted
+    bool dirty;
+
+    // Next entry in the same hash bucket
+    uint32_t hash_next;
+
+    // Neighbours in the LRU list, most recently used first
+    uint32_t lru_next;
+    uint32_t lru_prev;
+};
+
+struct disk_cache_stats
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t dirty;
+};
+
+int diskcache_init();
+bool diskcache_read(struct disk* disk, unsigned int lba, void* buf);
+bool diskcache_contains(struct disk* disk, unsigned int lba);
+void diskcache_insert(struct disk* disk, unsigned int lba, void* buf);
+bool diskcache_write(struct disk* disk, unsigned int lba, void* buf);
+uint32_t diskcache_get_dirty_count();
+int diskcache_flush(struct disk* disk);
+void diskcache_invalidate(struct disk* disk, unsigned int lba);
+void diskcache_get_stats(struct disk_cache_stats* stats);
+
+#endif
@@ -18,44 +18,362 @@ Abstract:
 
 #include "../io/io.h"
 #include "disk.h"
+#include "cache.h"
+#include "dma.h"
 #include "../config.h"
 #include "../status.h"
 #include "../memory/memory.h"
+#include "../memory/heap/kheap.h"
+#include "../memory/paging/paging.h"
+#include "../sync/sync.h"
+#include <stdint.h>
+#include <stdbool.h>
 
 struct disk disk;
 
-int disk_read_sector(int lba, int total, void* buf)
+static struct disk_queue disk_queue;
+
+// Requests covered by the run in flight, the first one is being filled
+static struct disk_request* disk_active;
+static unsigned int disk_active_lba;
+static int disk_active_left;
+static int disk_command_left;
+static bool disk_command_dma;
+
+// Next sector a PIO write command sends, and how many it has sent
+static struct disk_request* disk_write_request;
+static int disk_write_offset;
+static int disk_command_sent;
+
+// Read-ahead requests in flight, their sectors reach the block cache when they are reaped
+struct disk_prefetch
+{
+    struct disk_request request;
+    bool busy;
+};
+
+static struct disk_prefetch disk_prefetches[FREE95_DISK_PREFETCH_SLOTS];
+
+static uint32_t disk_lock()
 {
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static void disk_unlock(uint32_t flags)
+{
+    if (flags & 0x200)
+    {
+        asm volatile("sti" : : : "memory");
+    }
+}
+
+// Reading the alternate status four times gives the drive the 400ns it needs to update the status
+static void disk_delay()
+{
+    for (int i = 0; i < 4; i++)
+    {
+        insb(0x3F6);
+    }
+}
+
+static void disk_send_sector()
+{
+    struct disk_request* request = disk_write_request;
+    outsw_rep(0x1F0, request->buf + (disk_write_offset * FREE95_SECTOR_SIZE), FREE95_SECTOR_SIZE / 2);
+    disk_delay();
+    disk_command_sent++;
+
+    if (++disk_write_offset == request->total)
+    {
+        disk_write_request = request->next;
+        disk_write_offset = 0;
+    }
+}
+
+static void disk_issue_command()
+{
+    int total = disk_active_left > FREE95_DISK_MAX_SECTORS_PER_COMMAND ? FREE95_DISK_MAX_SECTORS_PER_COMMAND : disk_active_left;
+    unsigned int lba = disk_active_lba;
+
+    bool write = disk_active->write;
+
+    // Buffers DMA cannot reach are transferred with PIO instead
+    disk_command_dma = diskdma_available() && diskdma_prepare(disk_active, total) == 0;
+    disk_command_left = total;
+    disk_command_sent = 0;
     outb(0x1F6, (lba >> 24) | 0xE0);
-    outb(0x1F2, total);
+    // A count of zero asks for 256 sectors
+    outb(0x1F2, total & 0xFF);
     outb(0x1F3, (unsigned char)(lba & 0xff));
     outb(0x1F4, (unsigned char)(lba >> 8));
     outb(0x1F5, (unsigned char)(lba >> 16));
-    outb(0x1F7, 0x20);
+    if (write)
+    {
+        outb(0x1F7, disk_command_dma ? 0xCA : 0x30);
+    }
+    else
+    {
+        outb(0x1F7, disk_command_dma ? 0xC8 : 0x20);
+    }
 
-    unsigned short* ptr = (unsigned short*) buf;
-    for (int b = 0; b < total; b++)
+    if (disk_command_dma)
     {
-        // Wait for the buffer to be ready
-        char c = insb(0x1F7);
-        while(!(c & 0x08))
+        diskdma_start(write);
+        return;
+    }
+
+    if (write)
+    {
+        // The drive asks for the first sector without an interrupt
+        disk_write_request = disk_active;
+        disk_write_offset = disk_active->done;
+        disk_delay();
+
+        unsigned char c = insb(0x3F6);
+        while ((c & 0x80) && !(c & 0x21))
         {
-            c = insb(0x1F7);
+            c = insb(0x3F6);
         }
 
-        // Copy from hard disk to memory
-        for (int i = 0; i < 256; i++)
+        if (c & 0x08)
         {
-            *ptr = insw(0x1F0);
-            ptr++;
+            disk_send_sector();
         }
+    }
+}
+
+static void disk_complete(struct disk_request* request, int status)
+{
+    request->status = status;
+    request->complete = 1;
 
+    // The waiter runs no earlier than the interrupt returns, the callback may still reuse the request
+    KeSetEvent(&request->event, FREE95_PRIORITY_BOOST_DISK, TRUE);
+    if (request->callback)
+    {
+        request->callback(request);
     }
-    return 0;
+}
+
+static void disk_start()
+{
+    if (disk_active)
+    {
+        return;
+    }
+
+    disk_active = diskqueue_next(&disk_queue, &disk_active_left);
+    if (disk_active)
+    {
+        disk_active_lba = disk_active->lba;
+        disk_issue_command();
+    }
+}
+
+static void disk_fail()
+{
+    struct disk_request* request = disk_active;
+    disk_active = 0;
+    while (request)
+    {
+        struct disk_request* next = request->next;
+        disk_complete(request, -EIO);
+        request = next;
+    }
+
+    disk_start();
+}
+
+/**
+ * Credits the requests of the active run with the sectors that arrived,
+ * completes the ones that are full and moves on to the next command.
+ */
+static void disk_advance(int sectors)
+{
+    disk_active_lba += sectors;
+    disk_active_left -= sectors;
+    disk_command_left -= sectors;
+
+    while (sectors > 0 && disk_active)
+    {
+        struct disk_request* request = disk_active;
+        int taken = request->total - request->done;
+        if (taken > sectors)
+        {
+            taken = sectors;
+        }
+
+        request->done += taken;
+        sectors -= taken;
+        if (request->done == request->total)
+        {
+            // The callback may reuse the request, so unlink it first
+            disk_active = request->next;
+            disk_complete(request, 0);
+        }
+    }
+
+    if (disk_active_left == 0)
+    {
+        disk_active = 0;
+        disk_start();
+    }
+    else if (disk_command_left == 0)
+    {
+        disk_issue_command();
+    }
+}
+
+/**
+ * Moves one sector between the drive and the active request, or retires the
+ * whole command once a DMA transfer or the last written sector has finished.
+ * Called from the IRQ14 handler, or in a loop while interrupts are disabled.
+ */
+static void disk_service()
+{
+    if (!disk_active)
+    {
+        return;
+    }
+
+    if (disk_command_dma && !diskdma_done())
+    {
+        return;
+    }
+
+    // Reading the status register also acknowledges the interrupt
+    unsigned char c = insb(0x1F7);
+    if (c & 0x80)
+    {
+        return;
+    }
+
+    if (disk_command_dma)
+    {
+        // Error and drive fault bits are only valid once BSY is clear
+        if (diskdma_finish() < 0 || (c & 0x21))
+        {
+            disk_fail();
+            return;
+        }
+
+        disk_advance(disk_command_left);
+        return;
+    }
+
+    if (c & 0x21)
+    {
+        disk_fail();
+        return;
+    }
+
+    if (disk_active->write)
+    {
+        if (c & 0x08)
+        {
+            if (disk_command_sent < disk_command_left)
+            {
+                disk_send_sector();
+            }
+            return;
+        }
+
+        // Without DRQ after the last sector the drive has stored everything
+        if (disk_command_sent == disk_command_left)
+        {
+            disk_advance(disk_command_left);
+        }
+        return;
+    }
+
+    if (!(c & 0x08))
+    {
+        return;
+    }
+
+    struct disk_request* request = disk_active;
+    insw_rep(0x1F0, request->buf + (request->done * FREE95_SECTOR_SIZE), FREE95_SECTOR_SIZE / 2);
+    disk_delay();
+    disk_advance(1);
+}
+
+void DiskInterrupt()
+{
+    disk_service();
+}
+
+/**
+ * Queues a transfer of request->total sectors starting at request->lba, into
+ * request->buf or out of it for writes.
+ * The callback runs once the request is complete, the caller may also wait with DiskWait.
+ */
+void DiskSubmit(struct disk_request* request)
+{
+    request->done = 0;
+    request->status = 0;
+    request->complete = 0;
+    request->next = 0;
+    request->directory = paging_current_directory();
+    KeInitializeEvent(&request->event, NotificationEvent, FALSE);
+
+    if (request->total <= 0)
+    {
+        disk_complete(request, request->total < 0 ? -EINVARG : 0);
+        return;
+    }
+
+    uint32_t flags = disk_lock();
+    diskqueue_insert(&disk_queue, request);
+    disk_start();
+    disk_unlock(flags);
+}
+
+int DiskWait(struct disk_request* request)
+{
+    // Tasks sleep until the interrupt completes the request
+    if (KeCanWait())
+    {
+        KeWaitForSingleObject(&request->event, 0);
+        return request->status;
+    }
+
+    // Before the scheduler runs the CPU halts between interrupts instead
+    uint32_t flags = disk_lock();
+    while (!request->complete)
+    {
+        if (flags & 0x200)
+        {
+            // sti only takes effect after hlt, so the interrupt cannot slip in between
+            asm volatile("sti; hlt; cli" : : : "memory");
+        }
+
+        // Also covers interrupts that were lost or arrived while they were disabled
+        disk_service();
+    }
+    disk_unlock(flags);
+
+    return request->status;
 }
 
 void DiskInit()
 {
+    // The filesystem is resolved through the cache, so it has to exist first
+    diskcache_init();
+    diskqueue_init(&disk_queue);
+
+    // Clear nIEN so the drive raises IRQ14 for every sector
+    outb(0x3F6, 0x00);
+
+    // Without a bus mastering IDE controller every read stays PIO
+    diskdma_init();
+
+    for (int i = 0; i < FREE95_DISK_PREFETCH_SLOTS; i++)
+    {
+        disk_prefetches[i].request.buf = kmalloc(FREE95_DISK_PREFETCH_SECTORS * FREE95_SECTOR_SIZE);
+    }
+
     memset(&disk, 0, sizeof(disk));
     disk.type = FREE95_DISK_TYPE_REAL;
     disk.sector_size = FREE95_SECTOR_SIZE;
@@ -71,6 +389,120 @@ struct disk* GetDisk(int index)
     return &disk;
 }
 
+/**
+ * Moves finished read-ahead into the block cache. Read-ahead that overlaps
+ * lba to lba + total is waited for first, so the caller finds it cached.
+ */
+static void disk_prefetch_reap(unsigned int lba, int total)
+{
+    for (int i = 0; i < FREE95_DISK_PREFETCH_SLOTS; i++)
+    {
+        struct disk_prefetch* prefetch = &disk_prefetches[i];
+        struct disk_request* request = &prefetch->request;
+        if (!prefetch->busy)
+        {
+            continue;
+        }
+
+        bool overlaps = request->lba < lba + total && lba < request->lba + request->total;
+        if (!request->complete && !overlaps)
+        {
+            continue;
+        }
+
+        if (DiskWait(request) == 0)
+        {
+            for (int k = 0; k < request->total; k++)
+            {
+                diskcache_insert(&disk, request->lba + k, request->buf + (k * FREE95_SECTOR_SIZE));
+            }
+        }
+        prefetch->busy = false;
+    }
+}
+
+static struct disk_prefetch* disk_prefetch_find(unsigned int lba)
+{
+    for (int i = 0; i < FREE95_DISK_PREFETCH_SLOTS; i++)
+    {
+        struct disk_prefetch* prefetch = &disk_prefetches[i];
+        if (prefetch->busy && prefetch->request.lba <= lba && lba < prefetch->request.lba + prefetch->request.total)
+        {
+            return prefetch;
+        }
+    }
+
+    return 0;
+}
+
+static struct disk_prefetch* disk_prefetch_get_free()
+{
+    for (int i = 0; i < FREE95_DISK_PREFETCH_SLOTS; i++)
+    {
+        struct disk_prefetch* prefetch = &disk_prefetches[i];
+        if (!prefetch->busy && prefetch->request.buf)
+        {
+            return prefetch;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Starts reading sectors into the block cache without waiting for them.
+ * Sectors that are cached or already being read ahead are skipped, and the
+ * rest is dropped once every slot is busy.
+ */
+void DiskPrefetch(struct disk* idisk, unsigned int lba, int total)
+{
+    if (idisk != &disk)
+    {
+        return;
+    }
+
+    disk_prefetch_reap(0, 0);
+    while (total > 0)
+    {
+        if (diskcache_contains(idisk, lba))
+        {
+            lba++;
+            total--;
+            continue;
+        }
+
+        struct disk_prefetch* pending = disk_prefetch_find(lba);
+        if (pending)
+        {
+            int skip = pending->request.lba + pending->request.total - lba;
+            lba += skip;
+            total -= skip;
+            continue;
+        }
+
+        struct disk_prefetch* prefetch = disk_prefetch_get_free();
+        if (!prefetch)
+        {
+            break;
+        }
+
+        int count = total > FREE95_DISK_PREFETCH_SECTORS ? FREE95_DISK_PREFETCH_SECTORS : total;
+        prefetch->request.lba = lba;
+        prefetch->request.total = count;
+        prefetch->request.callback = 0;
+        prefetch->busy = true;
+        DiskSubmit(&prefetch->request);
+
+        lba += count;
+        total -= count;
+    }
+}
+
+/**
+ * Cached sectors are copied from the block cache, the runs of missing
+ * sectors are queued together so the elevator can order them, and are
+ * added to the cache once they are in.
+ */
 int DiskReadBlk(struct disk* idisk, unsigned int lba, int total, void* buf)
 {
     if (idisk != &disk)
@@ -78,5 +510,131 @@ int DiskReadBlk(struct disk* idisk, unsigned int lba, int total, void* buf)
         return -EIO;
     }
 
-    return disk_read_sector(lba, total, buf);
+    // Read-ahead of these sectors has to land in the cache before it is searched
+    disk_prefetch_reap(lba, total);
+
+    int res = 0;
+    char* ptr = buf;
+    struct disk_request requests[FREE95_DISK_QUEUE_DEPTH];
+    int i = 0;
+    while (i < total)
+    {
+        int queued = 0;
+        while (i < total && queued < FREE95_DISK_QUEUE_DEPTH)
+        {
+            if (diskcache_read(idisk, lba + i, ptr + (i * FREE95_SECTOR_SIZE)))
+            {
+                i++;
+                continue;
+            }
+
+            int run = 1;
+            while (i + run < total && !diskcache_contains(idisk, lba + i + run))
+            {
+                run++;
+            }
+
+            struct disk_request* request = &requests[queued++];
+            memset(request, 0, sizeof(struct disk_request));
+            request->lba = lba + i;
+            request->total = run;
+            request->buf = ptr + (i * FREE95_SECTOR_SIZE);
+            DiskSubmit(request);
+            i += run;
+        }
+
+        for (int r = 0; r < queued; r++)
+        {
+            struct disk_request* request = &requests[r];
+            if (DiskWait(request) < 0)
+            {
+                res = -EIO;
+                continue;
+            }
+
+            // Long runs are streamed, copying them would only evict the cache
+            if (request->total >= FREE95_BLOCK_CACHE_MAX_RUN)
+            {
+                continue;
+            }
+
+            for (int k = 0; k < request->total; k++)
+            {
+                diskcache_insert(idisk, request->lba + k, request->buf + (k * FREE95_SECTOR_SIZE));
+            }
+        }
+
+        if (res < 0)
+        {
+            break;
+        }
+    }
+
+    return res;
+}
+
+/**
+ * Written sectors go to the block cache and reach the disk when it is flushed,
+ * which happens once too many of them are dirty or on DiskFlush.
+ */
+int DiskWriteBlk(struct disk* idisk, unsigned int lba, int total, void* buf)
+{
+    if (idisk != &disk)
+    {
+        return -EIO;
+    }
+
+    // Read-ahead of these sectors would bring the old data back into the cache
+    disk_prefetch_reap(lba, total);
+
+    int res = 0;
+    char* ptr = buf;
+    for (int i = 0; i < total; i++)
+    {
+        char* sector = ptr + (i * FREE95_SECTOR_SIZE);
+        if (diskcache_write(idisk, lba + i, sector))
+        {
+            continue;
+        }
+
+        // Every cache entry is dirty, write them back and try again
+        res = diskcache_flush(idisk);
+        if (res < 0)
+        {
+            break;
+        }
+
+        if (!diskcache_write(idisk, lba + i, sector))
+        {
+            struct disk_request request;
+            memset(&request, 0, sizeof(request));
+            request.lba = lba + i;
+            request.total = 1;
+            request.buf = sector;
+            request.write = true;
+            DiskSubmit(&request);
+            res = DiskWait(&request);
+            if (res < 0)
+            {
+                break;
+            }
+        }
+    }
+
+    if (res == 0 && diskcache_get_dirty_count() >= FREE95_BLOCK_CACHE_DIRTY_LIMIT)
+    {
+        res = diskcache_flush(idisk);
+    }
+
+    return res;
+}
+
+int DiskFlush(struct disk* idisk)
+{
+    if (idisk != &disk)
+    {
+        return -EIO;
+    }
+
+    return diskcache_flush(idisk);
 }
@@ -2,6 +2,7 @@
 #define DISK_H
 
 #include "../fs/file.h"
+#include "queue.h"
 
 typedef unsigned int FREE95_DISK_TYPE;
 
@@ -20,5 +21,11 @@ struct disk
 void DiskInit();
 struct disk *GetDisk(int index);
 int DiskReadBlk(struct disk *idisk, unsigned int lba, int total, void *buf);
+int DiskWriteBlk(struct disk *idisk, unsigned int lba, int total, void *buf);
+int DiskFlush(struct disk *idisk);
+void DiskPrefetch(struct disk *idisk, unsigned int lba, int total);
+void DiskSubmit(struct disk_request *request);
+int DiskWait(struct disk_request *request);
+void DiskInterrupt();
 
 #endif
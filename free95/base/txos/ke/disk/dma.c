@@ -0,0 +1,221 @@
+/*++
+
+Free95 20x/TX Kernel
+
+You may only use this code if you agree to the terms of the Free95 Source Code License agreement (GNU GPL v3) (see LICENSE).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    dma.c
+
+Abstract:
+
+    This module implements bus master DMA for the primary ATA channel
+    of a PCI IDE controller. The request buffers are translated page by
+    page into a PRD table, so sectors go straight into the caller's
+    memory without bounce buffers.
+
+--*/
+
+#include "dma.h"
+#include "../io/io.h"
+#include "../pci/pci.h"
+#include "../config.h"
+#include "../status.h"
+#include "../memory/frame/frame.h"
+#include "../memory/paging/paging.h"
+
+#define DISKDMA_TOTAL_PRDS (PAGING_PAGE_SIZE / sizeof(struct disk_prd))
+
+static unsigned short diskdma_base;
+static struct disk_prd* diskdma_prds;
+
+// Commands that went through PIO because a buffer could not be handed to the controller
+static uint32_t diskdma_fallbacks;
+
+int diskdma_init()
+{
+    int res = 0;
+    struct pci_device device;
+    if (!FREE95_DISK_USE_DMA || pci_find_class(PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_IDE, &device) < 0)
+    {
+        res = -EIO;
+        goto out;
+    }
+
+    // The driver talks to the legacy ports, so the primary channel has to be
+    // in compatibility mode and the controller has to be able to bus master
+    if ((device.prog_if & 0x01) || !(device.prog_if & 0x80))
+    {
+        res = -EIO;
+        goto out;
+    }
+
+    uint32_t bar = pci_read_bar(&device, 4);
+    if (!(bar & PCI_BAR_IO_SPACE) || (bar & 0xFFFC) == 0)
+    {
+        res = -EIO;
+        goto out;
+    }
+
+    // One page is dword aligned and never crosses a 64K boundary
+    diskdma_prds = frame_zalloc(PAGING_PAGE_SIZE);
+    if (!diskdma_prds)
+    {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    diskdma_base = bar & 0xFFFC;
+    pci_enable_bus_master(&device);
+    outb(diskdma_base + DISKDMA_COMMAND, 0);
+    outb(diskdma_base + DISKDMA_STATUS, DISKDMA_STATUS_ERROR | DISKDMA_STATUS_INTERRUPT);
+    outl(diskdma_base + DISKDMA_PRDT, (uint32_t)diskdma_prds);
+
+out:
+    return res;
+}
+
+uint32_t diskdma_fallback_count()
+{
+    return diskdma_fallbacks;
+}
+
+bool diskdma_available()
+{
+    return diskdma_prds != 0;
+}
+
+static int diskdma_translate(uint32_t* directory, char* ptr, bool write, uint32_t* phys_out)
+{
+    if (!directory)
+    {
+        *phys_out = (uint32_t)ptr;
+        return 0;
+    }
+
+    uint32_t entry = paging_get(directory, (void*)((uint32_t)ptr & 0xfffff000));
+    if (!(entry & PAGING_IS_PRESENT))
+    {
+        return -EINVARG;
+    }
+
+    // The drive writes physical memory, so the page has to be writeable.
+    // Task directories map the identity tables without the writeable bit, the kernel mapping decides for those
+    uint32_t phys = entry & 0xfffff000;
+    bool writeable = (entry & PAGING_IS_WRITEABLE) || paging_identity_is_writeable(phys);
+    if (!write && !writeable)
+    {
+        return -EINVARG;
+    }
+
+    *phys_out = phys | ((uint32_t)ptr & 0xfff);
+    return 0;
+}
+
+/**
+ * Builds the PRD table for the next total sectors of a run of requests,
+ * starting at the first sector request has not received yet.
+ * Fails when a buffer page is not mapped, so the caller can fall back to PIO.
+ */
+int diskdma_prepare(struct disk_request* request, int total)
+{
+    int res = 0;
+    int prd = -1;
+    uint32_t length = 0;
+    int offset = request->done;
+
+    while (total > 0 && request)
+    {
+        int sectors = request->total - offset;
+        if (sectors > total)
+        {
+            sectors = total;
+        }
+
+        char* ptr = request->buf + (offset * FREE95_SECTOR_SIZE);
+        uint32_t left = sectors * FREE95_SECTOR_SIZE;
+        while (left > 0)
+        {
+            uint32_t chunk = PAGING_PAGE_SIZE - ((uint32_t)ptr % PAGING_PAGE_SIZE);
+            if (chunk > left)
+            {
+                chunk = left;
+            }
+
+            uint32_t phys = 0;
+            res = diskdma_translate(request->directory, ptr, request->write, &phys);
+            if (res < 0 || (phys & 1))
+            {
+                // Called from IRQ14, counted instead of logged
+                diskdma_fallbacks++;
+                res = -EINVARG;
+                goto out;
+            }
+
+            // Pages are never split by a 64K boundary, so only the end of the region is checked
+            if (prd >= 0 && diskdma_prds[prd].address + length == phys &&
+                (diskdma_prds[prd].address / DISKDMA_PRD_BOUNDARY) == ((phys + chunk - 1) / DISKDMA_PRD_BOUNDARY))
+            {
+                length += chunk;
+            }
+            else
+            {
+                if (prd + 1 >= (int)DISKDMA_TOTAL_PRDS)
+                {
+                    res = -ENOMEM;
+                    goto out;
+                }
+
+                prd++;
+                diskdma_prds[prd].address = phys;
+                diskdma_prds[prd].flags = 0;
+                length = chunk;
+            }
+            diskdma_prds[prd].count = length & 0xFFFF;
+
+            ptr += chunk;
+            left -= chunk;
+        }
+
+        total -= sectors;
+        request = request->next;
+        offset = 0;
+    }
+
+    if (prd < 0)
+    {
+        res = -EINVARG;
+        goto out;
+    }
+
+    diskdma_prds[prd].flags = DISKDMA_PRD_END;
+
+out:
+    return res;
+}
+
+void diskdma_start(bool write)
+{
+    unsigned char direction = write ? 0 : DISKDMA_COMMAND_READ;
+    outb(diskdma_base + DISKDMA_COMMAND, direction);
+    outb(diskdma_base + DISKDMA_STATUS, DISKDMA_STATUS_ERROR | DISKDMA_STATUS_INTERRUPT);
+    outb(diskdma_base + DISKDMA_COMMAND, direction | DISKDMA_COMMAND_START);
+}
+
+bool diskdma_done()
+{
+    unsigned char status = insb(diskdma_base + DISKDMA_STATUS);
+    return (status & (DISKDMA_STATUS_INTERRUPT | DISKDMA_STATUS_ERROR)) || !(status & DISKDMA_STATUS_ACTIVE);
+}
+
+int diskdma_finish()
+{
+    unsigned char status = insb(diskdma_base + DISKDMA_STATUS);
+    outb(diskdma_base + DISKDMA_COMMAND, 0);
+    outb(diskdma_base + DISKDMA_STATUS, DISKDMA_STATUS_ERROR | DISKDMA_STATUS_INTERRUPT);
+
+    return (status & DISKDMA_STATUS_ERROR) ? -EIO : 0;
+}
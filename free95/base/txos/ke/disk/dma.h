@@ -0,0 +1,41 @@
+#ifndef DISKDMA_H
+#define DISKDMA_H
+
+#include "queue.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Bus master registers of the primary channel, relative to BAR4
+#define DISKDMA_COMMAND 0x00
+#define DISKDMA_STATUS 0x02
+#define DISKDMA_PRDT 0x04
+
+#define DISKDMA_COMMAND_START 0x01
+// Set for transfers from the drive into memory
+#define DISKDMA_COMMAND_READ 0x08
+
+#define DISKDMA_STATUS_ACTIVE 0x01
+#define DISKDMA_STATUS_ERROR 0x02
+#define DISKDMA_STATUS_INTERRUPT 0x04
+
+// Set on the last entry of the table
+#define DISKDMA_PRD_END 0x8000
+// A region may not cross a 64K boundary, a count of 0 means 64K
+#define DISKDMA_PRD_BOUNDARY 0x10000
+
+struct disk_prd
+{
+    uint32_t address;
+    uint16_t count;
+    uint16_t flags;
+} __attribute__((packed));
+
+int diskdma_init();
+bool diskdma_available();
+uint32_t diskdma_fallback_count();
+int diskdma_prepare(struct disk_request* request, int total);
+void diskdma_start(bool write);
+bool diskdma_done();
+int diskdma_finish();
+
+#endif
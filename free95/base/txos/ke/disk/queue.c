@@ -0,0 +1,82 @@
+/*++
+
+Free95 20x/TX Kernel
+
+You may only use this code if you agree to the terms of the Free95 Source Code License agreement (GNU GPL v3) (see LICENSE).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    queue.c
+
+Abstract:
+
+    This module implements the disk request queue.
+    Pending requests are kept sorted by LBA and dispatched in one
+    upward sweep (C-LOOK), requests for adjacent sectors are merged
+    into a single run for the drive.
+
+--*/
+
+#include "queue.h"
+
+void diskqueue_init(struct disk_queue* queue)
+{
+    queue->pending = 0;
+    queue->head = 0;
+}
+
+void diskqueue_insert(struct disk_queue* queue, struct disk_request* request)
+{
+    // Requests for the same sector stay in submission order
+    struct disk_request** link = &queue->pending;
+    while (*link && (*link)->lba <= request->lba)
+    {
+        link = &(*link)->next;
+    }
+
+    request->next = *link;
+    *link = request;
+}
+
+/**
+ * Removes the next run of requests from the queue and returns it linked through next.
+ * The run starts at the first request at or past the head, or wraps to the lowest LBA,
+ * and continues while the following request goes the same direction and starts
+ * where the previous one ends.
+ */
+struct disk_request* diskqueue_next(struct disk_queue* queue, int* total)
+{
+    struct disk_request** link = &queue->pending;
+    while (*link && (*link)->lba < queue->head)
+    {
+        link = &(*link)->next;
+    }
+
+    if (!*link)
+    {
+        link = &queue->pending;
+    }
+
+    struct disk_request* first = *link;
+    if (!first)
+    {
+        return 0;
+    }
+
+    struct disk_request* last = first;
+    unsigned int end = first->lba + first->total;
+    while (last->next && last->next->lba == end && last->next->write == first->write)
+    {
+        last = last->next;
+        end += last->total;
+    }
+
+    *link = last->next;
+    last->next = 0;
+
+    queue->head = end;
+    *total = end - first->lba;
+    return first;
+}
@@ -0,0 +1,52 @@
+#ifndef DISKQUEUE_H
+#define DISKQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../sync/sync.h"
+
+struct disk_request;
+
+typedef void (*DISK_REQUEST_CALLBACK)(struct disk_request* request);
+
+struct disk_request
+{
+    unsigned int lba;
+    int total;
+    char* buf;
+    // Moves buf to the disk instead of filling it
+    bool write;
+
+    // Address space buf belongs to, DMA translates it through this directory
+    uint32_t* directory;
+
+    // Signaled on completion, it boosts the task waiting in DiskWait()
+    KEVENT event;
+
+    // Called from the interrupt handler once every sector is in or the read failed
+    DISK_REQUEST_CALLBACK callback;
+    void* context;
+
+    // Sectors transferred so far
+    int done;
+    int status;
+    volatile int complete;
+
+    // Next request in the queue, or in the command that is in flight
+    struct disk_request* next;
+};
+
+struct disk_queue
+{
+    // Requests waiting for the drive, sorted by LBA
+    struct disk_request* pending;
+
+    // Sector following the last dispatched request, the elevator sweeps upwards from here
+    unsigned int head;
+};
+
+void diskqueue_init(struct disk_queue* queue);
+void diskqueue_insert(struct disk_queue* queue, struct disk_request* request);
+struct disk_request* diskqueue_next(struct disk_queue* queue, int* total);
+
+#endif
@@ -1,6 +1,7 @@
 #include "streamer.h"
 #include "../memory/heap/kheap.h"
 #include "../config.h"
+#include "../memory/memory.h"
 
 struct disk_stream* diskstreamer_new(int disk_id)
 {
@@ -22,30 +23,55 @@ int diskstreamer_seek(struct disk_stream* stream, int pos)
     return 0;
 }
 
+/**
+ * Whole sectors are read straight into the caller's buffer with as few commands as possible,
+ * only a partial first or last sector goes through a bounce buffer.
+ */
 int diskstreamer_read(struct disk_stream* stream, void* out, int total)
 {
-    int sector = stream->pos / FREE95_SECTOR_SIZE;
-    int offset = stream->pos % FREE95_SECTOR_SIZE;
+    int res = 0;
+    char* ptr = out;
     char buf[FREE95_SECTOR_SIZE];
 
-    int res = DiskReadBlk(stream->disk, sector, 1, buf);
-    if (res < 0)
+    while (total > 0)
     {
-        goto out;
-    }
+        int sector = stream->pos / FREE95_SECTOR_SIZE;
+        int offset = stream->pos % FREE95_SECTOR_SIZE;
+        int total_to_read = 0;
 
-    int total_to_read = total > FREE95_SECTOR_SIZE ? FREE95_SECTOR_SIZE : total;
-    for (int i = 0; i < total_to_read; i++)
-    {
-        *(char*)out++ = buf[offset+i];
-    }
+        if (offset == 0 && total >= FREE95_SECTOR_SIZE)
+        {
+            int sectors = total / FREE95_SECTOR_SIZE;
+            res = DiskReadBlk(stream->disk, sector, sectors, ptr);
+            if (res < 0)
+            {
+                goto out;
+            }
 
-    // Adjust the stream
-    stream->pos += total_to_read;
-    if (total > FREE95_SECTOR_SIZE)
-    {
-        res = diskstreamer_read(stream, out, total-FREE95_SECTOR_SIZE);
+            total_to_read = sectors * FREE95_SECTOR_SIZE;
+        }
+        else
+        {
+            res = DiskReadBlk(stream->disk, sector, 1, buf);
+            if (res < 0)
+            {
+                goto out;
+            }
+
+            total_to_read = FREE95_SECTOR_SIZE - offset;
+            if (total_to_read > total)
+            {
+                total_to_read = total;
+            }
+            memcpy(ptr, buf + offset, total_to_read);
+        }
+
+        // Adjust the stream
+        ptr += total_to_read;
+        stream->pos += total_to_read;
+        total -= total_to_read;
     }
+
 out:
     return res;
 }
@@ -28,8 +28,15 @@ Abstract:
 
 #define FREE95_FAT16_SIGNATURE 0x29
 #define FREE95_FAT16_FAT_ENTRY_SIZE 0x02
-#define FREE95_FAT16_BAD_SECTOR 0xFF7
+#define FREE95_FAT16_BAD_SECTOR 0xFFF7
 #define FREE95_FAT16_UNUSED 0x00
+// 0xFFF0 - 0xFFF6 are reserved, 0xFFF8 and above end a cluster chain
+#define FREE95_FAT16_RESERVED 0xFFF0
+#define FREE95_FAT16_END_OF_CHAIN 0xFFF8
+// Written to the last cluster of chains we allocate
+#define FREE95_FAT16_LAST_CLUSTER 0xFFFF
+
+#define FAT16_HASH_NONE -1
 
 
 typedef unsigned int FAT_ITEM_TYPE;
@@ -107,6 +114,20 @@ struct fat_directory
     int total;
     int sector_pos;
     int ending_sector_pos;
+
+    // Slots held in item, subdirectories are read up to their end marker
+    // until a file is created in them
+    int capacity;
+
+    // Name index, hash_buckets holds the first item of every chain and
+    // hash_next the following one, FAT16_HASH_NONE ends a chain
+    int* hash_buckets;
+    int* hash_next;
+    uint32_t hash_mask;
+
+    // Loaded subdirectories are kept by their first cluster and never freed
+    uint32_t cluster;
+    struct fat_directory* next;
 };
 
 struct fat_item
@@ -118,12 +139,53 @@ struct fat_item
     };
     
     FAT_ITEM_TYPE type;
+
+    // Directory holding the item and its slot there, used to write the item back
+    struct fat_directory* parent;
+    int index;
+};
+
+// A run of clusters that follow each other on disk
+struct fat_extent
+{
+    // Index of the first cluster of the run within the file
+    uint32_t file_cluster;
+    uint32_t sector;
+    uint32_t clusters;
+};
+
+struct fat_extent_list
+{
+    // Sorted by file_cluster
+    struct fat_extent* extents;
+    int total;
 };
 
 struct fat_file_descriptor
 {
     struct fat_item* item;
     uint32_t pos;
+
+    // Cluster chain of the file, decoded once when it is opened
+    struct fat_extent_list extents;
+
+    // End of the last read, a read starting here continues a sequential stream
+    uint32_t last_end;
+    // Bytes read ahead of a sequential stream, doubled by every sequential read
+    uint32_t readahead;
+    // Offset up to which read-ahead was started
+    uint32_t readahead_end;
+
+    FILE_MODE mode;
+    // Bytes written past the clusters of the file, they get clusters when the descriptor is flushed
+    char* pending;
+    uint32_t pending_size;
+    uint32_t pending_capacity;
+    // The directory item changed and has to be written back
+    bool dirty;
+
+    // Next descriptor open on the same disk
+    struct fat_file_descriptor* next;
 };
 
 struct fat_private
@@ -133,22 +195,55 @@ struct fat_private
 
     // Used to stream data clusters
     struct disk_stream* cluster_read_stream;
-    // Used to stream the file allocation table
-    struct disk_stream* fat_read_stream;
+
+    // The first file allocation table, loaded whole when the disk is resolved
+    uint16_t* fat;
+    uint32_t fat_entries;
+    // One bit per FAT sector that was changed in memory and not written back yet
+    uint32_t* fat_dirty;
+    // Clusters the data area really has, the last FAT sector may describe more
+    uint32_t total_clusters;
 
     // Used in situations where we stream the directory
     struct disk_stream* directory_stream;
+
+    // Subdirectories loaded so far, path walks reuse them instead of reading them again
+    struct fat_directory* directories;
+
+    // Descriptors open on the disk, a file open elsewhere is not truncated under them
+    struct fat_file_descriptor* open_files;
 };
 
 int fat16_resolve(struct disk* disk);
-void* fat16_open(struct disk* disk, struct path_part* path, FILE_MODE mode);
+void* fat16_lookup(struct disk* disk, struct path_part* path);
+void fat16_release(void* node);
+void* fat16_open(struct disk* disk, void* node, FILE_MODE mode);
 int fat16_read(struct disk* disk, void* descriptor, uint32_t size, uint32_t nmemb, char* out_ptr);
+int fat16_seek(void* private, uint32_t offset, FILE_SEEK_MODE seek_mode);
+int fat16_tell(void* private);
+int fat16_stat(struct disk* disk, void* private, struct file_stat* stat);
+int fat16_close(struct disk* disk, void* private);
+int fat16_create(struct disk* disk, struct path_part* path);
+int fat16_write(struct disk* disk, void* descriptor, uint32_t size, uint32_t nmemb, const char* in_ptr);
+int fat16_flush(struct disk* disk, void* private);
+int fat16_sync(struct disk* disk);
+static int fat16_index_directory(struct fat_directory* directory);
 
 struct filesystem fat16_fs =
 {
     .resolve = fat16_resolve,
+    .lookup = fat16_lookup,
+    .release = fat16_release,
     .open = fat16_open,
-    .read = fat16_read
+    .read = fat16_read,
+    .seek = fat16_seek,
+    .tell = fat16_tell,
+    .stat = fat16_stat,
+    .close = fat16_close,
+    .create = fat16_create,
+    .write = fat16_write,
+    .flush = fat16_flush,
+    .sync = fat16_sync
 };
 
 struct filesystem* fat16_init()
@@ -161,7 +256,6 @@ static void fat16_init_private(struct disk* disk, struct fat_private* private)
 {
     memset(private, 0, sizeof(struct fat_private));
     private->cluster_read_stream = diskstreamer_new(disk->id);
-    private->fat_read_stream = diskstreamer_new(disk->id);
     private->directory_stream = diskstreamer_new(disk->id);
 }
 
@@ -254,12 +348,56 @@ int fat16_get_root_directory(struct disk* disk, struct fat_private* fat_private,
 
     directory->item = dir;
     directory->total = total_items;
+    directory->capacity = root_dir_entries;
     directory->sector_pos = root_dir_sector_pos;
     directory->ending_sector_pos = root_dir_sector_pos + (root_dir_size / disk->sector_size);
 out:
     return res;
 }
 
+static uint32_t fat16_get_first_fat_sector(struct fat_private* private)
+{
+    return private->header.primary_header.reserved_sectors;
+}
+
+/**
+ * Reads the first FAT into memory with a single request, chain walks never touch the disk again.
+ */
+static int fat16_load_fat(struct disk* disk, struct fat_private* fat_private)
+{
+    int res = 0;
+    struct fat_header* primary_header = &fat_private->header.primary_header;
+    uint32_t fat_sectors = primary_header->sectors_per_fat;
+    uint32_t fat_size = fat_sectors * disk->sector_size;
+
+    fat_private->fat = kmalloc(fat_size);
+    fat_private->fat_dirty = kzalloc(((fat_sectors + 31) / 32) * sizeof(uint32_t));
+    if (!fat_private->fat || !fat_private->fat_dirty)
+    {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    res = DiskReadBlk(disk, fat16_get_first_fat_sector(fat_private), fat_sectors, fat_private->fat);
+    if (res < 0)
+    {
+        res = -EIO;
+        goto out;
+    }
+
+    fat_private->fat_entries = fat_size / FREE95_FAT16_FAT_ENTRY_SIZE;
+
+    uint32_t total_sectors = primary_header->number_of_sectors ? primary_header->number_of_sectors : primary_header->sectors_big;
+    uint32_t data_sectors = total_sectors - fat_private->root_directory.ending_sector_pos;
+    fat_private->total_clusters = (data_sectors / primary_header->sectors_per_cluster) + 2;
+    if (fat_private->total_clusters > fat_private->fat_entries)
+    {
+        fat_private->total_clusters = fat_private->fat_entries;
+    }
+out:
+    return res;
+}
+
 int fat16_resolve(struct disk* disk)
 {
     int res = 0;
@@ -294,6 +432,18 @@ int fat16_resolve(struct disk* disk)
         goto out;
     }
 
+    res = fat16_index_directory(&fat_private->root_directory);
+    if (res < 0)
+    {
+        goto out;
+    }
+
+    res = fat16_load_fat(disk, fat_private);
+    if (res < 0)
+    {
+        goto out;
+    }
+
 out:
     if (stream)
     {
@@ -302,6 +452,16 @@ out:
 
     if (res < 0)
     {
+        if (fat_private->fat)
+        {
+            kfree(fat_private->fat);
+        }
+
+        if (fat_private->fat_dirty)
+        {
+            kfree(fat_private->fat_dirty);
+        }
+
         kfree(fat_private);
         disk->fs_private = 0;
     }
@@ -355,279 +515,778 @@ struct fat_directory_item* fat16_clone_directory_item(struct fat_directory_item*
     return item_copy;
 }
 
-static uint32_t fat16_get_first_cluster(struct fat_directory_item* item)
-{
-    return (item->high_16_bits_first_cluster) | item->low_16_bits_first_cluster;
-};
-
-static int fat16_cluster_to_sector(struct fat_private* private, int cluster)
+// FNV-1a of the lower case name, lookups are case insensitive
+static uint32_t fat16_hash_name(const char* name)
 {
-    return private->root_directory.ending_sector_pos + ((cluster - 2) * private->header.primary_header.sectors_per_cluster);
-}
+    uint32_t hash = 2166136261u;
+    while (*name)
+    {
+        hash ^= (uint8_t)tolower(*name++);
+        hash *= 16777619u;
+    }
 
-static uint32_t fat16_get_first_fat_sector(struct fat_private* private)
-{
-    return private->header.primary_header.reserved_sectors;
+    return hash;
 }
 
-static int fat16_get_fat_entry(struct disk* disk, int cluster)
+static void fat16_free_directory_index(struct fat_directory* directory)
 {
-    int res = -1;
-    struct fat_private* private = disk->fs_private;
-    struct disk_stream* stream = private->fat_read_stream;
-    if (!stream)
-    {
-        goto out;
-    }
-
-    uint32_t fat_table_position = fat16_get_first_fat_sector(private) * disk->sector_size;
-    res = diskstreamer_seek(stream, fat_table_position * (cluster * FREE95_FAT16_FAT_ENTRY_SIZE));
-    if (res < 0)
+    if (directory->hash_buckets)
     {
-        goto out;
+        kfree(directory->hash_buckets);
     }
 
-    uint16_t result = 0;
-    res = diskstreamer_read(stream, &result, sizeof(result));
-    if (res < 0)
+    if (directory->hash_next)
     {
-        goto out;
+        kfree(directory->hash_next);
     }
 
-    res = result;
-out:
-    return res;
+    directory->hash_buckets = 0;
+    directory->hash_next = 0;
 }
 
 /**
- * Gets the correct cluster to use based on the starting cluster and the offset
+ * Builds the name index of a loaded directory, the names are formatted once here instead of on every lookup.
  */
-static int fat16_get_cluster_for_offset(struct disk* disk, int starting_cluster, int offset)
+static int fat16_index_directory(struct fat_directory* directory)
 {
     int res = 0;
-    struct fat_private* private = disk->fs_private;
-    int size_of_cluster_bytes = private->header.primary_header.sectors_per_cluster * disk->sector_size;
-    int cluster_to_use = starting_cluster;
-    int clusters_ahead = offset / size_of_cluster_bytes;
-    for (int i = 0; i < clusters_ahead; i++)
+    uint32_t total_buckets = 1;
+    while (total_buckets < directory->total)
     {
-        int entry = fat16_get_fat_entry(disk, cluster_to_use);
-        if (entry == 0xFF8 || entry == 0xFFF)
-        {
-            // We are at the last entry in the file
-            res = -EIO;
-            goto out;
-        }
+        total_buckets <<= 1;
+    }
 
-        // Sector is marked as bad?
-        if (entry == FREE95_FAT16_BAD_SECTOR)
-        {
-            res = -EIO;
-            goto out;
-        }
+    directory->hash_buckets = kmalloc(total_buckets * sizeof(int));
+    directory->hash_next = kmalloc((directory->total ? directory->total : 1) * sizeof(int));
+    if (!directory->hash_buckets || !directory->hash_next)
+    {
+        fat16_free_directory_index(directory);
+        res = -ENOMEM;
+        goto out;
+    }
 
-        // Reserved sector?
-        if (entry == 0xFF0 || entry == 0xFF6)
-        {
-            res = -EIO;
-            goto out;
-        }
+    directory->hash_mask = total_buckets - 1;
+    for (uint32_t i = 0; i < total_buckets; i++)
+    {
+        directory->hash_buckets[i] = FAT16_HASH_NONE;
+    }
 
-        if (entry == 0x00)
+    char tmp_filename[FREE95_MAX_PATH];
+    // Insert backwards so every chain lists items in directory order
+    for (int i = directory->total - 1; i >= 0; i--)
+    {
+        directory->hash_next[i] = FAT16_HASH_NONE;
+        if (directory->item[i].filename[0] == 0xE5)
         {
-            res = -EIO;
-            goto out;
+            continue;
         }
 
-        cluster_to_use = entry;
+        fat16_get_full_relative_filename(&directory->item[i], tmp_filename, sizeof(tmp_filename));
+        uint32_t bucket = fat16_hash_name(tmp_filename) & directory->hash_mask;
+        directory->hash_next[i] = directory->hash_buckets[bucket];
+        directory->hash_buckets[bucket] = i;
     }
 
-    res = cluster_to_use;
 out:
     return res;
 }
 
-static int fat16_read_internal_from_stream(struct disk* disk, struct disk_stream* stream, int cluster, int offset, int total, void* out)
+static uint32_t fat16_get_first_cluster(struct fat_directory_item* item)
 {
-    int res = 0;
-    struct fat_private* private = disk->fs_private;
-    int size_of_cluster_bytes = private->header.primary_header.sectors_per_cluster * disk->sector_size;
-    int cluster_to_use = fat16_get_cluster_for_offset(disk, cluster, offset);
-    if (cluster_to_use < 0)
-    {
-        res = cluster_to_use;
-        goto out;
-    }
+    return (item->high_16_bits_first_cluster) | item->low_16_bits_first_cluster;
+};
 
+static int fat16_cluster_to_sector(struct fat_private* private, int cluster)
+{
+    return private->root_directory.ending_sector_pos + ((cluster - 2) * private->header.primary_header.sectors_per_cluster);
+}
 
-    int offset_from_cluster = offset % size_of_cluster_bytes;
+static int fat16_sector_to_cluster(struct fat_private* private, int sector)
+{
+    return ((sector - private->root_directory.ending_sector_pos) / private->header.primary_header.sectors_per_cluster) + 2;
+}
 
-    int starting_sector = fat16_cluster_to_sector(private, cluster_to_use);
-    int starting_pos = (starting_sector * disk->sector_size) + offset_from_cluster;
-    int total_to_read = total > size_of_cluster_bytes ? size_of_cluster_bytes : total;
-    res = diskstreamer_seek(stream, starting_pos);
-    if (res != FREE95_ALL_OK)
+static int fat16_get_fat_entry(struct disk* disk, int cluster)
+{
+    struct fat_private* private = disk->fs_private;
+    if (cluster < 0 || cluster >= private->fat_entries)
     {
-        goto out;
+        return -EIO;
     }
 
-    res = diskstreamer_read(stream, out, total_to_read);
-    if (res != FREE95_ALL_OK)
-    {
-        goto out;
-    }
+    return private->fat[cluster];
+}
 
-    total -= total_to_read;
-    if (total > 0)
+/**
+ * Changes a FAT entry in memory, the sector holding it is marked dirty
+ * so that it can be written back to every FAT copy later.
+ */
+static int fat16_set_fat_entry(struct disk* disk, int cluster, uint16_t value)
+{
+    struct fat_private* private = disk->fs_private;
+    if (cluster < 0 || cluster >= private->fat_entries)
     {
-        // We still have more to read
-        res = fat16_read_internal_from_stream(disk, stream, cluster, offset+total_to_read, total, out + total_to_read);
+        return -EIO;
     }
 
-out:
-    return res;
-}
+    private->fat[cluster] = value;
 
-static int fat16_read_internal(struct disk* disk, int starting_cluster, int offset, int total, void* out)
-{
-    struct fat_private* fs_private = disk->fs_private;
-    struct disk_stream* stream = fs_private->cluster_read_stream;
-    return fat16_read_internal_from_stream(disk, stream, starting_cluster, offset, total, out);
+    uint32_t sector = (cluster * FREE95_FAT16_FAT_ENTRY_SIZE) / disk->sector_size;
+    private->fat_dirty[sector / 32] |= 1 << (sector % 32);
+    return 0;
 }
 
-void fat16_free_directory(struct fat_directory* directory)
+/**
+ * Returns the cluster after the given one, 0 at the end of the chain.
+ */
+static int fat16_get_next_cluster(struct disk* disk, int cluster)
 {
-    if (!directory)
+    int entry = fat16_get_fat_entry(disk, cluster);
+    if (entry < 0)
     {
-        return;
+        return entry;
     }
 
-    if (directory->item)
+    if (entry >= FREE95_FAT16_END_OF_CHAIN)
     {
-        kfree(directory->item);
+        // We are at the last entry in the file
+        return 0;
     }
 
-    kfree(directory);
-}
-
-
-void fat16_fat_item_free(struct fat_item* item)
-{
-    if (item->type == FAT_ITEM_TYPE_DIRECTORY)
+    // Bad, reserved and free clusters cannot be part of a chain
+    if (entry == FREE95_FAT16_BAD_SECTOR || entry >= FREE95_FAT16_RESERVED || entry < 2)
     {
-        fat16_free_directory(item->directory);
-    }
-    else if(item->type == FAT_ITEM_TYPE_FILE)
-    {
-        kfree(item->item);
+        return -EIO;
     }
 
-    kfree(item);
+    return entry;
 }
 
-struct fat_directory* fat16_load_fat_directory(struct disk* disk, struct fat_directory_item* item)
+/**
+ * Decodes the cluster chain starting at cluster into runs of clusters
+ * that follow each other on disk, each run is one contiguous range of sectors.
+ */
+static int fat16_build_extents(struct disk* disk, int cluster, struct fat_extent_list* list)
 {
     int res = 0;
-    struct fat_directory* directory = 0;
-    struct fat_private* fat_private = disk->fs_private;
-    if (!(item->attribute & FAT_FILE_SUBDIRECTORY))
+    struct fat_private* private = disk->fs_private;
+    list->extents = 0;
+    list->total = 0;
+    if (cluster == 0)
     {
-        res = -EINVARG;
+        // Empty files have no clusters
         goto out;
     }
 
-    directory = kzalloc(sizeof(struct fat_directory));
-    if (!directory)
+    // Count the runs first so the list is allocated once
+    int total = 0;
+    uint32_t steps = 0;
+    int current = cluster;
+    int previous = -1;
+    while (current > 0)
     {
-        res = -ENOMEM;
-        goto out;
+        if (current != previous + 1)
+        {
+            total++;
+        }
+
+        // A chain longer than the FAT has a loop in it
+        if (++steps > private->fat_entries)
+        {
+            res = -EIO;
+            goto out;
+        }
+
+        previous = current;
+        current = fat16_get_next_cluster(disk, current);
     }
 
-    int cluster = fat16_get_first_cluster(item);
-    int cluster_sector = fat16_cluster_to_sector(fat_private, cluster);
-    int total_items = fat16_get_total_items_for_directory(disk, cluster_sector);
-    directory->total = total_items;
-    int directory_size = directory->total * sizeof(struct fat_directory_item);
-    directory->item = kzalloc(directory_size);
-    if (!directory->item)
+    if (current < 0)
     {
-        res = -ENOMEM;
+        res = current;
         goto out;
     }
 
-    res = fat16_read_internal(disk, cluster, 0x00, directory_size, directory->item);
-    if (res != FREE95_ALL_OK)
+    list->extents = kzalloc(total * sizeof(struct fat_extent));
+    if (!list->extents)
     {
+        res = -ENOMEM;
         goto out;
     }
-    
 
-out:
-    if (res != FREE95_ALL_OK)
+    struct fat_extent* extent = 0;
+    uint32_t file_cluster = 0;
+    current = cluster;
+    previous = -1;
+    while (current > 0)
     {
-        fat16_free_directory(directory);
+        if (current != previous + 1)
+        {
+            extent = &list->extents[list->total++];
+            extent->file_cluster = file_cluster;
+            extent->sector = fat16_cluster_to_sector(private, current);
+            extent->clusters = 0;
+        }
+
+        extent->clusters++;
+        file_cluster++;
+        previous = current;
+        current = fat16_get_next_cluster(disk, current);
     }
-    return directory;
+
+out:
+    return res;
 }
-struct fat_item* fat16_new_fat_item_for_directory_item(struct disk* disk, struct fat_directory_item* item)
-{
-    struct fat_item* f_item = kzalloc(sizeof(struct fat_item));
-    if (!f_item)
-    {
-        return 0;
-    }
 
-    if (item->attribute & FAT_FILE_SUBDIRECTORY)
+static void fat16_free_extents(struct fat_extent_list* list)
+{
+    if (list->extents)
     {
-        f_item->directory = fat16_load_fat_directory(disk, item);
-        f_item->type = FAT_ITEM_TYPE_DIRECTORY;
+        kfree(list->extents);
     }
 
-    f_item->type = FAT_ITEM_TYPE_FILE;
-    f_item->item = fat16_clone_directory_item(item, sizeof(struct fat_directory_item));
-    return f_item;
+    list->extents = 0;
+    list->total = 0;
 }
 
-struct fat_item* fat16_find_item_in_directory(struct disk* disk, struct fat_directory* directory, const char* name)
+/**
+ * Finds the run holding the given cluster of the file with a binary search.
+ */
+static struct fat_extent* fat16_find_extent(struct fat_extent_list* list, uint32_t file_cluster)
 {
-    struct fat_item* f_item = 0;
-    char tmp_filename[FREE95_MAX_PATH];
-    for (int i = 0; i < directory->total; i++)
+    int low = 0;
+    int high = list->total - 1;
+    while (low <= high)
     {
-        fat16_get_full_relative_filename(&directory->item[i], tmp_filename, sizeof(tmp_filename));
-        if (istrncmp(tmp_filename, name, sizeof(tmp_filename)) == 0)
+        int middle = (low + high) / 2;
+        struct fat_extent* extent = &list->extents[middle];
+        if (file_cluster < extent->file_cluster)
         {
-            // Found it let's create a new fat_item
-            f_item = fat16_new_fat_item_for_directory_item(disk, &directory->item[i]);
+            high = middle - 1;
+        }
+        else if (file_cluster >= extent->file_cluster + extent->clusters)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            return extent;
         }
     }
 
-    return f_item;
+    return 0;
 }
 
-struct fat_item* fat16_get_directory_entry(struct disk* disk, struct path_part* path)
+/**
+ * Reads total bytes at offset, every piece that lies in one run is a single stream read.
+ */
+static int fat16_read_internal(struct disk* disk, struct fat_extent_list* list, uint32_t offset, uint32_t total, void* out)
 {
-    struct fat_private* fat_private = disk->fs_private;
-    struct fat_item* current_item = 0;
-    struct fat_item* root_item 
-            = fat16_find_item_in_directory(disk, &fat_private->root_directory, path->part);
-    if (!root_item)
-    {
-        goto out;
-    }
+    int res = 0;
+    struct fat_private* private = disk->fs_private;
+    struct disk_stream* stream = private->cluster_read_stream;
+    uint32_t size_of_cluster_bytes = private->header.primary_header.sectors_per_cluster * disk->sector_size;
+    char* ptr = out;
 
-    struct path_part* next_part = path->next;
-    current_item = root_item;
-    while(next_part != 0)
+    while (total > 0)
     {
-        if (current_item->type != FAT_ITEM_TYPE_DIRECTORY)
+        struct fat_extent* extent = fat16_find_extent(list, offset / size_of_cluster_bytes);
+        if (!extent)
         {
-            current_item = 0;
-            break;
+            res = -EIO;
+            goto out;
         }
 
-        struct fat_item* tmp_item = fat16_find_item_in_directory(disk, current_item->directory, next_part->part);
-        fat16_fat_item_free(current_item);
+        uint32_t extent_start = extent->file_cluster * size_of_cluster_bytes;
+        uint32_t extent_end = extent_start + (extent->clusters * size_of_cluster_bytes);
+        uint32_t total_to_read = extent_end - offset;
+        if (total_to_read > total)
+        {
+            total_to_read = total;
+        }
+
+        uint32_t position = (extent->sector * disk->sector_size) + (offset - extent_start);
+        if ((position % disk->sector_size) == 0 && (total_to_read % disk->sector_size) == 0)
+        {
+            // Whole sectors go from the disk straight into the caller's buffer
+            res = DiskReadBlk(disk, position / disk->sector_size, total_to_read / disk->sector_size, ptr);
+            if (res < 0)
+            {
+                goto out;
+            }
+        }
+        else
+        {
+            res = diskstreamer_seek(stream, position);
+            if (res != FREE95_ALL_OK)
+            {
+                goto out;
+            }
+
+            res = diskstreamer_read(stream, ptr, total_to_read);
+            if (res != FREE95_ALL_OK)
+            {
+                goto out;
+            }
+        }
+
+        ptr += total_to_read;
+        offset += total_to_read;
+        total -= total_to_read;
+    }
+
+out:
+    return res;
+}
+
+/**
+ * Writes total bytes at offset into clusters the file already has. Whole sectors
+ * go to the block cache as they are, partial ones are merged with the sector first.
+ */
+static int fat16_write_internal(struct disk* disk, struct fat_extent_list* list, uint32_t offset, uint32_t total, const char* in)
+{
+    int res = 0;
+    struct fat_private* private = disk->fs_private;
+    uint32_t size_of_cluster_bytes = private->header.primary_header.sectors_per_cluster * disk->sector_size;
+    char sector[FREE95_SECTOR_SIZE];
+
+    while (total > 0)
+    {
+        struct fat_extent* extent = fat16_find_extent(list, offset / size_of_cluster_bytes);
+        if (!extent)
+        {
+            res = -EIO;
+            goto out;
+        }
+
+        uint32_t extent_start = extent->file_cluster * size_of_cluster_bytes;
+        uint32_t extent_end = extent_start + (extent->clusters * size_of_cluster_bytes);
+        uint32_t total_to_write = extent_end - offset;
+        if (total_to_write > total)
+        {
+            total_to_write = total;
+        }
+
+        uint32_t position = (extent->sector * disk->sector_size) + (offset - extent_start);
+        uint32_t lba = position / disk->sector_size;
+        uint32_t sector_offset = position % disk->sector_size;
+        if (sector_offset == 0 && total_to_write >= disk->sector_size)
+        {
+            total_to_write -= total_to_write % disk->sector_size;
+            res = DiskWriteBlk(disk, lba, total_to_write / disk->sector_size, (void*)in);
+        }
+        else
+        {
+            if (total_to_write > disk->sector_size - sector_offset)
+            {
+                total_to_write = disk->sector_size - sector_offset;
+            }
+
+            res = DiskReadBlk(disk, lba, 1, sector);
+            if (res < 0)
+            {
+                goto out;
+            }
+
+            memcpy(sector + sector_offset, (void*)in, total_to_write);
+            res = DiskWriteBlk(disk, lba, 1, sector);
+        }
+
+        if (res < 0)
+        {
+            goto out;
+        }
+
+        in += total_to_write;
+        offset += total_to_write;
+        total -= total_to_write;
+    }
+
+out:
+    return res;
+}
+
+/**
+ * Links total free clusters to the end of the chain ending at last, or starts
+ * a new chain when last is 0. A single free run that fits all of them is
+ * preferred so that the file stays one extent. Returns the first new cluster.
+ */
+static int fat16_allocate_chain(struct disk* disk, int last, uint32_t total)
+{
+    struct fat_private* private = disk->fs_private;
+    uint32_t free_clusters = 0;
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+    uint32_t cluster = 2;
+    for (; cluster < private->total_clusters; cluster++)
+    {
+        if (private->fat[cluster] != FREE95_FAT16_UNUSED)
+        {
+            run_length = 0;
+            continue;
+        }
+
+        free_clusters++;
+        if (run_length++ == 0)
+        {
+            run_start = cluster;
+        }
+
+        if (run_length == total)
+        {
+            break;
+        }
+    }
+
+    if (run_length == total)
+    {
+        cluster = run_start;
+    }
+    else if (free_clusters < total)
+    {
+        return -ENOMEM;
+    }
+    else
+    {
+        // No run is long enough, the free clusters are taken in disk order
+        cluster = 2;
+    }
+
+    int first = 0;
+    for (uint32_t i = 0; i < total; i++)
+    {
+        while (private->fat[cluster] != FREE95_FAT16_UNUSED)
+        {
+            cluster++;
+        }
+
+        if (last)
+        {
+            fat16_set_fat_entry(disk, last, cluster);
+        }
+
+        fat16_set_fat_entry(disk, cluster, FREE95_FAT16_LAST_CLUSTER);
+        if (!first)
+        {
+            first = cluster;
+        }
+        last = cluster;
+    }
+
+    return first;
+}
+
+static int fat16_free_chain(struct disk* disk, int cluster)
+{
+    struct fat_private* private = disk->fs_private;
+    uint32_t steps = 0;
+    while (cluster > 0)
+    {
+        // A chain longer than the FAT has a loop in it
+        if (++steps > private->fat_entries)
+        {
+            return -EIO;
+        }
+
+        int next = fat16_get_next_cluster(disk, cluster);
+        fat16_set_fat_entry(disk, cluster, FREE95_FAT16_UNUSED);
+        cluster = next;
+    }
+
+    return cluster;
+}
+
+/**
+ * Reads every slot of a subdirectory, the root directory is read whole when the disk is resolved.
+ */
+static int fat16_load_directory_slots(struct disk* disk, struct fat_directory* directory)
+{
+    int res = 0;
+    struct fat_private* private = disk->fs_private;
+    uint32_t size_of_cluster_bytes = private->header.primary_header.sectors_per_cluster * disk->sector_size;
+    if (directory->cluster == 0)
+    {
+        goto out;
+    }
+
+    struct fat_extent_list extents;
+    res = fat16_build_extents(disk, directory->cluster, &extents);
+    if (res < 0)
+    {
+        goto out;
+    }
+
+    struct fat_extent* extent = &extents.extents[extents.total - 1];
+    uint32_t size = (extent->file_cluster + extent->clusters) * size_of_cluster_bytes;
+    int capacity = size / sizeof(struct fat_directory_item);
+    if (capacity == directory->capacity)
+    {
+        fat16_free_extents(&extents);
+        goto out;
+    }
+
+    struct fat_directory_item* items = kzalloc(size);
+    if (!items)
+    {
+        fat16_free_extents(&extents);
+        res = -ENOMEM;
+        goto out;
+    }
+
+    res = fat16_read_internal(disk, &extents, 0x00, size, items);
+    fat16_free_extents(&extents);
+    if (res < 0)
+    {
+        kfree(items);
+        goto out;
+    }
+
+    kfree(directory->item);
+    directory->item = items;
+    directory->capacity = capacity;
+out:
+    return res;
+}
+
+/**
+ * Stores item in slot index of the directory and puts the sector holding
+ * it in the block cache, it reaches the disk with the next flush.
+ */
+static int fat16_write_directory_item(struct disk* disk, struct fat_directory* directory, int index, struct fat_directory_item* item)
+{
+    int res = fat16_load_directory_slots(disk, directory);
+    if (res < 0)
+    {
+        goto out;
+    }
+
+    directory->item[index] = *item;
+
+    struct fat_private* private = disk->fs_private;
+    uint32_t size_of_cluster_bytes = private->header.primary_header.sectors_per_cluster * disk->sector_size;
+    uint32_t items_per_sector = disk->sector_size / sizeof(struct fat_directory_item);
+    uint32_t offset = index * sizeof(struct fat_directory_item);
+    uint32_t lba = 0;
+    if (directory->cluster == 0)
+    {
+        lba = directory->sector_pos + (offset / disk->sector_size);
+    }
+    else
+    {
+        struct fat_extent_list extents;
+        res = fat16_build_extents(disk, directory->cluster, &extents);
+        if (res < 0)
+        {
+            goto out;
+        }
+
+        struct fat_extent* extent = fat16_find_extent(&extents, offset / size_of_cluster_bytes);
+        if (extent)
+        {
+            lba = extent->sector + ((offset - (extent->file_cluster * size_of_cluster_bytes)) / disk->sector_size);
+        }
+        fat16_free_extents(&extents);
+
+        if (!extent)
+        {
+            res = -EIO;
+            goto out;
+        }
+    }
+
+    res = DiskWriteBlk(disk, lba, 1, &directory->item[index - (index % items_per_sector)]);
+out:
+    return res;
+}
+
+void fat16_free_directory(struct fat_directory* directory)
+{
+    if (!directory)
+    {
+        return;
+    }
+
+    if (directory->item)
+    {
+        kfree(directory->item);
+    }
+
+    fat16_free_directory_index(directory);
+    kfree(directory);
+}
+
+
+void fat16_fat_item_free(struct fat_item* item)
+{
+    // Directories belong to the directory cache of the disk
+    if(item->type == FAT_ITEM_TYPE_FILE)
+    {
+        kfree(item->item);
+    }
+
+    kfree(item);
+}
+
+struct fat_directory* fat16_load_fat_directory(struct disk* disk, struct fat_directory_item* item)
+{
+    int res = 0;
+    struct fat_directory* directory = 0;
+    struct fat_private* fat_private = disk->fs_private;
+    if (!(item->attribute & FAT_FILE_SUBDIRECTORY))
+    {
+        res = -EINVARG;
+        goto out;
+    }
+
+    int cluster = fat16_get_first_cluster(item);
+    for (directory = fat_private->directories; directory; directory = directory->next)
+    {
+        if (directory->cluster == cluster)
+        {
+            return directory;
+        }
+    }
+
+    directory = kzalloc(sizeof(struct fat_directory));
+    if (!directory)
+    {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    int cluster_sector = fat16_cluster_to_sector(fat_private, cluster);
+    int total_items = fat16_get_total_items_for_directory(disk, cluster_sector);
+    directory->total = total_items;
+    int directory_size = directory->total * sizeof(struct fat_directory_item);
+    directory->item = kzalloc(directory_size);
+    if (!directory->item)
+    {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    struct fat_extent_list extents;
+    res = fat16_build_extents(disk, cluster, &extents);
+    if (res < 0)
+    {
+        goto out;
+    }
+
+    res = fat16_read_internal(disk, &extents, 0x00, directory_size, directory->item);
+    fat16_free_extents(&extents);
+    if (res != FREE95_ALL_OK)
+    {
+        goto out;
+    }
+
+    res = fat16_index_directory(directory);
+    if (res < 0)
+    {
+        goto out;
+    }
+
+    directory->capacity = directory->total;
+    directory->cluster = cluster;
+    directory->next = fat_private->directories;
+    fat_private->directories = directory;
+
+out:
+    if (res != FREE95_ALL_OK)
+    {
+        fat16_free_directory(directory);
+        directory = 0;
+    }
+    return directory;
+}
+struct fat_item* fat16_new_fat_item_for_directory_item(struct disk* disk, struct fat_directory_item* item)
+{
+    struct fat_item* f_item = kzalloc(sizeof(struct fat_item));
+    if (!f_item)
+    {
+        return 0;
+    }
+
+    if (item->attribute & FAT_FILE_SUBDIRECTORY)
+    {
+        f_item->directory = fat16_load_fat_directory(disk, item);
+        f_item->type = FAT_ITEM_TYPE_DIRECTORY;
+        if (!f_item->directory)
+        {
+            kfree(f_item);
+            return 0;
+        }
+
+        return f_item;
+    }
+
+    f_item->type = FAT_ITEM_TYPE_FILE;
+    f_item->item = fat16_clone_directory_item(item, sizeof(struct fat_directory_item));
+    if (!f_item->item)
+    {
+        kfree(f_item);
+        return 0;
+    }
+
+    return f_item;
+}
+
+struct fat_item* fat16_find_item_in_directory(struct disk* disk, struct fat_directory* directory, const char* name)
+{
+    struct fat_item* f_item = 0;
+    char tmp_filename[FREE95_MAX_PATH];
+    if (!directory->hash_buckets)
+    {
+        goto out;
+    }
+
+    // Only the items that share the name's hash bucket are compared
+    int i = directory->hash_buckets[fat16_hash_name(name) & directory->hash_mask];
+    while (i != FAT16_HASH_NONE)
+    {
+        fat16_get_full_relative_filename(&directory->item[i], tmp_filename, sizeof(tmp_filename));
+        if (istrncmp(tmp_filename, name, sizeof(tmp_filename)) == 0)
+        {
+            // Found it let's create a new fat_item
+            f_item = fat16_new_fat_item_for_directory_item(disk, &directory->item[i]);
+            if (f_item)
+            {
+                f_item->parent = directory;
+                f_item->index = i;
+            }
+            break;
+        }
+
+        i = directory->hash_next[i];
+    }
+
+out:
+    return f_item;
+}
+
+struct fat_item* fat16_get_directory_entry(struct disk* disk, struct path_part* path)
+{
+    struct fat_private* fat_private = disk->fs_private;
+    struct fat_item* current_item = 0;
+    struct fat_item* root_item 
+            = fat16_find_item_in_directory(disk, &fat_private->root_directory, path->part);
+    if (!root_item)
+    {
+        goto out;
+    }
+
+    struct path_part* next_part = path->next;
+    current_item = root_item;
+    while(next_part != 0)
+    {
+        if (current_item->type != FAT_ITEM_TYPE_DIRECTORY)
+        {
+            fat16_fat_item_free(current_item);
+            current_item = 0;
+            break;
+        }
+
+        struct fat_item* tmp_item = fat16_find_item_in_directory(disk, current_item->directory, next_part->part);
+        fat16_fat_item_free(current_item);
         current_item = tmp_item;
         next_part = next_part->next;
     }
@@ -635,11 +1294,213 @@ out:
     return current_item;
 }
 
-void* fat16_open(struct disk* disk, struct path_part* path, FILE_MODE mode)
+/**
+ * Resolves a path to a fat_item, the caller keeps it until fat16_release.
+ */
+void* fat16_lookup(struct disk* disk, struct path_part* path)
 {
+    struct fat_item* item = fat16_get_directory_entry(disk, path);
+    if (!item)
+    {
+        return ERROR(-ENOENT);
+    }
+
+    return item;
+}
+
+void fat16_release(void* node)
+{
+    fat16_fat_item_free(node);
+}
+
+/**
+ * Converts name.ext into the space padded upper case 8.3 form of a directory item.
+ */
+static int fat16_set_short_name(struct fat_directory_item* item, const char* name)
+{
+    memset(item->filename, ' ', sizeof(item->filename));
+    memset(item->ext, ' ', sizeof(item->ext));
+
+    int i = 0;
+    for (; *name && *name != '.'; name++)
+    {
+        if (i == sizeof(item->filename))
+        {
+            return -EBADPATH;
+        }
+        item->filename[i++] = toupper(*name);
+    }
+
+    if (i == 0)
+    {
+        return -EBADPATH;
+    }
+
+    if (*name == '.')
+    {
+        name++;
+        for (i = 0; *name; name++)
+        {
+            if (i == sizeof(item->ext) || *name == '.')
+            {
+                return -EBADPATH;
+            }
+            item->ext[i++] = toupper(*name);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Adds an empty file to a free slot of its directory. Directories are not
+ * grown, a full directory fails with -ENOMEM.
+ */
+int fat16_create(struct disk* disk, struct path_part* path)
+{
+    int res = 0;
+    struct fat_private* fat_private = disk->fs_private;
+    struct fat_directory* directory = &fat_private->root_directory;
+    while (path->next)
+    {
+        struct fat_item* item = fat16_find_item_in_directory(disk, directory, path->part);
+        if (!item)
+        {
+            res = -ENOENT;
+            goto out;
+        }
+
+        if (item->type != FAT_ITEM_TYPE_DIRECTORY)
+        {
+            fat16_fat_item_free(item);
+            res = -EBADPATH;
+            goto out;
+        }
+
+        // Directories stay in the directory cache
+        directory = item->directory;
+        fat16_fat_item_free(item);
+        path = path->next;
+    }
+
+    struct fat_directory_item new_item;
+    memset(&new_item, 0, sizeof(new_item));
+    res = fat16_set_short_name(&new_item, path->part);
+    if (res < 0)
+    {
+        goto out;
+    }
+    new_item.attribute = FAT_FILE_ARCHIVED;
+
+    res = fat16_load_directory_slots(disk, directory);
+    if (res < 0)
+    {
+        goto out;
+    }
+
+    int index = -1;
+    for (int i = 0; i < directory->capacity; i++)
+    {
+        if (directory->item[i].filename[0] == 0x00 || directory->item[i].filename[0] == 0xE5)
+        {
+            index = i;
+            break;
+        }
+    }
+
+    if (index < 0)
+    {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    res = fat16_write_directory_item(disk, directory, index, &new_item);
+    if (res < 0)
+    {
+        goto out;
+    }
+
+    if (index >= directory->total)
+    {
+        directory->total = index + 1;
+    }
+
+    fat16_free_directory_index(directory);
+    res = fat16_index_directory(directory);
+
+    // The path may be cached as one that does not exist
+    fs_invalidate(disk);
+out:
+    return res;
+}
+
+static uint32_t fat16_get_allocated_size(struct disk* disk, struct fat_file_descriptor* desc)
+{
+    struct fat_private* private = disk->fs_private;
+    uint32_t size_of_cluster_bytes = private->header.primary_header.sectors_per_cluster * disk->sector_size;
+    if (desc->extents.total == 0)
+    {
+        return 0;
+    }
+
+    struct fat_extent* extent = &desc->extents.extents[desc->extents.total - 1];
+    return (extent->file_cluster + extent->clusters) * size_of_cluster_bytes;
+}
+
+static bool fat16_is_open(struct disk* disk, struct fat_item* item)
+{
+    struct fat_private* private = disk->fs_private;
+    for (struct fat_file_descriptor* desc = private->open_files; desc; desc = desc->next)
+    {
+        if (desc->item->parent == item->parent && desc->item->index == item->index)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Gives the clusters of the file back to the FAT. The emptied directory
+ * item is written first, so no lookup can find the freed chain.
+ */
+static int fat16_truncate(struct disk* disk, struct fat_file_descriptor* desc)
+{
+    struct fat_directory_item* ritem = desc->item->item;
+    int first_cluster = fat16_get_first_cluster(ritem);
+    ritem->high_16_bits_first_cluster = 0;
+    ritem->low_16_bits_first_cluster = 0;
+    ritem->filesize = 0;
+    fat16_free_extents(&desc->extents);
+
+    int res = fat16_write_directory_item(disk, desc->item->parent, desc->item->index, ritem);
+    if (res < 0)
+    {
+        goto out;
+    }
+
+    // Cached lookups hold copies of the old item
+    fs_invalidate(disk);
+    res = fat16_free_chain(disk, first_cluster);
+out:
+    return res;
+}
+
+void* fat16_open(struct disk* disk, void* node, FILE_MODE mode)
+{
+    struct fat_item* item = node;
     if (mode != FILE_MODE_READ)
     {
-        return ERROR(-ERDONLY);
+        if (item->type != FAT_ITEM_TYPE_FILE)
+        {
+            return ERROR(-EINVARG);
+        }
+
+        if (item->item->attribute & FAT_FILE_READ_ONLY)
+        {
+            return ERROR(-ERDONLY);
+        }
     }
 
     struct fat_file_descriptor* descriptor = 0;
@@ -649,25 +1510,156 @@ void* fat16_open(struct disk* disk, struct path_part* path, FILE_MODE mode)
         return ERROR(-ENOMEM);
     }
 
-    descriptor->item = fat16_get_directory_entry(disk, path);
+    // The node stays in the lookup cache, so the descriptor gets its own item
+    descriptor->item = kzalloc(sizeof(struct fat_item));
     if (!descriptor->item)
     {
-        return ERROR(-EIO);
+        kfree(descriptor);
+        return ERROR(-ENOMEM);
+    }
+
+    descriptor->item->type = item->type;
+    descriptor->item->parent = item->parent;
+    descriptor->item->index = item->index;
+    if (item->type == FAT_ITEM_TYPE_DIRECTORY)
+    {
+        descriptor->item->directory = item->directory;
+    }
+    else
+    {
+        descriptor->item->item = fat16_clone_directory_item(item->item, sizeof(struct fat_directory_item));
+        if (!descriptor->item->item)
+        {
+            kfree(descriptor->item);
+            kfree(descriptor);
+            return ERROR(-ENOMEM);
+        }
+
+        int res = fat16_build_extents(disk, fat16_get_first_cluster(descriptor->item->item), &descriptor->extents);
+        if (res < 0)
+        {
+            fat16_fat_item_free(descriptor->item);
+            kfree(descriptor);
+            return ERROR(res);
+        }
     }
 
+    descriptor->mode = mode;
     descriptor->pos = 0;
+    if (mode == FILE_MODE_WRITE)
+    {
+        // Descriptors open on the file keep extents to its clusters
+        if (fat16_is_open(disk, descriptor->item))
+        {
+            fat16_close(disk, descriptor);
+            return ERROR(-EISTKN);
+        }
+
+        int res = fat16_truncate(disk, descriptor);
+        if (res < 0)
+        {
+            fat16_close(disk, descriptor);
+            return ERROR(res);
+        }
+    }
+    else if (mode == FILE_MODE_APPEND)
+    {
+        descriptor->pos = descriptor->item->item->filesize;
+    }
+
+    struct fat_private* private = disk->fs_private;
+    descriptor->next = private->open_files;
+    private->open_files = descriptor;
     return descriptor;
 }
 
+/**
+ * Starts reading the sectors behind total bytes at offset into the block cache.
+ */
+static void fat16_prefetch(struct disk* disk, struct fat_extent_list* list, uint32_t offset, uint32_t total)
+{
+    struct fat_private* private = disk->fs_private;
+    uint32_t size_of_cluster_bytes = private->header.primary_header.sectors_per_cluster * disk->sector_size;
+    while (total > 0)
+    {
+        struct fat_extent* extent = fat16_find_extent(list, offset / size_of_cluster_bytes);
+        if (!extent)
+        {
+            break;
+        }
+
+        uint32_t extent_start = extent->file_cluster * size_of_cluster_bytes;
+        uint32_t extent_end = extent_start + (extent->clusters * size_of_cluster_bytes);
+        uint32_t total_to_read = extent_end - offset;
+        if (total_to_read > total)
+        {
+            total_to_read = total;
+        }
+
+        uint32_t first_sector = extent->sector + ((offset - extent_start) / disk->sector_size);
+        uint32_t last_sector = extent->sector + ((offset - extent_start + total_to_read - 1) / disk->sector_size);
+        DiskPrefetch(disk, first_sector, last_sector - first_sector + 1);
+
+        offset += total_to_read;
+        total -= total_to_read;
+    }
+}
+
+/**
+ * Grows the read-ahead window while reads follow each other and drops it
+ * on a jump, then starts whatever part of the window is not on its way yet.
+ */
+static void fat16_readahead(struct disk* disk, struct fat_file_descriptor* desc, uint32_t offset)
+{
+    struct fat_private* private = disk->fs_private;
+    uint32_t size_of_cluster_bytes = private->header.primary_header.sectors_per_cluster * disk->sector_size;
+    uint32_t filesize = desc->item->item->filesize;
+
+    if (offset != desc->last_end)
+    {
+        desc->readahead = 0;
+        desc->readahead_end = desc->pos;
+        return;
+    }
+
+    desc->readahead = desc->readahead ? desc->readahead * 2 : size_of_cluster_bytes;
+    if (desc->readahead > FREE95_FS_READAHEAD_MAX)
+    {
+        desc->readahead = FREE95_FS_READAHEAD_MAX;
+    }
+
+    uint32_t start = desc->readahead_end > desc->pos ? desc->readahead_end : desc->pos;
+    uint32_t end = desc->pos + desc->readahead;
+    if (end > filesize)
+    {
+        end = filesize;
+    }
+
+    if (end > start)
+    {
+        fat16_prefetch(disk, &desc->extents, start, end - start);
+        desc->readahead_end = end;
+    }
+}
+
 int fat16_read(struct disk* disk, void* descriptor, uint32_t size, uint32_t nmemb, char* out_ptr)
 {
     int res = 0;
     struct fat_file_descriptor* fat_desc = descriptor;
-    struct fat_directory_item* item = fat_desc->item->item;
+    if (fat_desc->pending_size > 0)
+    {
+        // Buffered data is only readable once it has clusters
+        res = fat16_flush(disk, fat_desc);
+        if (res < 0)
+        {
+            goto out;
+        }
+    }
+
     int offset = fat_desc->pos;
     for (uint32_t i = 0; i < nmemb; i++)
     {
-        res = fat16_read_internal(disk, fat16_get_first_cluster(item), offset, size, out_ptr);
+        res = fat16_read_internal(disk, &fat_desc->extents, offset, size, out_ptr);
         if (ISERR(res))
         {
             goto out;
@@ -677,7 +1669,348 @@ int fat16_read(struct disk* disk, void* descriptor, uint32_t size, uint32_t nmem
         offset += size;
     }
 
+    uint32_t start = fat_desc->pos;
+    fat_desc->pos = offset;
+    fat16_readahead(disk, fat_desc, start);
+    fat_desc->last_end = offset;
+    res = nmemb;
+out:
+    return res;
+}
+
+int fat16_seek(void* private, uint32_t offset, FILE_SEEK_MODE seek_mode)
+{
+    int res = 0;
+    struct fat_file_descriptor* desc = private;
+    struct fat_item* desc_item = desc->item;
+    if (desc_item->type != FAT_ITEM_TYPE_FILE)
+    {
+        res = -EINVARG;
+        goto out;
+    }
+
+    struct fat_directory_item* ritem = desc_item->item;
+    uint32_t pos = 0;
+    switch (seek_mode)
+    {
+        case SEEK_SET:
+            pos = offset;
+            break;
+
+        case SEEK_CUR:
+            pos = desc->pos + offset;
+            break;
+
+        case SEEK_END:
+            pos = ritem->filesize + offset;
+            break;
+
+        default:
+            res = -EINVARG;
+            goto out;
+    }
+
+    if (pos > ritem->filesize)
+    {
+        res = -EIO;
+        goto out;
+    }
+
+    desc->pos = pos;
+out:
+    return res;
+}
+
+int fat16_tell(void* private)
+{
+    struct fat_file_descriptor* desc = private;
+    return desc->pos;
+}
+
+int fat16_stat(struct disk* disk, void* private, struct file_stat* stat)
+{
+    int res = 0;
+    struct fat_file_descriptor* desc = private;
+    struct fat_item* desc_item = desc->item;
+    if (desc_item->type == FAT_ITEM_TYPE_DIRECTORY)
+    {
+        stat->filesize = 0;
+        stat->flags = FILE_STAT_DIRECTORY;
+        goto out;
+    }
+
+    struct fat_directory_item* ritem = desc_item->item;
+    stat->filesize = ritem->filesize;
+    stat->flags = 0x00;
+
+    if (ritem->attribute & FAT_FILE_READ_ONLY)
+    {
+        stat->flags |= FILE_STAT_READ_ONLY;
+    }
+out:
+    return res;
+}
+
+/**
+ * Adds data past the allocated clusters to the descriptor's buffer at offset from their end.
+ */
+static int fat16_buffer(struct fat_file_descriptor* desc, uint32_t offset, const char* in, uint32_t total)
+{
+    uint32_t end = offset + total;
+    if (end > desc->pending_capacity)
+    {
+        uint32_t capacity = desc->pending_capacity ? desc->pending_capacity : FREE95_SECTOR_SIZE;
+        while (capacity < end)
+        {
+            capacity *= 2;
+        }
+
+        char* pending = kmalloc(capacity);
+        if (!pending)
+        {
+            return -ENOMEM;
+        }
+
+        if (desc->pending)
+        {
+            memcpy(pending, desc->pending, desc->pending_size);
+            kfree(desc->pending);
+        }
+
+        desc->pending = pending;
+        desc->pending_capacity = capacity;
+    }
+
+    memcpy(desc->pending + offset, (void*)in, total);
+    if (end > desc->pending_size)
+    {
+        desc->pending_size = end;
+    }
+
+    return 0;
+}
+
+/**
+ * Data inside the clusters of the file goes to the block cache, data that
+ * extends the file is buffered and only gets clusters when the descriptor
+ * is flushed, so that a file written in small pieces is allocated at once.
+ */
+int fat16_write(struct disk* disk, void* descriptor, uint32_t size, uint32_t nmemb, const char* in_ptr)
+{
+    int res = 0;
+    struct fat_file_descriptor* desc = descriptor;
+    if (desc->mode == FILE_MODE_READ)
+    {
+        res = -ERDONLY;
+        goto out;
+    }
+
+    struct fat_directory_item* ritem = desc->item->item;
+    uint32_t allocated = fat16_get_allocated_size(disk, desc);
+    uint32_t total = size * nmemb;
+    if (desc->mode == FILE_MODE_APPEND)
+    {
+        desc->pos = ritem->filesize;
+    }
+
+    if (desc->pos < allocated)
+    {
+        uint32_t total_to_write = allocated - desc->pos;
+        if (total_to_write > total)
+        {
+            total_to_write = total;
+        }
+
+        res = fat16_write_internal(disk, &desc->extents, desc->pos, total_to_write, in_ptr);
+        if (res < 0)
+        {
+            goto out;
+        }
+
+        in_ptr += total_to_write;
+        desc->pos += total_to_write;
+        total -= total_to_write;
+    }
+
+    if (total > 0)
+    {
+        res = fat16_buffer(desc, desc->pos - allocated, in_ptr, total);
+        if (res < 0)
+        {
+            goto out;
+        }
+        desc->pos += total;
+    }
+
+    if (desc->pos > ritem->filesize)
+    {
+        ritem->filesize = desc->pos;
+    }
+    desc->dirty = true;
+
+    if (desc->pending_size >= FREE95_FS_WRITE_BUFFER_MAX)
+    {
+        res = fat16_flush(disk, desc);
+        if (res < 0)
+        {
+            goto out;
+        }
+    }
+
     res = nmemb;
 out:
     return res;
 }
+
+/**
+ * Allocates clusters for the buffered data, one contiguous run when the disk
+ * has one, and stores the changed directory item. FAT sectors stay in memory
+ * and the data and directory sectors in the block cache until fat16_sync.
+ */
+int fat16_flush(struct disk* disk, void* private)
+{
+    int res = 0;
+    struct fat_file_descriptor* desc = private;
+    struct fat_private* fat_private = disk->fs_private;
+    if (desc->item->type != FAT_ITEM_TYPE_FILE)
+    {
+        goto out;
+    }
+
+    struct fat_directory_item* ritem = desc->item->item;
+    if (desc->pending_size > 0)
+    {
+        uint32_t size_of_cluster_bytes = fat_private->header.primary_header.sectors_per_cluster * disk->sector_size;
+        uint32_t allocated = fat16_get_allocated_size(disk, desc);
+        int last = 0;
+        if (desc->extents.total > 0)
+        {
+            struct fat_extent* extent = &desc->extents.extents[desc->extents.total - 1];
+            last = fat16_sector_to_cluster(fat_private, extent->sector) + extent->clusters - 1;
+        }
+
+        int first = fat16_allocate_chain(disk, last, (desc->pending_size + size_of_cluster_bytes - 1) / size_of_cluster_bytes);
+        if (first < 0)
+        {
+            res = first;
+            goto out;
+        }
+
+        if (!last)
+        {
+            ritem->low_16_bits_first_cluster = first;
+        }
+
+        fat16_free_extents(&desc->extents);
+        res = fat16_build_extents(disk, fat16_get_first_cluster(ritem), &desc->extents);
+        if (res < 0)
+        {
+            goto out;
+        }
+
+        res = fat16_write_internal(disk, &desc->extents, allocated, desc->pending_size, desc->pending);
+        if (res < 0)
+        {
+            goto out;
+        }
+
+        desc->pending_size = 0;
+    }
+
+    if (desc->dirty)
+    {
+        res = fat16_write_directory_item(disk, desc->item->parent, desc->item->index, ritem);
+        if (res < 0)
+        {
+            goto out;
+        }
+
+        // Cached lookups hold copies of the old item
+        fs_invalidate(disk);
+        desc->dirty = false;
+    }
+out:
+    return res;
+}
+
+/**
+ * Writes the changed FAT sectors to every FAT copy, then everything the block cache holds for the disk.
+ */
+int fat16_sync(struct disk* disk)
+{
+    int res = 0;
+    struct fat_private* fat_private = disk->fs_private;
+    struct fat_header* primary_header = &fat_private->header.primary_header;
+    uint32_t fat_sectors = primary_header->sectors_per_fat;
+    uint32_t* dirty = fat_private->fat_dirty;
+
+    uint32_t sector = 0;
+    while (sector < fat_sectors)
+    {
+        if (!(dirty[sector / 32] & (1 << (sector % 32))))
+        {
+            sector++;
+            continue;
+        }
+
+        // Neighbouring dirty sectors are written as one run
+        uint32_t end = sector;
+        while (end < fat_sectors && (dirty[end / 32] & (1 << (end % 32))))
+        {
+            end++;
+        }
+
+        char* data = (char*)fat_private->fat + (sector * disk->sector_size);
+        for (uint32_t copy = 0; copy < primary_header->fat_copies; copy++)
+        {
+            uint32_t lba = fat16_get_first_fat_sector(fat_private) + (copy * fat_sectors) + sector;
+            res = DiskWriteBlk(disk, lba, end - sector, data);
+            if (res < 0)
+            {
+                goto out;
+            }
+        }
+
+        for (; sector < end; sector++)
+        {
+            dirty[sector / 32] &= ~(1 << (sector % 32));
+        }
+    }
+
+    res = DiskFlush(disk);
+out:
+    return res;
+}
+
+int fat16_close(struct disk* disk, void* private)
+{
+    struct fat_file_descriptor* desc = private;
+    int res = 0;
+    if (desc->mode != FILE_MODE_READ)
+    {
+        res = fat16_flush(disk, desc);
+    }
+
+    // Descriptors that failed to open were never linked
+    struct fat_private* fat_private = disk->fs_private;
+    struct fat_file_descriptor** link = &fat_private->open_files;
+    while (*link && *link != desc)
+    {
+        link = &(*link)->next;
+    }
+
+    if (*link)
+    {
+        *link = desc->next;
+    }
+
+    if (desc->pending)
+    {
+        kfree(desc->pending);
+    }
+
+    fat16_free_extents(&desc->extents);
+    fat16_fat_item_free(desc->item);
+    kfree(desc);
+    return res;
+}
@@ -25,9 +25,30 @@ Abstract:
 #include "../status.h"
 #include "../../init/kernel.h"
 #include "fat/fat16.h"
+#include "../sync/sync.h"
 
 struct filesystem* filesystems[FREE95_MAX_FILESYSTEMS];
 struct file_descriptor* file_descriptors[FREE95_MAX_FILE_DESCRIPTORS];
+// Guards the slots of the descriptor table, which every CPU opens and closes files in
+static KSPIN_LOCK file_descriptors_lock = 0;
+
+// Path lookup cache, allocated by fs_init
+static struct dentry* dentries;
+static uint32_t dentry_clock;
+
+// Held by the task inside the filesystem code. It is recursive, a page fault
+// in the middle of a read loads the faulting page with another read.
+static KMUTEX fs_mutex;
+
+static void fs_lock()
+{
+    KeWaitForSingleObject(&fs_mutex, 0);
+}
+
+static void fs_unlock()
+{
+    KeReleaseMutex(&fs_mutex, FALSE);
+}
 
 static struct filesystem** fs_get_free_filesystem()
 {
@@ -70,17 +91,26 @@ void fs_load()
 void fs_init()
 {
     memset(file_descriptors, 0, sizeof(file_descriptors));
+    KeInitializeMutex(&fs_mutex);
+    dentries = kzalloc(FREE95_DENTRY_CACHE_SIZE * sizeof(struct dentry));
     fs_load();
 }
 
 static int file_new_descriptor(struct file_descriptor** desc_out)
 {
     int res = -ENOMEM;
+    // Allocated up front, the heap is not called with the table locked
+    struct file_descriptor* desc = kzalloc(sizeof(struct file_descriptor));
+    if (!desc)
+    {
+        return res;
+    }
+
+    ULONG flags = KeAcquireSpinLock(&file_descriptors_lock);
     for (int i = 0; i < FREE95_MAX_FILE_DESCRIPTORS; i++)
     {
         if (file_descriptors[i] == 0)
         {
-            struct file_descriptor* desc = kzalloc(sizeof(struct file_descriptor));
             // Descriptors start at 1
             desc->index = i + 1;
             file_descriptors[i] = desc;
@@ -89,10 +119,24 @@ static int file_new_descriptor(struct file_descriptor** desc_out)
             break;
         }
     }
+    KeReleaseSpinLock(&file_descriptors_lock, flags);
+
+    if (res < 0)
+    {
+        kfree(desc);
+    }
 
     return res;
 }
 
+static void file_free_descriptor(struct file_descriptor* desc)
+{
+    ULONG flags = KeAcquireSpinLock(&file_descriptors_lock);
+    file_descriptors[desc->index - 1] = 0;
+    KeReleaseSpinLock(&file_descriptors_lock, flags);
+    kfree(desc);
+}
+
 static struct file_descriptor* file_get_descriptor(int fd)
 {
     if (fd <= 0 || fd >= FREE95_MAX_FILE_DESCRIPTORS)
@@ -138,25 +182,197 @@ FILE_MODE file_get_mode_by_string(const char* str)
     return mode;
 }
 
-int fopen(const char* filename, const char* mode_str)
+/**
+ * Lower cases the path and drops repeated and trailing separators,
+ * so every spelling of a path shares one cache entry.
+ */
+static int dentry_normalize(const char* path, char* out)
+{
+    int len = strnlen(path, FREE95_MAX_PATH);
+    if (len >= FREE95_MAX_PATH || len < 3 || !isdigit(path[0]) || path[1] != ':' || path[2] != '/')
+    {
+        return -EBADPATH;
+    }
+
+    int o = 0;
+    for (int i = 0; i < len; i++)
+    {
+        if (path[i] == '/' && o > 0 && out[o - 1] == '/')
+        {
+            continue;
+        }
+
+        out[o++] = tolower(path[i]);
+    }
+
+    while (o > 3 && out[o - 1] == '/')
+    {
+        o--;
+    }
+    out[o] = 0;
+
+    // We cannot have just a root path 0:/ 0:/test.txt
+    return o > 3 ? 0 : -EINVARG;
+}
+
+static uint32_t dentry_hash(const char* path)
+{
+    uint32_t hash = 2166136261u;
+    while (*path)
+    {
+        hash ^= (uint8_t)*path++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static struct dentry* dentry_find(struct disk* disk, const char* path, uint32_t hash)
+{
+    for (int i = 0; dentries && i < FREE95_DENTRY_CACHE_SIZE; i++)
+    {
+        struct dentry* dentry = &dentries[i];
+        if (dentry->valid && dentry->hash == hash && dentry->disk == disk && strncmp(dentry->path, path, FREE95_MAX_PATH) == 0)
+        {
+            dentry->last_used = ++dentry_clock;
+            return dentry;
+        }
+    }
+
+    return 0;
+}
+
+static void dentry_insert(struct disk* disk, const char* path, uint32_t hash, void* node)
+{
+    if (!dentries)
+    {
+        return;
+    }
+
+    // Take a free entry, or the one that was used longest ago
+    struct dentry* dentry = &dentries[0];
+    for (int i = 0; i < FREE95_DENTRY_CACHE_SIZE && dentry->valid; i++)
+    {
+        if (!dentries[i].valid || dentries[i].last_used < dentry->last_used)
+        {
+            dentry = &dentries[i];
+        }
+    }
+
+    if (dentry->valid && dentry->node)
+    {
+        dentry->disk->filesystem->release(dentry->node);
+    }
+
+    dentry->disk = disk;
+    dentry->hash = hash;
+    strncpy(dentry->path, path, FREE95_MAX_PATH);
+    dentry->node = node;
+    dentry->last_used = ++dentry_clock;
+    dentry->valid = true;
+}
+
+/**
+ * Forgets every cached path of the disk, filesystems call this when they change directories.
+ */
+void fs_invalidate(struct disk* disk)
+{
+    for (int i = 0; dentries && i < FREE95_DENTRY_CACHE_SIZE; i++)
+    {
+        struct dentry* dentry = &dentries[i];
+        if (!dentry->valid || dentry->disk != disk)
+        {
+            continue;
+        }
+
+        if (dentry->node)
+        {
+            disk->filesystem->release(dentry->node);
+        }
+        dentry->valid = false;
+    }
+}
+
+/**
+ * Resolves a path through the lookup cache, the filesystem is only asked on a miss.
+ * Paths that do not exist are cached as well and fail without touching the disk.
+ */
+static void* fs_lookup(struct disk* disk, const char* path)
+{
+    void* node = 0;
+    uint32_t hash = dentry_hash(path);
+    struct dentry* dentry = dentry_find(disk, path, hash);
+    if (dentry)
+    {
+        node = dentry->node ? dentry->node : ERROR(-ENOENT);
+        goto out;
+    }
+
+    struct path_root* root_path = pathparser_parse(path, NULL);
+    if (!root_path)
+    {
+        node = ERROR(-EINVARG);
+        goto out;
+    }
+
+    if (!root_path->first)
+    {
+        pathparser_free(root_path);
+        node = ERROR(-EINVARG);
+        goto out;
+    }
+
+    node = disk->filesystem->lookup(disk, root_path->first);
+    pathparser_free(root_path);
+    if (!ISERR(node))
+    {
+        dentry_insert(disk, path, hash, node);
+    }
+    else if (ERROR_I(node) == -ENOENT)
+    {
+        dentry_insert(disk, path, hash, 0);
+    }
+
+out:
+    return node;
+}
+
+static int fs_create(struct disk* disk, const char* path)
 {
     int res = 0;
-    struct path_root* root_path = pathparser_parse(filename, NULL);
+    struct path_root* root_path = pathparser_parse(path, NULL);
     if (!root_path)
     {
         res = -EINVARG;
         goto out;
     }
 
-    // We cannot have just a root path 0:/ 0:/test.txt
     if (!root_path->first)
     {
+        pathparser_free(root_path);
         res = -EINVARG;
         goto out;
     }
 
+    res = disk->filesystem->create(disk, root_path->first);
+    pathparser_free(root_path);
+out:
+    return res;
+}
+
+int fopen(const char* filename, const char* mode_str)
+{
+    int res = 0;
+    fs_lock();
+    char path[FREE95_MAX_PATH];
+    res = dentry_normalize(filename, path);
+    if (res < 0)
+    {
+        goto out;
+    }
+
     // Ensure the disk we are reading from exists
-    struct disk* disk = GetDisk(root_path->drive_no);
+    struct disk* disk = GetDisk(tonumericdigit(path[0]));
     if (!disk)
     {
         res = -EIO;
@@ -176,7 +392,26 @@ int fopen(const char* filename, const char* mode_str)
         goto out;
     }
 
-    void* descriptor_private_data = disk->filesystem->open(disk, root_path->first, mode);
+    void* node = fs_lookup(disk, path);
+    if (ISERR(node) && ERROR_I(node) == -ENOENT && mode != FILE_MODE_READ)
+    {
+        // Writing to a file that does not exist creates it
+        res = fs_create(disk, path);
+        if (res < 0)
+        {
+            goto out;
+        }
+
+        node = fs_lookup(disk, path);
+    }
+
+    if (ISERR(node))
+    {
+        res = ERROR_I(node);
+        goto out;
+    }
+
+    void* descriptor_private_data = disk->filesystem->open(disk, node, mode);
     if (ISERR(descriptor_private_data))
     {
         res = ERROR_I(descriptor_private_data);
@@ -187,6 +422,8 @@ int fopen(const char* filename, const char* mode_str)
     res = file_new_descriptor(&desc);
     if (res < 0)
     {
+        // The filesystem already opened the file, it has to let go of it again
+        disk->filesystem->close(disk, descriptor_private_data);
         goto out;
     }
     desc->filesystem = disk->filesystem;
@@ -195,7 +432,9 @@ int fopen(const char* filename, const char* mode_str)
     res = desc->index;
 
 out:
-    // fopen shouldnt return negative values
+    fs_unlock();
+
+    // fopen shouldnt return negative values, descriptors start at 1 so 0 is the error
     if (res < 0)
         res = 0;
 
@@ -205,6 +444,7 @@ out:
 int fread(void* ptr, uint32_t size, uint32_t nmemb, int fd)
 {
     int res = 0;
+    fs_lock();
     if (size == 0 || nmemb == 0 || fd < 1)
     {
         res = -EINVARG;
@@ -220,5 +460,179 @@ int fread(void* ptr, uint32_t size, uint32_t nmemb, int fd)
 
     res = desc->filesystem->read(desc->disk, desc->private, size, nmemb, (char*) ptr);
 out:
+    fs_unlock();
+    return res;
+}
+
+/**
+ * Reads like fread() from the given offset, the seek and the read happen
+ * under one lock so other users of the descriptor cannot move it between them.
+ */
+int fpread(void* ptr, uint32_t size, uint32_t nmemb, int fd, uint32_t offset)
+{
+    int res = 0;
+    fs_lock();
+    if (size == 0 || nmemb == 0 || fd < 1)
+    {
+        res = -EINVARG;
+        goto out;
+    }
+
+    struct file_descriptor* desc = file_get_descriptor(fd);
+    if (!desc)
+    {
+        res = -EINVARG;
+        goto out;
+    }
+
+    res = desc->filesystem->seek(desc->private, offset, SEEK_SET);
+    if (res < 0)
+    {
+        goto out;
+    }
+
+    res = desc->filesystem->read(desc->disk, desc->private, size, nmemb, (char*) ptr);
+out:
+    fs_unlock();
+    return res;
+}
+
+int fwrite(const void* ptr, uint32_t size, uint32_t nmemb, int fd)
+{
+    int res = 0;
+    fs_lock();
+    if (size == 0 || nmemb == 0 || fd < 1)
+    {
+        res = -EINVARG;
+        goto out;
+    }
+
+    struct file_descriptor* desc = file_get_descriptor(fd);
+    if (!desc)
+    {
+        res = -EINVARG;
+        goto out;
+    }
+
+    res = desc->filesystem->write(desc->disk, desc->private, size, nmemb, (const char*) ptr);
+out:
+    fs_unlock();
+    return res;
+}
+
+int fflush(int fd)
+{
+    int res = 0;
+    fs_lock();
+    struct file_descriptor* desc = file_get_descriptor(fd);
+    if (!desc)
+    {
+        res = -EINVARG;
+        goto out;
+    }
+
+    res = desc->filesystem->flush(desc->disk, desc->private);
+out:
+    fs_unlock();
+    return res;
+}
+
+int fseek(int fd, int offset, FILE_SEEK_MODE whence)
+{
+    int res = 0;
+    fs_lock();
+    struct file_descriptor* desc = file_get_descriptor(fd);
+    if (!desc)
+    {
+        res = -EINVARG;
+        goto out;
+    }
+
+    res = desc->filesystem->seek(desc->private, offset, whence);
+out:
+    fs_unlock();
+    return res;
+}
+
+int ftell(int fd)
+{
+    int res = 0;
+    fs_lock();
+    struct file_descriptor* desc = file_get_descriptor(fd);
+    if (!desc)
+    {
+        res = -EINVARG;
+        goto out;
+    }
+
+    res = desc->filesystem->tell(desc->private);
+out:
+    fs_unlock();
+    return res;
+}
+
+int fstat(int fd, struct file_stat* stat)
+{
+    int res = 0;
+    fs_lock();
+    struct file_descriptor* desc = file_get_descriptor(fd);
+    if (!desc)
+    {
+        res = -EINVARG;
+        goto out;
+    }
+
+    res = desc->filesystem->stat(desc->disk, desc->private, stat);
+out:
+    fs_unlock();
+    return res;
+}
+
+int fclose(int fd)
+{
+    int res = 0;
+    fs_lock();
+    struct file_descriptor* desc = file_get_descriptor(fd);
+    if (!desc)
+    {
+        res = -EINVARG;
+        goto out;
+    }
+
+    // The filesystem releases the descriptor even when writing it back failed
+    res = desc->filesystem->close(desc->disk, desc->private);
+    file_free_descriptor(desc);
+out:
+    fs_unlock();
+    return res;
+}
+
+/**
+ * Writes the data of every open file and everything the filesystems keep
+ * in memory back to the disks.
+ */
+int fs_sync()
+{
+    int res = 0;
+    fs_lock();
+    for (int i = 0; i < FREE95_MAX_FILE_DESCRIPTORS; i++)
+    {
+        struct file_descriptor* desc = file_descriptors[i];
+        if (desc && desc->filesystem->flush(desc->disk, desc->private) < 0)
+        {
+            res = -EIO;
+        }
+    }
+
+    struct disk* disk = 0;
+    for (int i = 0; (disk = GetDisk(i)) != 0; i++)
+    {
+        if (disk->filesystem && disk->filesystem->sync(disk) < 0)
+        {
+            res = -EIO;
+        }
+    }
+
+    fs_unlock();
     return res;
 }
@@ -2,7 +2,9 @@
 #define FILE_H
 
 #include "pparser.h"
+#include "../config.h"
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef unsigned int FILE_SEEK_MODE;
 enum
@@ -22,17 +24,51 @@ enum
     FILE_MODE_INVALID
 };
 
+typedef unsigned int FILE_STAT_FLAGS;
+#define FILE_STAT_READ_ONLY 0b00000001
+#define FILE_STAT_DIRECTORY 0b00000010
+
+struct file_stat
+{
+    FILE_STAT_FLAGS flags;
+    uint32_t filesize;
+};
+
 struct disk;
-typedef void*(*FS_OPEN_FUNCTION)(struct disk* disk, struct path_part* path, FILE_MODE mode);
+// Resolves a path to a filesystem node, or returns ERROR(-ENOENT) when it does not exist
+typedef void*(*FS_LOOKUP_FUNCTION)(struct disk* disk, struct path_part* path);
+typedef void (*FS_RELEASE_FUNCTION)(void* node);
+typedef void*(*FS_OPEN_FUNCTION)(struct disk* disk, void* node, FILE_MODE mode);
 typedef int (*FS_READ_FUNCTION)(struct disk* disk, void* private, uint32_t size, uint32_t nmemb, char* out);
 typedef int (*FS_RESOLVE_FUNCTION)(struct disk* disk);
+typedef int (*FS_SEEK_FUNCTION)(void* private, uint32_t offset, FILE_SEEK_MODE seek_mode);
+typedef int (*FS_TELL_FUNCTION)(void* private);
+typedef int (*FS_STAT_FUNCTION)(struct disk* disk, void* private, struct file_stat* stat);
+typedef int (*FS_CLOSE_FUNCTION)(struct disk* disk, void* private);
+// Creates an empty file at the path, its directory has to exist
+typedef int (*FS_CREATE_FUNCTION)(struct disk* disk, struct path_part* path);
+typedef int (*FS_WRITE_FUNCTION)(struct disk* disk, void* private, uint32_t size, uint32_t nmemb, const char* in);
+// Hands data the descriptor buffers to the disk layer
+typedef int (*FS_FLUSH_FUNCTION)(struct disk* disk, void* private);
+// Writes everything the filesystem and the block cache hold for the disk back
+typedef int (*FS_SYNC_FUNCTION)(struct disk* disk);
 
 struct filesystem
 {
     // Filesystem should return zero from resolve if the provided disk is using its filesystem
     FS_RESOLVE_FUNCTION resolve;
+    FS_LOOKUP_FUNCTION lookup;
+    FS_RELEASE_FUNCTION release;
     FS_OPEN_FUNCTION open;
     FS_READ_FUNCTION read;
+    FS_SEEK_FUNCTION seek;
+    FS_TELL_FUNCTION tell;
+    FS_STAT_FUNCTION stat;
+    FS_CLOSE_FUNCTION close;
+    FS_CREATE_FUNCTION create;
+    FS_WRITE_FUNCTION write;
+    FS_FLUSH_FUNCTION flush;
+    FS_SYNC_FUNCTION sync;
 
     char name[20];
 };
@@ -50,11 +86,36 @@ struct file_descriptor
     struct disk* disk;
 };
 
+// Cached result of a path lookup
+struct dentry
+{
+    struct disk* disk;
+    uint32_t hash;
+
+    // Normalized path, lower case without repeated or trailing separators
+    char path[FREE95_MAX_PATH];
+
+    // Filesystem node of the path, 0 when the path does not exist
+    void* node;
+
+    uint32_t last_used;
+    bool valid;
+};
+
 void fs_init();
 int fopen(const char* filename, const char* mode_str);
 int fread(void* ptr, uint32_t size, uint32_t nmemb, int fd);
+int fpread(void* ptr, uint32_t size, uint32_t nmemb, int fd, uint32_t offset);
+int fwrite(const void* ptr, uint32_t size, uint32_t nmemb, int fd);
+int fflush(int fd);
+int fseek(int fd, int offset, FILE_SEEK_MODE whence);
+int ftell(int fd);
+int fstat(int fd, struct file_stat* stat);
+int fclose(int fd);
 
 void fs_insert_filesystem(struct filesystem* filesystem);
+void fs_invalidate(struct disk* disk);
+int fs_sync();
 struct filesystem* fs_resolve(struct disk* disk);
 
 #endif
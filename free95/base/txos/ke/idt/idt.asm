@@ -1,13 +1,24 @@
 section .asm
 
+extern int20h_handler
 extern int21h_handler
+extern int24h_handler
+extern int76h_handler
+extern int40h_handler
 extern syscall_handler
 extern no_interrupt_handler
+extern idt_page_fault_handler
 
+global int20h
 global int21h
+global int24h
+global int76h
+global int40h
 global int2eh
 global idt_load
 global no_interrupt
+global idt_page_fault
+global idt_spurious
 global enable_interrupts
 global disable_interrupts
 
@@ -28,6 +39,15 @@ idt_load:
 	pop ebp
     ret
 
+; The handler may switch tasks, the frame stays on the kernel stack of the preempted task
+int20h:
+	pushad
+	push esp
+	call int20h_handler
+	add esp, 4
+	popad
+	iret
+
 int21h:
 	cli
 	pushad
@@ -36,6 +56,31 @@ int21h:
 	sti
 	iret
 
+int24h:
+	cli
+	pushad
+	call int24h_handler
+	popad
+	sti
+	iret
+
+int76h:
+	cli
+	pushad
+	call int76h_handler
+	popad
+	sti
+	iret
+
+; Like int20h, the local APIC timer preempts tasks on the other CPUs
+int40h:
+	pushad
+	push esp
+	call int40h_handler
+	add esp, 4
+	popad
+	iret
+
 int2eh:
 	pushad
 
@@ -43,12 +88,12 @@ int2eh:
 
 	push eax
 	call syscall_handler
-
-	mov dword[tmp_res], eax
 	add esp, 8
 
+	; The result goes in the eax pushad saved, a global would be shared by every CPU
+	mov [esp+28], eax
+
 	popad
-	mov eax, [tmp_res]
 	iretd
 
 no_interrupt:
@@ -59,5 +104,18 @@ no_interrupt:
 	sti
 	iret
 
-section .data
-tmp_res: dd 0
+; The CPU pushes an error code for page faults, it is dropped before returning
+idt_page_fault:
+	pushad
+	mov eax, cr2
+	push dword [esp+32]
+	push eax
+	call idt_page_fault_handler
+	add esp, 8
+	popad
+	add esp, 4
+	iretd
+
+; Spurious local APIC interrupts are not acknowledged
+idt_spurious:
+	iret
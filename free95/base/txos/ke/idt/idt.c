@@ -23,6 +23,12 @@ Abstract:
 #include "../io/io.h"
 #include "../bug.h"
 #include "../../init/loader.h"
+#include "../disk/disk.h"
+#include "../fs/file.h"
+#include "../task/task.h"
+#include "../timer/pit.h"
+#include "../sync/sync.h"
+#include "../smp/smp.h"
 
 #define RING3 0xEE
 
@@ -30,9 +36,15 @@ struct idt_desc idt_descriptors[FREE95_TOTAL_INTERRUPTS];
 struct idtr_desc idtr_descriptor;
 
 extern void idt_load(struct idtr_desc* ptr);
+extern void int20h();
 extern void int21h();
+extern void int24h();
+extern void int76h();
+extern void int40h();
 extern void int2eh();
 extern void no_interrupt();
+extern void idt_spurious();
+extern void idt_page_fault();
 
 char* strcat(char* dest, const char* src)
 {
@@ -72,8 +84,34 @@ static char kb[] =
 static char input_buffer[256]; // Global input buffer
 static int input_pos = 0;                   // Current position in the buffer
 
+// Signaled for every key, the shell sleeps on it between redraws
+static KEVENT input_event;
+
+// IRQ0, the PIT
+void int20h_handler(struct interrupt_frame* frame)
+{
+    // Acknowledged first, the scheduler may not return here until this task runs again
+    outb(0x20, 0x20);
+
+    KeEnterInterrupt();
+    pit_tick();
+    KeClockTick();
+    KeLeaveInterrupt();
+
+    task_tick(frame);
+}
+
+// The local APIC timer of the other CPUs, the PIT only reaches the BSP
+void int40h_handler(struct interrupt_frame* frame)
+{
+    smp_apic_eoi();
+    task_tick(frame);
+}
+
 void int21h_handler()
 {
+    KeEnterInterrupt();
+    smp_lock_kernel();
     uint8_t scancode = insb(KEYBOARD_DATA_PORT);
     char key = kb[scancode];
 
@@ -98,7 +136,43 @@ void int21h_handler()
         PrintChar(key);
     }
 
+    // The task waiting for input handles the key before CPU-bound tasks get the CPU back
+    KeSetEvent(&input_event, FREE95_PRIORITY_BOOST_KEYBOARD, FALSE);
+    smp_unlock_kernel();
+    KeLeaveInterrupt();
+
     outb(0x20, 0x20);
+    task_schedule();
+}
+
+// IRQ4, COM1
+void int24h_handler()
+{
+    KeEnterInterrupt();
+    smp_lock_kernel();
+    DbgInterrupt();
+    smp_unlock_kernel();
+    KeLeaveInterrupt();
+
+    outb(0x20, 0x20);
+    task_schedule();
+}
+
+// IRQ14, the primary ATA channel
+void int76h_handler()
+{
+    KeEnterInterrupt();
+    smp_lock_kernel();
+    DiskInterrupt();
+    smp_unlock_kernel();
+    KeLeaveInterrupt();
+
+    // The slave PIC has to be acknowledged before the master
+    outb(0xA0, 0x20);
+    outb(0x20, 0x20);
+
+    // The task waiting for the request may have been woken with a higher priority than the current one
+    task_schedule();
 }
 
 int NtGetInputBufferSyscall(char *buffer)
@@ -166,6 +240,12 @@ int NtDisplayStringSyscall(PUNICODE_STRING String)
 
 NTSTATUS NtShutdownSystemSyscall(SHUTDOWN_ACTION Action)
 {
+    if (Action == ShutdownPowerOff || Action == ShutdownReboot)
+    {
+        // Written files are only in memory until they are synced
+        fs_sync();
+    }
+
     if (Action == ShutdownPowerOff)
     {
         outw(0x604, 0x2000); // QEMU-specific
@@ -209,6 +289,8 @@ void *syscall_dispatcher(uint32_t syscall_number, uint32_t arg1, uint32_t arg2,
 {
     void* result = (void*)STATUS_INVALID_SYSTEM_SERVICE;
 
+    // One CPU at a time runs system calls, sleeping inside one lets the others in
+    smp_lock_kernel();
     switch (syscall_number)
     {
         /* NOTE: Syscalls below are NOT real NT 4.0 Syscalls */
@@ -236,6 +318,29 @@ void *syscall_dispatcher(uint32_t syscall_number, uint32_t arg1, uint32_t arg2,
             result = (void*)LdrExecBat((char*)arg1);
             break;
 
+        case 0x05:
+            result = (void*)LdrStartPe((char*)arg1);
+            break;
+
+        case 0x06:
+            // Images are unloaded while the task can still wait for the filesystem
+            LdrReleaseTask(task_current());
+            task_exit();
+            break;
+
+        case 0x07:
+            task_yield();
+            result = STATUS_SUCCESS;
+            break;
+
+        case 0x08:
+            result = (void*)KeWaitForSingleObject(&input_event, (PULONG)arg1);
+            break;
+
+        case 0x09:
+            result = (void*)LdrUnloadPe((LPVOID)arg1);
+            break;
+
         /* NOTE: Real NT syscalls begin here */
 
         /* NOTE: NTDLL.DLL Syscalls */
@@ -264,11 +369,12 @@ void *syscall_dispatcher(uint32_t syscall_number, uint32_t arg1, uint32_t arg2,
             Print("Syscall failed with status: 0xC000001C\n");
             break;
     }
+    smp_unlock_kernel();
 
     return (void*)result;
 }
 
-void syscall_handler()
+void* syscall_handler()
 {
     uint32_t syscall_number;
     uint32_t arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9;
@@ -285,7 +391,7 @@ void syscall_handler()
     asm volatile("mov 20(%%esp), %0" : "=r"(arg8));
     asm volatile("mov 24(%%esp), %0" : "=r"(arg9));
 
-    syscall_dispatcher(syscall_number, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9);
+    return syscall_dispatcher(syscall_number, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9);
 }
 
 
@@ -299,9 +405,20 @@ void idt_zero()
     KeBugCheck(KMODE_DIV_ZERO);
 }
 
-void idt_pf()
+void idt_page_fault_handler(uint32_t address, uint32_t error_code)
 {
+    smp_lock_kernel();
+
+    // Pages of loaded images are read on first access
+    if (LdrHandlePageFault(address, error_code) == STATUS_SUCCESS)
+    {
+        goto out;
+    }
+
     KeBugCheck(KMODE_PAGE_FAULT);
+
+out:
+    smp_unlock_kernel();
 }
 
 void idt_gpf()
@@ -341,6 +458,8 @@ void idt_set(int interrupt_no, void* address)
 
 void idt_init()
 {
+    KeInitializeEvent(&input_event, SynchronizationEvent, FALSE);
+
     memset(idt_descriptors, 0, sizeof(idt_descriptors));
     idtr_descriptor.limit = sizeof(idt_descriptors) -1;
     idtr_descriptor.base = (uint32_t) idt_descriptors;
@@ -353,14 +472,25 @@ void idt_init()
     idt_set(0x2E, int2eh);
 
     idt_set(0, idt_zero);
-    idt_set(14, idt_pf);
+    idt_set(14, idt_page_fault);
     idt_set(13, idt_gpf);
     idt_set(6, idt_inv);
     idt_set(8, idt_df);
     idt_set(11, idt_snp);
 
+    idt_set(0x20, int20h);
     idt_set(0x21, int21h);
+    idt_set(0x24, int24h);
+    idt_set(0x76, int76h);
+    idt_set(FREE95_APIC_TIMER_VECTOR, int40h);
+    idt_set(FREE95_APIC_SPURIOUS_VECTOR, idt_spurious);
 
     // Load the interrupt descriptor table
     idt_load(&idtr_descriptor);
 }
+
+// The other CPUs share the table the BSP built
+void idt_init_cpu()
+{
+    idt_load(&idtr_descriptor);
+}
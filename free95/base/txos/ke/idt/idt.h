@@ -25,6 +25,25 @@ struct idt_desc
     uint16_t offset_2; // Offset bits 16-31
 } __attribute__((packed));
 
+// What the interrupt stubs leave on the stack, pushad and the frame the CPU pushed.
+// esp and ss are only there when the interrupt came from ring 3
+struct interrupt_frame
+{
+    uint32_t edi;
+    uint32_t esi;
+    uint32_t ebp;
+    uint32_t reserved;
+    uint32_t ebx;
+    uint32_t edx;
+    uint32_t ecx;
+    uint32_t eax;
+    uint32_t ip;
+    uint32_t cs;
+    uint32_t flags;
+    uint32_t esp;
+    uint32_t ss;
+} __attribute__((packed));
+
 struct idtr_desc
 {
     uint16_t limit; // Size of descriptor table -1
@@ -63,6 +82,7 @@ typedef LPOSVERSIONINFOEXA LPOSVERSIONINFOEX;
 int isEnter();
 void KeBugCheck(unsigned long BugCheckCode);
 void idt_init();
+void idt_init_cpu();
 void enable_interrupts();
 void disable_interrupts();
 
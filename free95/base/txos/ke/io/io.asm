@@ -2,8 +2,12 @@ section .asm
 
 global insb
 global insw
+global insw_rep
+global outsw_rep
+global insl
 global outb
 global outw
+global outl
 
 insb:
     push ebp
@@ -27,6 +31,48 @@ insw:
     pop ebp
     ret
 
+insl:
+    push ebp
+    mov ebp, esp
+
+    mov edx, [ebp+8]
+    in eax, dx
+
+    pop ebp
+    ret
+
+; Reads count words from the port into the buffer
+insw_rep:
+    push ebp
+    mov ebp, esp
+    push edi
+
+    mov edx, [ebp+8]
+    mov edi, [ebp+12]
+    mov ecx, [ebp+16]
+    cld
+    rep insw
+
+    pop edi
+    pop ebp
+    ret
+
+; Writes count words from the buffer to the port
+outsw_rep:
+    push ebp
+    mov ebp, esp
+    push esi
+
+    mov edx, [ebp+8]
+    mov esi, [ebp+12]
+    mov ecx, [ebp+16]
+    cld
+    rep outsw
+
+    pop esi
+    pop ebp
+    ret
+
 outb:
     push ebp
     mov ebp, esp
@@ -48,3 +94,14 @@ outw:
 
     pop ebp
     ret
+
+outl:
+    push ebp
+    mov ebp, esp
+
+    mov eax, [ebp+12]
+    mov edx, [ebp+8]
+    out dx, eax
+
+    pop ebp
+    ret
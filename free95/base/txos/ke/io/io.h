@@ -3,8 +3,12 @@
 
 unsigned char insb(unsigned short port);
 unsigned short insw(unsigned short port);
+void insw_rep(unsigned short port, void* buf, unsigned int count);
+unsigned int insl(unsigned short port);
 
+void outsw_rep(unsigned short port, void* buf, unsigned int count);
 void outb(unsigned short port, unsigned char val);
 void outw(unsigned short port, unsigned short val);
+void outl(unsigned short port, unsigned int val);
 
 #endif
@@ -0,0 +1,269 @@
+/*++
+
+Free95 20x/TX Kernel
+
+You may only use this code if you agree to the terms of the Free95 Source Code License agreement (GNU GPL v3) (see LICENSE).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    frame.c
+
+Abstract:
+
+    This module implements the physical frame allocator.
+    Memory above the kernel heap is handed out in power of two runs of
+    4KB frames by a buddy system, page tables, stacks and images are
+    taken from here so they do not compete with kernel objects.
+
+--*/
+
+#include "frame.h"
+#include "../heap/kheap.h"
+#include "../memory.h"
+#include "../../io/io.h"
+#include "../../status.h"
+
+static struct frame_allocator frame_allocator;
+
+static uint8_t frame_cmos_read(uint8_t reg)
+{
+    outb(0x70, reg);
+    return insb(0x71);
+}
+
+/**
+ * Returns the end of usable memory as reported by the CMOS,
+ * this covers the contiguous memory below the PCI hole.
+ */
+static uintptr_t frame_detect_memory_end()
+{
+    // 64KB units above 16MB
+    uint32_t above_16mb = frame_cmos_read(0x34) | (frame_cmos_read(0x35) << 8);
+    if (above_16mb)
+    {
+        return 0x1000000 + (above_16mb * 0x10000);
+    }
+
+    // 1KB units above 1MB
+    uint32_t above_1mb = frame_cmos_read(0x30) | (frame_cmos_read(0x31) << 8);
+    return 0x100000 + (above_1mb * 0x400);
+}
+
+static void frame_list_push(uint32_t order, uint32_t index)
+{
+    struct frame* frame = &frame_allocator.frames[index];
+    frame->order = order;
+    frame->flags = FRAME_IS_FREE | FRAME_IS_HEAD;
+    frame->prev = FRAME_NONE;
+    frame->next = frame_allocator.free_lists[order];
+    if (frame->next != FRAME_NONE)
+    {
+        frame_allocator.frames[frame->next].prev = index;
+    }
+    frame_allocator.free_lists[order] = index;
+}
+
+static void frame_list_remove(uint32_t order, uint32_t index)
+{
+    struct frame* frame = &frame_allocator.frames[index];
+    if (frame->prev != FRAME_NONE)
+    {
+        frame_allocator.frames[frame->prev].next = frame->next;
+    }
+    else
+    {
+        frame_allocator.free_lists[order] = frame->next;
+    }
+
+    if (frame->next != FRAME_NONE)
+    {
+        frame_allocator.frames[frame->next].prev = frame->prev;
+    }
+
+    frame->flags &= ~FRAME_IS_FREE;
+}
+
+static uint32_t frame_order_for_size(size_t size)
+{
+    uint32_t frames = (size + FRAME_SIZE - 1) / FRAME_SIZE;
+    uint32_t order = 0;
+    while ((1U << order) < frames)
+    {
+        order++;
+    }
+
+    return order;
+}
+
+int frame_init()
+{
+    int res = 0;
+    memset(&frame_allocator, 0, sizeof(frame_allocator));
+    for (int i = 0; i <= FREE95_FRAME_MAX_ORDER; i++)
+    {
+        frame_allocator.free_lists[i] = FRAME_NONE;
+    }
+
+    uintptr_t start = FREE95_KERNEL_IDENTITY_END;
+    uintptr_t end = frame_detect_memory_end();
+    if (end > FREE95_FRAME_MEMORY_LIMIT)
+    {
+        end = FREE95_FRAME_MEMORY_LIMIT;
+    }
+
+    if (end < start + FREE95_FRAME_MIN_BYTES)
+    {
+        // Not enough memory above the heap, give the frames a part of the heap instead
+        start = (uintptr_t)kmalloc(FREE95_FRAME_MIN_BYTES);
+        if (!start)
+        {
+            res = -ENOMEM;
+            goto out;
+        }
+        end = start + FREE95_FRAME_MIN_BYTES;
+    }
+
+    frame_allocator.base = start;
+    frame_allocator.total = (end - start) / FRAME_SIZE;
+    frame_allocator.frames = kzalloc(frame_allocator.total * sizeof(struct frame));
+    if (!frame_allocator.frames)
+    {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    // Cover the region with the largest blocks that fit
+    uint32_t index = 0;
+    while (index < frame_allocator.total)
+    {
+        uint32_t order = FREE95_FRAME_MAX_ORDER;
+        while ((index & ((1U << order) - 1)) || index + (1U << order) > frame_allocator.total)
+        {
+            order--;
+        }
+
+        frame_list_push(order, index);
+        index += 1U << order;
+    }
+    frame_allocator.free = frame_allocator.total;
+
+out:
+    return res;
+}
+
+void* frame_alloc(size_t size)
+{
+    uint32_t order = frame_order_for_size(size);
+    if (size == 0 || order > FREE95_FRAME_MAX_ORDER)
+    {
+        return 0;
+    }
+
+    uint32_t current = order;
+    while (current <= FREE95_FRAME_MAX_ORDER && frame_allocator.free_lists[current] == FRAME_NONE)
+    {
+        current++;
+    }
+
+    if (current > FREE95_FRAME_MAX_ORDER)
+    {
+        return 0;
+    }
+
+    uint32_t index = frame_allocator.free_lists[current];
+    frame_list_remove(current, index);
+
+    // Give the upper halves back until the block has the requested order
+    while (current > order)
+    {
+        current--;
+        frame_list_push(current, index + (1U << current));
+    }
+
+    struct frame* frame = &frame_allocator.frames[index];
+    frame->order = order;
+    frame->flags = FRAME_IS_HEAD;
+    frame->refcount = 1;
+    frame_allocator.free -= 1U << order;
+
+    return (void*)(frame_allocator.base + (index * FRAME_SIZE));
+}
+
+void* frame_zalloc(size_t size)
+{
+    void* ptr = frame_alloc(size);
+    if (!ptr)
+    {
+        return 0;
+    }
+
+    memset(ptr, 0x00, size);
+    return ptr;
+}
+
+bool frame_is_managed(void* ptr)
+{
+    uintptr_t address = (uintptr_t)ptr;
+    return frame_allocator.frames && address >= frame_allocator.base &&
+           address < frame_allocator.base + (frame_allocator.total * FRAME_SIZE);
+}
+
+void frame_free(void* ptr)
+{
+    if (!ptr || !frame_is_managed(ptr))
+    {
+        return;
+    }
+
+    uint32_t index = ((uintptr_t)ptr - frame_allocator.base) / FRAME_SIZE;
+    struct frame* frame = &frame_allocator.frames[index];
+    if ((frame->flags & (FRAME_IS_HEAD | FRAME_IS_FREE)) != FRAME_IS_HEAD)
+    {
+        return;
+    }
+
+    uint32_t order = frame->order;
+    frame->refcount = 0;
+    frame_allocator.free += 1U << order;
+
+    // Merge with the buddy for as long as it is free and whole
+    while (order < FREE95_FRAME_MAX_ORDER)
+    {
+        uint32_t buddy = index ^ (1U << order);
+        if (buddy + (1U << order) > frame_allocator.total)
+        {
+            break;
+        }
+
+        struct frame* buddy_frame = &frame_allocator.frames[buddy];
+        if (buddy_frame->flags != (FRAME_IS_FREE | FRAME_IS_HEAD) || buddy_frame->order != order)
+        {
+            break;
+        }
+
+        frame_list_remove(order, buddy);
+        buddy_frame->flags = 0;
+        frame_allocator.frames[index].flags = 0;
+        index &= buddy;
+        order++;
+    }
+
+    frame_list_push(order, index);
+}
+
+void* frame_region_start()
+{
+    return (void*)frame_allocator.base;
+}
+
+void* frame_region_end()
+{
+    return (void*)(frame_allocator.base + (frame_allocator.total * FRAME_SIZE));
+}
+
+uint32_t frame_free_count()
+{
+    return frame_allocator.free;
+}
@@ -0,0 +1,51 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "../../config.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define FRAME_SIZE 4096
+#define FRAME_NONE 0xFFFFFFFF
+
+#define FRAME_IS_FREE 0b00000001
+#define FRAME_IS_HEAD 0b00000010
+
+// Bookkeeping of one physical frame, kept outside of the frame itself
+struct frame
+{
+    // Neighbours in the free list of the order, valid on the head of a free block
+    uint32_t next;
+    uint32_t prev;
+
+    // Size of the block this frame heads as a power of two in frames
+    uint8_t order;
+    uint8_t flags;
+
+    uint16_t refcount;
+};
+
+struct frame_allocator
+{
+    // First byte of the managed physical memory
+    uintptr_t base;
+    uint32_t total;
+    uint32_t free;
+
+    struct frame* frames;
+
+    // Head frame of the first free block of every order
+    uint32_t free_lists[FREE95_FRAME_MAX_ORDER + 1];
+};
+
+int frame_init();
+void* frame_alloc(size_t size);
+void* frame_zalloc(size_t size);
+void frame_free(void* ptr);
+bool frame_is_managed(void* ptr);
+void* frame_region_start();
+void* frame_region_end();
+uint32_t frame_free_count();
+
+#endif
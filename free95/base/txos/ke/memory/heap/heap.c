@@ -43,6 +43,9 @@ static bool heap_validate_alignment(void* ptr)
     return ((unsigned int)ptr % FREE95_HEAP_BLOCK_SIZE) == 0;
 }
 
+static void heap_extent_insert(struct heap* heap, uint32_t start, uint32_t total);
+void heap_mark_blocks_taken(struct heap* heap, int start_block, int total_blocks);
+
 int heap_create(struct heap* heap, void* ptr, void* end, struct heap_table* table)
 {
     int res = 0;
@@ -66,6 +69,24 @@ int heap_create(struct heap* heap, void* ptr, void* end, struct heap_table* tabl
     size_t table_size = sizeof(HEAP_BLOCK_TABLE_ENTRY) * table->total;
     memset(table->entries, HEAP_BLOCK_TABLE_ENTRY_FREE, table_size);
 
+    // The free extent index lives in the first blocks of the heap itself
+    size_t index_size = sizeof(struct heap_extent) * table->total;
+    uint32_t index_blocks = (index_size + FREE95_HEAP_BLOCK_SIZE - 1) / FREE95_HEAP_BLOCK_SIZE;
+    if (index_blocks >= table->total)
+    {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    for (int i = 0; i < HEAP_TOTAL_BUCKETS; i++)
+    {
+        heap->buckets[i] = HEAP_EXTENT_NONE;
+    }
+
+    heap->extents = ptr;
+    heap_extent_insert(heap, 0, table->total);
+    heap_mark_blocks_taken(heap, 0, index_blocks);
+
 out:
     return res;
 }
@@ -87,40 +108,109 @@ static int heap_get_entry_type(HEAP_BLOCK_TABLE_ENTRY entry)
     return entry & 0x0f;
 }
 
+static int heap_extent_bucket(uint32_t total)
+{
+    return 31 - __builtin_clz(total);
+}
+
+static void heap_extent_insert(struct heap* heap, uint32_t start, uint32_t total)
+{
+    struct heap_extent* extents = heap->extents;
+    int bucket = heap_extent_bucket(total);
+
+    extents[start].total = total;
+    extents[start + total - 1].start = start;
+
+    extents[start].prev = HEAP_EXTENT_NONE;
+    extents[start].next = heap->buckets[bucket];
+    if (heap->buckets[bucket] != HEAP_EXTENT_NONE)
+    {
+        extents[heap->buckets[bucket]].prev = start;
+    }
+
+    heap->buckets[bucket] = start;
+    heap->bucket_map |= (1 << bucket);
+    heap->free_blocks += total;
+}
+
+static void heap_extent_remove(struct heap* heap, uint32_t start)
+{
+    struct heap_extent* extents = heap->extents;
+    struct heap_extent* extent = &extents[start];
+    int bucket = heap_extent_bucket(extent->total);
+
+    if (extent->prev != HEAP_EXTENT_NONE)
+    {
+        extents[extent->prev].next = extent->next;
+    }
+    else
+    {
+        heap->buckets[bucket] = extent->next;
+    }
+
+    if (extent->next != HEAP_EXTENT_NONE)
+    {
+        extents[extent->next].prev = extent->prev;
+    }
+
+    if (heap->buckets[bucket] == HEAP_EXTENT_NONE)
+    {
+        heap->bucket_map &= ~(1 << bucket);
+    }
+
+    heap->free_blocks -= extent->total;
+}
+
 int heap_get_start_block(struct heap* heap, uint32_t total_blocks)
 {
-    struct heap_table* table = heap->table;
-    int bc = 0;
-    int bs = -1;
+    struct heap_extent* extents = heap->extents;
+    if (total_blocks == 0)
+    {
+        return -EINVARG;
+    }
 
-    for (size_t i = 0; i < table->total; i++)
+    // Runs in the bucket of the request may still be too short, look for the best fit
+    int bucket = heap_extent_bucket(total_blocks);
+    uint32_t best = HEAP_EXTENT_NONE;
+    uint32_t block = heap->buckets[bucket];
+    for (int i = 0; i < HEAP_BEST_FIT_SCAN && block != HEAP_EXTENT_NONE; i++)
     {
-        if (heap_get_entry_type(table->entries[i]) != HEAP_BLOCK_TABLE_ENTRY_FREE)
+        uint32_t total = extents[block].total;
+        if (total == total_blocks)
         {
-            bc = 0;
-            bs = -1;
-            continue;
+            return block;
         }
 
-        // If this is the first block
-        if (bs == -1)
-        {
-            bs = i;
-        }
-        bc++;
-        if (bc == total_blocks)
+        if (total > total_blocks && (best == HEAP_EXTENT_NONE || total < extents[best].total))
         {
-            break;
+            best = block;
         }
+
+        block = extents[block].next;
     }
 
-    if (bs == -1)
+    if (best != HEAP_EXTENT_NONE)
     {
-        return -ENOMEM;
+        return best;
+    }
+
+    // Every run in a higher bucket is long enough, take one from the smallest
+    uint32_t larger = heap->bucket_map & ~((2u << bucket) - 1);
+    if (larger != 0)
+    {
+        return heap->buckets[__builtin_ctz(larger)];
+    }
+
+    // Nothing larger is left, a fitting run may sit past the scanned part of the bucket
+    for (; block != HEAP_EXTENT_NONE; block = extents[block].next)
+    {
+        if (extents[block].total >= total_blocks)
+        {
+            return block;
+        }
     }
-    
-    return bs;
 
+    return -ENOMEM;
 }
 
 void* heap_block_to_address(struct heap* heap, int block)
@@ -128,9 +218,32 @@ void* heap_block_to_address(struct heap* heap, int block)
     return heap->saddr + (block * FREE95_HEAP_BLOCK_SIZE);
 }
 
+static uint32_t heap_extent_find_start(struct heap* heap, uint32_t block)
+{
+    while (block > 0 && heap_get_entry_type(heap->table->entries[block - 1]) == HEAP_BLOCK_TABLE_ENTRY_FREE)
+    {
+        block--;
+    }
+
+    return block;
+}
+
 void heap_mark_blocks_taken(struct heap* heap, int start_block, int total_blocks)
 {
     int end_block = (start_block + total_blocks)-1;
+
+    // Carve the blocks out of the free run holding them, keep what is left over indexed
+    uint32_t run = heap_extent_find_start(heap, start_block);
+    uint32_t run_end = run + heap->extents[run].total;
+    heap_extent_remove(heap, run);
+    if (run < start_block)
+    {
+        heap_extent_insert(heap, run, start_block - run);
+    }
+    if (end_block + 1 < run_end)
+    {
+        heap_extent_insert(heap, end_block + 1, run_end - (end_block + 1));
+    }
     
     HEAP_BLOCK_TABLE_ENTRY entry = HEAP_BLOCK_TABLE_ENTRY_TAKEN | HEAP_BLOCK_IS_FIRST;
     if (total_blocks > 1)
@@ -171,15 +284,41 @@ out:
 void heap_mark_blocks_free(struct heap* heap, int starting_block)
 {
     struct heap_table* table = heap->table;
+    struct heap_extent* extents = heap->extents;
+    if (starting_block < 0 || starting_block >= (int)table->total || !(table->entries[starting_block] & HEAP_BLOCK_IS_FIRST))
+    {
+        return;
+    }
+
+    int end_block = starting_block;
     for (int i = starting_block; i < (int)table->total; i++)
     {
         HEAP_BLOCK_TABLE_ENTRY entry = table->entries[i];
         table->entries[i] = HEAP_BLOCK_TABLE_ENTRY_FREE;
+        end_block = i;
         if (!(entry & HEAP_BLOCK_HAS_NEXT))
         {
             break;
         }
     }
+
+    // Coalesce with the free runs on either side
+    uint32_t run = starting_block;
+    uint32_t run_end = end_block + 1;
+    if (run > 0 && heap_get_entry_type(table->entries[run - 1]) == HEAP_BLOCK_TABLE_ENTRY_FREE)
+    {
+        run = extents[run - 1].start;
+        heap_extent_remove(heap, run);
+    }
+
+    if (run_end < table->total && heap_get_entry_type(table->entries[run_end]) == HEAP_BLOCK_TABLE_ENTRY_FREE)
+    {
+        uint32_t next_total = extents[run_end].total;
+        heap_extent_remove(heap, run_end);
+        run_end += next_total;
+    }
+
+    heap_extent_insert(heap, run, run_end - run);
 }
 
 int heap_address_to_block(struct heap* heap, void* address)
@@ -198,3 +337,22 @@ void heap_free(struct heap* heap, void* ptr)
 {
     heap_mark_blocks_free(heap, heap_address_to_block(heap, ptr));
 }
+
+void heap_get_stats(struct heap* heap, struct heap_stats* stats)
+{
+    memset(stats, 0, sizeof(struct heap_stats));
+    stats->total_blocks = heap->table->total;
+    stats->free_blocks = heap->free_blocks;
+
+    for (int i = 0; i < HEAP_TOTAL_BUCKETS; i++)
+    {
+        for (uint32_t block = heap->buckets[i]; block != HEAP_EXTENT_NONE; block = heap->extents[block].next)
+        {
+            stats->free_runs++;
+            if (heap->extents[block].total > stats->largest_free_run)
+            {
+                stats->largest_free_run = heap->extents[block].total;
+            }
+        }
+    }
+}
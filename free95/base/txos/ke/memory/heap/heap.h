@@ -11,6 +11,10 @@
 #define HEAP_BLOCK_HAS_NEXT 0b10000000
 #define HEAP_BLOCK_IS_FIRST  0b01000000
 
+#define HEAP_EXTENT_NONE 0xFFFFFFFF
+#define HEAP_TOTAL_BUCKETS 32
+// How many runs of the requested size class are compared for the best fit
+#define HEAP_BEST_FIT_SCAN 32
 
 typedef unsigned char HEAP_BLOCK_TABLE_ENTRY;
 
@@ -21,15 +25,50 @@ struct heap_table
 };
 
 
+// Boundary tag of a free run of blocks
+struct heap_extent
+{
+    // Length of the run, valid on the first block of a run
+    uint32_t total;
+    // First block of the run, valid on the last block of a run
+    uint32_t start;
+    // Neighbours in the size bucket, valid on the first block of a run
+    uint32_t next;
+    uint32_t prev;
+};
+
 struct heap
 {
     struct heap_table* table;
 
     // Start address of the heap data pool
     void* saddr;
+
+    // One boundary tag per block, stored in the first blocks of the heap
+    struct heap_extent* extents;
+
+    // First blocks of the free runs, bucketed by floor(log2(run length))
+    uint32_t buckets[HEAP_TOTAL_BUCKETS];
+
+    // Bit n is set when bucket n holds at least one free run
+    uint32_t bucket_map;
+
+    size_t free_blocks;
+};
+
+struct heap_stats
+{
+    size_t total_blocks;
+    size_t free_blocks;
+    size_t free_runs;
+    size_t largest_free_run;
 };
 
 int heap_create(struct heap* heap, void* ptr, void* end, struct heap_table* table);
 void* heap_malloc(struct heap* heap, size_t size);
 void heap_free(struct heap* heap, void* ptr);
+void* heap_malloc_blocks(struct heap* heap, uint32_t total_blocks);
+void* heap_block_to_address(struct heap* heap, int block);
+int heap_address_to_block(struct heap* heap, void* address);
+void heap_get_stats(struct heap* heap, struct heap_stats* stats);
 #endif
@@ -18,12 +18,18 @@ Abstract:
 
 #include "kheap.h"
 #include "heap.h"
+#include "slab.h"
 #include "../../config.h"
 #include "../../../init/kernel.h"
 #include "../memory.h"
+#include "../../sync/sync.h"
 
 struct heap kernel_heap;
 struct heap_table kernel_heap_table;
+struct slab_allocator kernel_slab;
+
+// The heap and the slab caches are shared by every CPU
+static KSPIN_LOCK kernel_heap_lock = 0;
 
 void kheap_init()
 {
@@ -36,13 +42,34 @@ void kheap_init()
     if (res < 0)
     {
         print("Failed to create heap\n");
+        return;
     }
 
+    res = slab_allocator_create(&kernel_slab, &kernel_heap);
+    if (res < 0)
+    {
+        print("Failed to create slab caches\n");
+    }
 }
 
 void* kmalloc(size_t size)
 {
-    return heap_malloc(&kernel_heap, size);
+    void* ptr = 0;
+    ULONG flags = KeAcquireSpinLock(&kernel_heap_lock);
+
+    // Small objects come from the slab caches, everything else takes whole blocks
+    if (size <= FREE95_SLAB_MAX_OBJECT_SIZE)
+    {
+        ptr = slab_malloc(&kernel_slab, size);
+    }
+
+    if (!ptr)
+    {
+        ptr = heap_malloc(&kernel_heap, size);
+    }
+
+    KeReleaseSpinLock(&kernel_heap_lock, flags);
+    return ptr;
 }
 
 void* kzalloc(size_t size)
@@ -57,5 +84,15 @@ void* kzalloc(size_t size)
 
 void kfree(void* ptr)
 {
-    heap_free(&kernel_heap, ptr);
+    if (!ptr)
+    {
+        return;
+    }
+
+    ULONG flags = KeAcquireSpinLock(&kernel_heap_lock);
+    if (!slab_free(&kernel_slab, ptr))
+    {
+        heap_free(&kernel_heap, ptr);
+    }
+    KeReleaseSpinLock(&kernel_heap_lock, flags);
 }
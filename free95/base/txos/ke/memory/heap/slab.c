@@ -0,0 +1,259 @@
+/*++
+
+Free95 20x/TX Kernel
+
+You may only use this code if you agree to the terms of the Free95 Source Code License agreement (GNU GPL v3) (see LICENSE).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    slab.c
+
+Abstract:
+
+    This module implements the slab caches used for small kernel objects.
+    Each size class carves runs of heap blocks into equally sized objects,
+    so small allocations no longer consume a whole heap block each.
+
+--*/
+
+#include "slab.h"
+#include "../../status.h"
+#include "../memory.h"
+
+// Objects start after the slab header, kept 16 byte aligned
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + 15) & ~15)
+
+static void slab_list_push(struct slab** head, struct slab* slab)
+{
+    slab->prev = 0;
+    slab->next = *head;
+    if (*head)
+    {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+static void slab_list_remove(struct slab** head, struct slab* slab)
+{
+    if (slab->prev)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        *head = slab->next;
+    }
+
+    if (slab->next)
+    {
+        slab->next->prev = slab->prev;
+    }
+
+    slab->next = 0;
+    slab->prev = 0;
+}
+
+static void slab_cache_init(struct slab_cache* cache, size_t object_size)
+{
+    memset(cache, 0, sizeof(struct slab_cache));
+    cache->object_size = object_size;
+
+    // Use enough blocks that every slab holds a useful number of objects
+    size_t bytes = SLAB_HEADER_SIZE + (object_size * FREE95_SLAB_MIN_OBJECTS);
+    cache->blocks_per_slab = (bytes + FREE95_HEAP_BLOCK_SIZE - 1) / FREE95_HEAP_BLOCK_SIZE;
+    cache->objects_per_slab = ((cache->blocks_per_slab * FREE95_HEAP_BLOCK_SIZE) - SLAB_HEADER_SIZE) / object_size;
+}
+
+int slab_allocator_create(struct slab_allocator* allocator, struct heap* heap)
+{
+    int res = 0;
+    memset(allocator, 0, sizeof(struct slab_allocator));
+    allocator->heap = heap;
+
+    size_t map_size = heap->table->total * sizeof(struct slab*);
+    allocator->block_map = heap_malloc(heap, map_size);
+    if (!allocator->block_map)
+    {
+        res = -ENOMEM;
+        goto out;
+    }
+    memset(allocator->block_map, 0, map_size);
+
+    size_t object_size = FREE95_SLAB_MIN_OBJECT_SIZE;
+    for (int i = 0; i < FREE95_SLAB_TOTAL_CLASSES; i++)
+    {
+        slab_cache_init(&allocator->caches[i], object_size);
+        object_size *= 2;
+    }
+
+out:
+    return res;
+}
+
+static struct slab_cache* slab_cache_for_size(struct slab_allocator* allocator, size_t size)
+{
+    for (int i = 0; i < FREE95_SLAB_TOTAL_CLASSES; i++)
+    {
+        if (size <= allocator->caches[i].object_size)
+        {
+            return &allocator->caches[i];
+        }
+    }
+
+    return 0;
+}
+
+struct slab_cache* slab_get_cache(struct slab_allocator* allocator, int index)
+{
+    if (index < 0 || index >= FREE95_SLAB_TOTAL_CLASSES)
+    {
+        return 0;
+    }
+
+    return &allocator->caches[index];
+}
+
+static struct slab* slab_new(struct slab_allocator* allocator, struct slab_cache* cache)
+{
+    struct slab* slab = heap_malloc_blocks(allocator->heap, cache->blocks_per_slab);
+    if (!slab)
+    {
+        return 0;
+    }
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->total = cache->objects_per_slab;
+    slab->free = 0;
+
+    // Thread the free list through the objects, lowest address first
+    char* objects = (char*)slab + SLAB_HEADER_SIZE;
+    for (int i = slab->total - 1; i >= 0; i--)
+    {
+        void** object = (void**)(objects + (i * cache->object_size));
+        *object = slab->free;
+        slab->free = object;
+    }
+
+    int block = heap_address_to_block(allocator->heap, slab);
+    for (int i = 0; i < cache->blocks_per_slab; i++)
+    {
+        allocator->block_map[block + i] = slab;
+    }
+
+    slab_list_push(&cache->partial, slab);
+    cache->stats.slabs++;
+    cache->stats.empty_slabs++;
+    return slab;
+}
+
+static void slab_release(struct slab_allocator* allocator, struct slab* slab)
+{
+    struct slab_cache* cache = slab->cache;
+    slab_list_remove(&cache->partial, slab);
+
+    int block = heap_address_to_block(allocator->heap, slab);
+    for (int i = 0; i < cache->blocks_per_slab; i++)
+    {
+        allocator->block_map[block + i] = 0;
+    }
+
+    cache->stats.slabs--;
+    cache->stats.empty_slabs--;
+    heap_free(allocator->heap, slab);
+}
+
+void* slab_malloc(struct slab_allocator* allocator, size_t size)
+{
+    if (!allocator->block_map || size == 0 || size > FREE95_SLAB_MAX_OBJECT_SIZE)
+    {
+        return 0;
+    }
+
+    struct slab_cache* cache = slab_cache_for_size(allocator, size);
+    struct slab* slab = cache->partial;
+    if (!slab)
+    {
+        slab = slab_new(allocator, cache);
+        if (!slab)
+        {
+            return 0;
+        }
+    }
+
+    void** object = slab->free;
+    slab->free = *object;
+    if (slab->inuse == 0)
+    {
+        cache->stats.empty_slabs--;
+    }
+    slab->inuse++;
+
+    if (!slab->free)
+    {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->stats.allocs++;
+    cache->stats.active_objects++;
+    if (cache->stats.active_objects > cache->stats.peak_objects)
+    {
+        cache->stats.peak_objects = cache->stats.active_objects;
+    }
+
+    return object;
+}
+
+/**
+ * Returns false if the pointer was not handed out by a slab cache
+ */
+bool slab_free(struct slab_allocator* allocator, void* ptr)
+{
+    if (!allocator->block_map)
+    {
+        return false;
+    }
+
+    char* start = allocator->heap->saddr;
+    char* end = start + (allocator->heap->table->total * FREE95_HEAP_BLOCK_SIZE);
+    if ((char*)ptr < start || (char*)ptr >= end)
+    {
+        return false;
+    }
+
+    struct slab* slab = allocator->block_map[heap_address_to_block(allocator->heap, ptr)];
+    if (!slab)
+    {
+        return false;
+    }
+
+    struct slab_cache* cache = slab->cache;
+    if (!slab->free)
+    {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void** object = ptr;
+    *object = slab->free;
+    slab->free = object;
+    slab->inuse--;
+
+    cache->stats.frees++;
+    cache->stats.active_objects--;
+
+    if (slab->inuse == 0)
+    {
+        cache->stats.empty_slabs++;
+        if (cache->stats.empty_slabs > FREE95_SLAB_MAX_EMPTY)
+        {
+            slab_release(allocator, slab);
+        }
+    }
+
+    return true;
+}
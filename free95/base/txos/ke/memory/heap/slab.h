@@ -0,0 +1,67 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "heap.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct slab_cache;
+
+struct slab
+{
+    // The cache this slab carves objects for
+    struct slab_cache* cache;
+
+    // Singly linked list of free objects inside this slab
+    void* free;
+
+    // Objects handed out and objects the slab can hold
+    uint32_t inuse;
+    uint32_t total;
+
+    // Links in the partial or full list of the cache
+    struct slab* next;
+    struct slab* prev;
+};
+
+struct slab_cache_stats
+{
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t active_objects;
+    uint32_t peak_objects;
+    uint32_t slabs;
+    uint32_t empty_slabs;
+};
+
+struct slab_cache
+{
+    size_t object_size;
+    uint32_t blocks_per_slab;
+    uint32_t objects_per_slab;
+
+    // Slabs with at least one free object
+    struct slab* partial;
+    // Slabs with no free objects
+    struct slab* full;
+
+    struct slab_cache_stats stats;
+};
+
+struct slab_allocator
+{
+    struct heap* heap;
+
+    // Owning slab of every heap block, zero when the block is not a slab
+    struct slab** block_map;
+
+    struct slab_cache caches[FREE95_SLAB_TOTAL_CLASSES];
+};
+
+int slab_allocator_create(struct slab_allocator* allocator, struct heap* heap);
+void* slab_malloc(struct slab_allocator* allocator, size_t size);
+bool slab_free(struct slab_allocator* allocator, void* ptr);
+struct slab_cache* slab_get_cache(struct slab_allocator* allocator, int index);
+
+#endif
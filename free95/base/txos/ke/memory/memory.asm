@@ -0,0 +1,19 @@
+[BITS 32]
+
+section .asm
+
+global memory_enable_sse
+
+; Lets SSE instructions run without faulting, CR0.EM off, CR0.MP and CR4.OSFXSR/OSXMMEXCPT on
+memory_enable_sse:
+    push ebp
+    mov ebp, esp
+    mov eax, cr0
+    and eax, 0xFFFFFFFB
+    or eax, 0x2
+    mov cr0, eax
+    mov eax, cr4
+    or eax, 0x600
+    mov cr4, eax
+    pop ebp
+    ret
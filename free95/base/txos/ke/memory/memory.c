@@ -13,12 +13,32 @@ Module Name:
 Abstract:
 
     This module implements basic memory services.
+    memset and memcpy dispatch to byte loops, rep string instructions or
+    an SSE2 copy loop, memory_init() picks the fastest the CPU supports.
 
 --*/
 
 #include "memory.h"
+#include "../config.h"
+#include <stdint.h>
 
-void* memset(void* ptr, int c, size_t size)
+void memory_enable_sse();
+
+typedef void* (*MEMORY_SET_FUNCTION)(void* ptr, int c, size_t size);
+typedef void* (*MEMORY_COPY_FUNCTION)(void* dest, void* src, int len);
+typedef int (*MEMORY_COMPARE_FUNCTION)(void* s1, void* s2, int count);
+
+static void* memory_set_rep(void* ptr, int c, size_t size);
+static void* memory_copy_rep(void* dest, void* src, int len);
+static int memory_compare_dwords(void* s1, void* s2, int count);
+
+// rep string instructions exist on every CPU the kernel runs on, so they are used until memory_init()
+static MEMORY_SET_FUNCTION memory_set_function = memory_set_rep;
+static MEMORY_COPY_FUNCTION memory_copy_function = memory_copy_rep;
+static MEMORY_COMPARE_FUNCTION memory_compare_function = memory_compare_dwords;
+static unsigned int memory_features = MEMORY_FEATURE_REP_STRING;
+
+static void* memory_set_bytes(void* ptr, int c, size_t size)
 {
     char* c_ptr = (char*) ptr;
     for (int i = 0; i < size; i++)
@@ -28,7 +48,18 @@ void* memset(void* ptr, int c, size_t size)
     return ptr;
 }
 
-int memcmp(void* s1, void* s2, int count)
+static void* memory_copy_bytes(void* dest, void* src, int len)
+{
+    char *d = dest;
+    char *s = src;
+    while(len-- > 0)
+    {
+        *d++ = *s++;
+    }
+    return dest;
+}
+
+static int memory_compare_bytes(void* s1, void* s2, int count)
 {
     char* c1 = s1;
     char* c2 = s2;
@@ -43,13 +74,212 @@ int memcmp(void* s1, void* s2, int count)
     return 0;
 }
 
+static int memory_compare_dwords(void* s1, void* s2, int count)
+{
+    char* c1 = s1;
+    char* c2 = s2;
+
+    // Skip equal dwords, the differing byte is found byte by byte
+    while (count >= 4 && *(uint32_t*)c1 == *(uint32_t*)c2)
+    {
+        c1 += 4;
+        c2 += 4;
+        count -= 4;
+    }
+
+    return memory_compare_bytes(c1, c2, count);
+}
+
+static void* memory_set_rep(void* ptr, int c, size_t size)
+{
+    char* d = ptr;
+    uint32_t value = (uint8_t)c * 0x01010101;
+
+    // Align the destination so the dword stores never split
+    while (size && ((uintptr_t)d & 3))
+    {
+        *d++ = (char) c;
+        size--;
+    }
+
+    size_t dwords = size / 4;
+    size_t bytes = size & 3;
+    __asm__ __volatile__("rep stosl" : "+D"(d), "+c"(dwords) : "a"(value) : "memory");
+    __asm__ __volatile__("rep stosb" : "+D"(d), "+c"(bytes) : "a"(value) : "memory");
+    return ptr;
+}
+
+static void* memory_copy_rep(void* dest, void* src, int len)
+{
+    char *d = dest;
+    char *s = src;
+    if (len <= 0)
+    {
+        return dest;
+    }
+
+    size_t head = (4 - ((uintptr_t)d & 3)) & 3;
+    if (head > (size_t)len)
+    {
+        head = len;
+    }
+
+    size_t dwords = (len - head) / 4;
+    size_t bytes = (len - head) & 3;
+    __asm__ __volatile__("rep movsb" : "+D"(d), "+S"(s), "+c"(head) : : "memory");
+    __asm__ __volatile__("rep movsl" : "+D"(d), "+S"(s), "+c"(dwords) : : "memory");
+    __asm__ __volatile__("rep movsb" : "+D"(d), "+S"(s), "+c"(bytes) : : "memory");
+    return dest;
+}
+
+/**
+ * The SSE2 loop saves and restores the registers it uses itself,
+ * so callers never see their XMM state change.
+ */
+static void* memory_copy_sse2(void* dest, void* src, int len)
+{
+    if (len < FREE95_MEMORY_SSE_THRESHOLD)
+    {
+        return memory_copy_rep(dest, src, len);
+    }
+
+    char *d = dest;
+    char *s = src;
+    int head = (16 - ((uintptr_t)d & 15)) & 15;
+    memory_copy_rep(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+
+    uint8_t saved[64];
+    size_t blocks = len / 64;
+    __asm__ __volatile__(
+        "movdqu %%xmm0, 0(%3)\n\t"
+        "movdqu %%xmm1, 16(%3)\n\t"
+        "movdqu %%xmm2, 32(%3)\n\t"
+        "movdqu %%xmm3, 48(%3)\n\t"
+        "1:\n\t"
+        "movdqu 0(%1), %%xmm0\n\t"
+        "movdqu 16(%1), %%xmm1\n\t"
+        "movdqu 32(%1), %%xmm2\n\t"
+        "movdqu 48(%1), %%xmm3\n\t"
+        "movdqa %%xmm0, 0(%0)\n\t"
+        "movdqa %%xmm1, 16(%0)\n\t"
+        "movdqa %%xmm2, 32(%0)\n\t"
+        "movdqa %%xmm3, 48(%0)\n\t"
+        "add $64, %0\n\t"
+        "add $64, %1\n\t"
+        "dec %2\n\t"
+        "jnz 1b\n\t"
+        "movdqu 0(%3), %%xmm0\n\t"
+        "movdqu 16(%3), %%xmm1\n\t"
+        "movdqu 32(%3), %%xmm2\n\t"
+        "movdqu 48(%3), %%xmm3\n\t"
+        : "+r"(d), "+r"(s), "+r"(blocks)
+        : "r"(saved)
+        : "memory", "cc");
+
+    memory_copy_rep(d, s, len & 63);
+    return dest;
+}
+
+static uint32_t memory_cpuid_features()
+{
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ __volatile__ (
+        "cpuid"
+        : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+        : "a"(1)
+    );
+
+    return edx;
+}
+
+void memory_init()
+{
+    unsigned int features = MEMORY_FEATURE_REP_STRING;
+
+    // SSE2 also needs FXSR and SSE for the OS to enable it
+    uint32_t edx = memory_cpuid_features();
+    uint32_t sse2 = (1 << 24) | (1 << 25) | (1 << 26);
+    if ((edx & sse2) == sse2)
+    {
+        memory_enable_sse();
+        features |= MEMORY_FEATURE_SSE2;
+    }
+
+    memory_set_features(features);
+}
+
+void memory_set_features(unsigned int features)
+{
+    memory_features = features;
+    if (features & MEMORY_FEATURE_SSE2)
+    {
+        // rep stosd measured faster than an SSE2 store loop for memset at every size
+        memory_set_function = memory_set_rep;
+        memory_copy_function = memory_copy_sse2;
+        memory_compare_function = memory_compare_dwords;
+    }
+    else if (features & MEMORY_FEATURE_REP_STRING)
+    {
+        memory_set_function = memory_set_rep;
+        memory_copy_function = memory_copy_rep;
+        memory_compare_function = memory_compare_dwords;
+    }
+    else
+    {
+        memory_set_function = memory_set_bytes;
+        memory_copy_function = memory_copy_bytes;
+        memory_compare_function = memory_compare_bytes;
+    }
+}
+
+unsigned int memory_get_features()
+{
+    return memory_features;
+}
+
+void* memset(void* ptr, int c, size_t size)
+{
+    return memory_set_function(ptr, c, size);
+}
+
+int memcmp(void* s1, void* s2, int count)
+{
+    return memory_compare_function(s1, s2, count);
+}
+
 void* memcpy(void* dest, void* src, int len)
+{
+    return memory_copy_function(dest, src, len);
+}
+
+void* memmove(void* dest, void* src, int len)
 {
     char *d = dest;
     char *s = src;
-    while(len--)
+    if (d <= s || d >= s + len)
     {
-        *d++ = *s++;
+        return memcpy(dest, src, len);
+    }
+
+    // The destination overlaps the end of the source, copy backwards
+    d += len;
+    s += len;
+    size_t bytes = len & 3;
+    while (bytes--)
+    {
+        *--d = *--s;
+    }
+
+    size_t dwords = len / 4;
+    if (dwords)
+    {
+        d -= 4;
+        s -= 4;
+        __asm__ __volatile__("std\n\trep movsl\n\tcld" : "+D"(d), "+S"(s), "+c"(dwords) : : "memory", "cc");
     }
+
     return dest;
 }
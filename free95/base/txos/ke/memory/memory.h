@@ -3,8 +3,17 @@
 
 #include <stddef.h>
 
+// Implementations memory_init() may select, byte loops are used without any
+#define MEMORY_FEATURE_REP_STRING 0b00000001
+#define MEMORY_FEATURE_SSE2       0b00000010
+
+void memory_init();
+void memory_set_features(unsigned int features);
+unsigned int memory_get_features();
+
 void* memset(void* ptr, int c, size_t size);
 int memcmp(void* s1, void* s2, int count);
 void* memcpy(void* dest, void* src, int len);
+void* memmove(void* dest, void* src, int len);
 
 #endif
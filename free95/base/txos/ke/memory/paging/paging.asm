@@ -4,6 +4,9 @@ section .asm
 
 global paging_load_directory
 global enable_paging
+global paging_enable_pse
+global paging_invalidate_page
+global paging_reload_directory
 
 paging_load_directory:
     push ebp
@@ -21,3 +24,28 @@ enable_paging:
     mov cr0, eax
     pop ebp
     ret
+
+paging_enable_pse:
+    push ebp
+    mov ebp, esp
+    mov eax, cr4
+    or eax, 0x10
+    mov cr4, eax
+    pop ebp
+    ret
+
+paging_invalidate_page:
+    push ebp
+    mov ebp, esp
+    mov eax, [ebp+8]
+    invlpg [eax]
+    pop ebp
+    ret
+
+paging_reload_directory:
+    push ebp
+    mov ebp, esp
+    mov eax, cr3
+    mov cr3, eax
+    pop ebp
+    ret
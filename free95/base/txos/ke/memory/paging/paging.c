@@ -18,26 +18,162 @@ Abstract:
 
 #include "paging.h"
 #include "../heap/kheap.h"
+#include "../frame/frame.h"
 #include "../../status.h"
+#include "../../config.h"
 void paging_load_directory(uint32_t *directory);
+void paging_enable_pse();
+void paging_invalidate_page(void *virt);
+void paging_reload_directory();
 
-static uint32_t *current_directory = 0;
+// Set once the first directory is loaded, before that CR3 means nothing
+static bool paging_started = false;
+
+static int paging_set_entry(uint32_t *directory, void *virt, uint32_t val);
+static void paging_flush_range(uint32_t *directory, void *virt, int count);
+
+// Set once the CPU has been switched to 4MB pages for directory entries
+static bool paging_large_pages = false;
+
+// Directory entries of the identity mapped tables shared by every address space
+static uint32_t paging_shared_tables[PAGING_TOTAL_ENTRIES_PER_TABLE];
+
+static bool paging_is_shared_table(uint32_t directory_index, uint32_t entry)
+{
+    uint32_t shared = paging_shared_tables[directory_index];
+    if (shared & PAGING_IS_LARGE_PAGE)
+    {
+        return entry & PAGING_IS_LARGE_PAGE;
+    }
+
+    return shared && (entry & 0xfffff000) == (shared & 0xfffff000);
+}
+
+/**
+ * True if the kernel identity mapping lets the physical page be written.
+ * Directories built from the shared tables may leave out the writeable
+ * bit, the kernel tables tell what the memory actually is.
+ */
+bool paging_identity_is_writeable(uint32_t phys)
+{
+    uint32_t shared = paging_shared_tables[phys / PAGING_LARGE_PAGE_SIZE];
+    if (!(shared & PAGING_IS_PRESENT))
+    {
+        return false;
+    }
+
+    if (shared & PAGING_IS_LARGE_PAGE)
+    {
+        return shared & PAGING_IS_WRITEABLE;
+    }
+
+    uint32_t *table = (uint32_t *)(shared & 0xfffff000);
+    uint32_t entry = table[(phys % PAGING_LARGE_PAGE_SIZE) / PAGING_PAGE_SIZE];
+    return (entry & PAGING_IS_PRESENT) && (entry & PAGING_IS_WRITEABLE);
+}
+
+int paging_identity_map(void *start, void *end)
+{
+    uint32_t first = (uint32_t)start / PAGING_LARGE_PAGE_SIZE;
+    uint32_t last = ((uint32_t)end - 1) / PAGING_LARGE_PAGE_SIZE;
+    if ((uint32_t)end <= (uint32_t)start)
+    {
+        return -EINVARG;
+    }
+
+    for (uint32_t i = first; i <= last; i++)
+    {
+        if (paging_shared_tables[i])
+        {
+            continue;
+        }
+
+        uint32_t offset = i * PAGING_LARGE_PAGE_SIZE;
+        if (paging_large_pages)
+        {
+            // The whole 4MB range is covered by the directory entry itself
+            paging_shared_tables[i] = offset | PAGING_IS_LARGE_PAGE | PAGING_IS_PRESENT | PAGING_IS_WRITEABLE | PAGING_ACCESS_FROM_ALL;
+        }
+        else
+        {
+            uint32_t *table = frame_zalloc(sizeof(uint32_t) * PAGING_TOTAL_ENTRIES_PER_TABLE);
+            if (!table)
+            {
+                return -ENOMEM;
+            }
+
+            for (int b = 0; b < PAGING_TOTAL_ENTRIES_PER_TABLE; b++)
+            {
+                table[b] = (offset + (b * PAGING_PAGE_SIZE)) | PAGING_IS_PRESENT | PAGING_IS_WRITEABLE | PAGING_ACCESS_FROM_ALL;
+            }
+            paging_shared_tables[i] = (uint32_t)table | PAGING_IS_PRESENT | PAGING_IS_WRITEABLE | PAGING_ACCESS_FROM_ALL;
+        }
+
+        // Directories created earlier only learn about the new range if they are active
+        uint32_t *current_directory = paging_current_directory();
+        if (current_directory && !(current_directory[i] & PAGING_IS_PRESENT))
+        {
+            current_directory[i] = paging_shared_tables[i];
+        }
+    }
+
+    return 0;
+}
+
+static bool paging_cpu_has_pse()
+{
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ __volatile__ (
+        "cpuid"
+        : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+        : "a"(1)
+    );
+
+    return edx & (1 << 3);
+}
+
+void paging_init()
+{
+    if (paging_cpu_has_pse())
+    {
+        paging_enable_pse();
+        paging_large_pages = true;
+    }
+
+    // Low memory, the kernel image, its stacks and the kernel heap
+    paging_identity_map(0, (void *)FREE95_KERNEL_IDENTITY_END);
+
+    // Frames are used through their physical address
+    paging_identity_map(frame_region_start(), frame_region_end());
+}
+
+/**
+ * Creates an address space that starts out with the shared kernel identity tables only,
+ * the flags of the directory entries limit what the shared tables allow.
+ */
 struct paging_4gb_chunk *paging_new_4gb(uint8_t flags)
 {
-    uint32_t *directory = kzalloc(sizeof(uint32_t) * PAGING_TOTAL_ENTRIES_PER_TABLE);
-    int offset = 0;
+    uint32_t *directory = frame_zalloc(sizeof(uint32_t) * PAGING_TOTAL_ENTRIES_PER_TABLE);
+    if (!directory)
+    {
+        return 0;
+    }
+
     for (int i = 0; i < PAGING_TOTAL_ENTRIES_PER_TABLE; i++)
     {
-        uint32_t *entry = kzalloc(sizeof(uint32_t) * PAGING_TOTAL_ENTRIES_PER_TABLE);
-        for (int b = 0; b < PAGING_TOTAL_ENTRIES_PER_TABLE; b++)
+        if (paging_shared_tables[i])
         {
-            entry[b] = (offset + (b * PAGING_PAGE_SIZE)) | flags;
+            directory[i] = (paging_shared_tables[i] & (0xfffff000 | PAGING_IS_LARGE_PAGE)) | flags | PAGING_IS_PRESENT;
         }
-        offset += (PAGING_TOTAL_ENTRIES_PER_TABLE * PAGING_PAGE_SIZE);
-        directory[i] = (uint32_t)entry | flags | PAGING_IS_WRITEABLE;
     }
 
     struct paging_4gb_chunk *chunk_4gb = kzalloc(sizeof(struct paging_4gb_chunk));
+    if (!chunk_4gb)
+    {
+        frame_free(directory);
+        return 0;
+    }
+
     chunk_4gb->directory_entry = directory;
     return chunk_4gb;
 }
@@ -45,19 +181,53 @@ struct paging_4gb_chunk *paging_new_4gb(uint8_t flags)
 void paging_switch(uint32_t *directory)
 {
     paging_load_directory(directory);
-    current_directory = directory;
+    paging_started = true;
+}
+
+// Every CPU runs on a directory of its own, CR3 tells which
+uint32_t *paging_current_directory()
+{
+    if (!paging_started)
+    {
+        return 0;
+    }
+
+    uint32_t directory;
+    asm volatile("mov %%cr3, %0" : "=r"(directory));
+    return (uint32_t *)(directory & ~0xFFF);
+}
+
+/**
+ * Frees the frame of a page table entry that owns it, other frames
+ * belong to their allocator.
+ */
+static void paging_release_entry(uint32_t entry)
+{
+    if ((entry & PAGING_IS_PRESENT) && (entry & PAGING_IS_COPIED))
+    {
+        frame_free((void *)(entry & 0xfffff000));
+    }
 }
 
 void paging_free_4gb(struct paging_4gb_chunk *chunk)
 {
-    for (int i = 0; i < 1024; i++)
+    for (int i = 0; i < PAGING_TOTAL_ENTRIES_PER_TABLE; i++)
     {
         uint32_t entry = chunk->directory_entry[i];
+        if (!(entry & PAGING_IS_PRESENT) || paging_is_shared_table(i, entry))
+        {
+            continue;
+        }
+
         uint32_t *table = (uint32_t *)(entry & 0xfffff000);
-        kfree(table);
+        for (int b = 0; b < PAGING_TOTAL_ENTRIES_PER_TABLE; b++)
+        {
+            paging_release_entry(table[b]);
+        }
+        frame_free(table);
     }
 
-    kfree(chunk->directory_entry);
+    frame_free(chunk->directory_entry);
     kfree(chunk);
 }
 
@@ -104,18 +274,31 @@ int paging_map(uint32_t* directory, void* virt, void* phys, int flags)
 
     return paging_set(directory, virt, (uint32_t) phys | flags);
 }
+/**
+ * Maps count pages starting at virt to the physical pages starting at phys,
+ * the TLB is invalidated once for the whole range when the directory is active.
+ */
 int paging_map_range(uint32_t* directory, void* virt, void* phys, int count, int flags)
 {
     int res = 0;
-    for (int i = 0; i < count; i++)
+    if (!paging_is_aligned(virt) || !paging_is_aligned(phys) || count < 0)
     {
-        res = paging_map(directory, virt, phys, flags);
-        if (res == 0)
+        res = -EINVARG;
+        goto out;
+    }
+
+    int mapped = 0;
+    for (; mapped < count; mapped++)
+    {
+        res = paging_set_entry(directory, virt + (mapped * PAGING_PAGE_SIZE), ((uint32_t)phys + (mapped * PAGING_PAGE_SIZE)) | flags);
+        if (res < 0)
+        {
             break;
-        virt += PAGING_PAGE_SIZE;
-        phys += PAGING_PAGE_SIZE;
+        }
     }
 
+    paging_flush_range(directory, virt, mapped);
+out:
     return res;
 }
 
@@ -150,7 +333,51 @@ int paging_map_to(uint32_t *directory, void *virt, void *phys, void *phys_end, i
 out:
     return res;
 }
-int paging_set(uint32_t *directory, void *virt, uint32_t val)
+
+/**
+ * Returns the table of this directory that may be modified for the directory index,
+ * missing tables are created and shared identity tables are replaced by a private copy.
+ */
+static uint32_t *paging_get_private_table(uint32_t *directory, uint32_t directory_index)
+{
+    uint32_t entry = directory[directory_index];
+    if ((entry & PAGING_IS_PRESENT) && !paging_is_shared_table(directory_index, entry))
+    {
+        return (uint32_t *)(entry & 0xfffff000);
+    }
+
+    uint32_t *table = frame_zalloc(sizeof(uint32_t) * PAGING_TOTAL_ENTRIES_PER_TABLE);
+    if (!table)
+    {
+        return 0;
+    }
+
+    if ((entry & PAGING_IS_PRESENT) && (entry & PAGING_IS_LARGE_PAGE))
+    {
+        // Split the large page into 4KB pages with the same rights
+        uint32_t base = entry & 0xffc00000;
+        uint32_t rights = entry & (PAGING_IS_PRESENT | PAGING_IS_WRITEABLE | PAGING_ACCESS_FROM_ALL | PAGING_CACHE_DISABLED | PAGING_WRITE_THROUGH);
+        for (int i = 0; i < PAGING_TOTAL_ENTRIES_PER_TABLE; i++)
+        {
+            table[i] = (base + (i * PAGING_PAGE_SIZE)) | rights;
+        }
+    }
+    else if (entry & PAGING_IS_PRESENT)
+    {
+        // Keep the restrictions the directory entry placed on the shared table
+        uint32_t *shared = (uint32_t *)(entry & 0xfffff000);
+        uint32_t allowed = 0xfffff000 | (entry & (PAGING_IS_PRESENT | PAGING_IS_WRITEABLE | PAGING_ACCESS_FROM_ALL)) | PAGING_CACHE_DISABLED | PAGING_WRITE_THROUGH;
+        for (int i = 0; i < PAGING_TOTAL_ENTRIES_PER_TABLE; i++)
+        {
+            table[i] = shared[i] & allowed;
+        }
+    }
+
+    directory[directory_index] = (uint32_t)table | PAGING_IS_PRESENT | PAGING_IS_WRITEABLE | PAGING_ACCESS_FROM_ALL;
+    return table;
+}
+
+static int paging_set_entry(uint32_t *directory, void *virt, uint32_t val)
 {
     if (!paging_is_aligned(virt))
     {
@@ -165,9 +392,102 @@ int paging_set(uint32_t *directory, void *virt, uint32_t val)
         return res;
     }
 
-    uint32_t entry = directory[directory_index];
-    uint32_t *table = (uint32_t *)(entry & 0xfffff000);
+    uint32_t *table = paging_get_private_table(directory, directory_index);
+    if (!table)
+    {
+        return -ENOMEM;
+    }
+    paging_release_entry(table[table_index]);
     table[table_index] = val;
 
     return 0;
 }
+
+/**
+ * Drops stale translations for count pages, small ranges are invalidated
+ * page by page while larger ones reload CR3 and flush the whole TLB.
+ */
+static void paging_flush_range(uint32_t *directory, void *virt, int count)
+{
+    if (directory != paging_current_directory() || count <= 0)
+    {
+        return;
+    }
+
+    if (count > FREE95_PAGING_INVLPG_THRESHOLD)
+    {
+        paging_reload_directory();
+        return;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        paging_invalidate_page(virt + (i * PAGING_PAGE_SIZE));
+    }
+}
+
+int paging_set(uint32_t *directory, void *virt, uint32_t val)
+{
+    int res = paging_set_entry(directory, virt, val);
+    if (res < 0)
+    {
+        return res;
+    }
+
+    paging_flush_range(directory, virt, 1);
+    return 0;
+}
+
+/**
+ * Removes count pages from the directory and drops the frames the entries
+ * own. Pages in the shared identity tables are left alone.
+ */
+int paging_unmap_range(uint32_t *directory, void *virt, int count)
+{
+    if (!paging_is_aligned(virt))
+    {
+        return -EINVARG;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t address = (uint32_t)virt + (i * PAGING_PAGE_SIZE);
+        uint32_t directory_index = address / PAGING_LARGE_PAGE_SIZE;
+        uint32_t entry = directory[directory_index];
+        if (!(entry & PAGING_IS_PRESENT) || (entry & PAGING_IS_LARGE_PAGE) || paging_is_shared_table(directory_index, entry))
+        {
+            continue;
+        }
+
+        uint32_t *table = (uint32_t *)(entry & 0xfffff000);
+        uint32_t table_index = (address % PAGING_LARGE_PAGE_SIZE) / PAGING_PAGE_SIZE;
+        paging_release_entry(table[table_index]);
+        table[table_index] = 0;
+    }
+
+    paging_flush_range(directory, virt, count);
+    return 0;
+}
+
+/**
+ * Returns the page table entry that maps virt, or 0 when it is not mapped.
+ * Pages inside a large page get an entry for their own 4K part of it.
+ */
+uint32_t paging_get(uint32_t *directory, void *virt)
+{
+    uint32_t directory_index = (uint32_t)virt / PAGING_LARGE_PAGE_SIZE;
+    uint32_t table_index = ((uint32_t)virt % PAGING_LARGE_PAGE_SIZE) / PAGING_PAGE_SIZE;
+    uint32_t entry = directory[directory_index];
+    if (!(entry & PAGING_IS_PRESENT))
+    {
+        return 0;
+    }
+
+    if (entry & PAGING_IS_LARGE_PAGE)
+    {
+        return ((entry & 0xffc00000) + (table_index * PAGING_PAGE_SIZE)) | (entry & 0xfff & ~PAGING_IS_LARGE_PAGE);
+    }
+
+    uint32_t *table = (uint32_t *)(entry & 0xfffff000);
+    return table[table_index];
+}
@@ -5,6 +5,9 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+// Kept in a bit the CPU ignores, the entry owns its frame and frees it when it goes away
+#define PAGING_IS_COPIED       0b10000000000
+#define PAGING_IS_LARGE_PAGE   0b10000000
 #define PAGING_CACHE_DISABLED  0b00010000
 #define PAGING_WRITE_THROUGH   0b00001000
 #define PAGING_ACCESS_FROM_ALL 0b00000100
@@ -12,8 +15,14 @@
 #define PAGING_IS_PRESENT      0b00000001
 
 
+// Page fault error code bits
+#define PAGING_FAULT_PRESENT 0b00000001
+#define PAGING_FAULT_WRITE   0b00000010
+#define PAGING_FAULT_USER    0b00000100
+
 #define PAGING_TOTAL_ENTRIES_PER_TABLE 1024
 #define PAGING_PAGE_SIZE 4096
+#define PAGING_LARGE_PAGE_SIZE (PAGING_TOTAL_ENTRIES_PER_TABLE * PAGING_PAGE_SIZE)
 
 
 struct paging_4gb_chunk
@@ -21,19 +30,25 @@ struct paging_4gb_chunk
     uint32_t* directory_entry;
 };
 
+void paging_init();
+int paging_identity_map(void* start, void* end);
+bool paging_identity_is_writeable(uint32_t phys);
 struct paging_4gb_chunk* paging_new_4gb(uint8_t flags);
 void paging_switch(uint32_t* directory);
 void enable_paging();
 
 int paging_set(uint32_t* directory, void* virt, uint32_t val);
+uint32_t paging_get(uint32_t* directory, void* virt);
 bool paging_is_aligned(void* addr);
 
 uint32_t* paging_4gb_chunk_get_directory(struct paging_4gb_chunk* chunk);
 void paging_free_4gb(struct paging_4gb_chunk* chunk);
+uint32_t* paging_current_directory();
 
 int paging_map_to(uint32_t *directory, void *virt, void *phys, void *phys_end, int flags);
 int paging_map_range(uint32_t* directory, void* virt, void* phys, int count, int flags);
 int paging_map(uint32_t* directory, void* virt, void* phys, int flags);
+int paging_unmap_range(uint32_t* directory, void* virt, int count);
 void* paging_align_address(void* ptr);
 
 #endif
@@ -0,0 +1,104 @@
+/*++
+
+Free95 20x/TX Kernel
+
+You may only use this code if you agree to the terms of the Free95 Source Code License agreement (GNU GPL v3) (see LICENSE).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    pci.c
+
+Abstract:
+
+    This module implements PCI configuration space access through
+    the 0xCF8/0xCFC mechanism and a scan of the bus for a device class.
+
+--*/
+
+#include "pci.h"
+#include "../io/io.h"
+#include "../status.h"
+
+static uint32_t pci_address(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset)
+{
+    return 0x80000000 | ((uint32_t)bus << 16) | ((uint32_t)slot << 11) | ((uint32_t)function << 8) | (offset & 0xFC);
+}
+
+static uint32_t pci_read_config(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset)
+{
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, slot, function, offset));
+    return insl(PCI_CONFIG_DATA);
+}
+
+uint32_t pci_read(struct pci_device* device, uint8_t offset)
+{
+    return pci_read_config(device->bus, device->slot, device->function, offset);
+}
+
+void pci_write(struct pci_device* device, uint8_t offset, uint32_t value)
+{
+    outl(PCI_CONFIG_ADDRESS, pci_address(device->bus, device->slot, device->function, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+uint32_t pci_read_bar(struct pci_device* device, int index)
+{
+    return pci_read(device, PCI_BAR0 + (index * 4));
+}
+
+void pci_enable_bus_master(struct pci_device* device)
+{
+    // The status register in the upper half is write-one-to-clear, so only the command is written back
+    uint32_t command = pci_read(device, PCI_COMMAND) & 0xFFFF;
+    pci_write(device, PCI_COMMAND, command | PCI_COMMAND_IO_SPACE | PCI_COMMAND_BUS_MASTER);
+}
+
+/**
+ * Finds the first function of the given class and subclass.
+ */
+int pci_find_class(uint8_t class_code, uint8_t subclass, struct pci_device* device_out)
+{
+    for (int bus = 0; bus < PCI_MAX_BUSES; bus++)
+    {
+        for (int slot = 0; slot < PCI_MAX_DEVICES; slot++)
+        {
+            for (int function = 0; function < PCI_MAX_FUNCTIONS; function++)
+            {
+                uint32_t id = pci_read_config(bus, slot, function, PCI_VENDOR_ID);
+                if ((id & 0xFFFF) == 0xFFFF)
+                {
+                    if (function == 0)
+                    {
+                        break;
+                    }
+                    continue;
+                }
+
+                uint32_t class_reg = pci_read_config(bus, slot, function, PCI_CLASS);
+                if ((class_reg >> 24) == class_code && ((class_reg >> 16) & 0xFF) == subclass)
+                {
+                    device_out->bus = bus;
+                    device_out->slot = slot;
+                    device_out->function = function;
+                    device_out->vendor_id = id & 0xFFFF;
+                    device_out->device_id = id >> 16;
+                    device_out->class_code = class_code;
+                    device_out->subclass = subclass;
+                    device_out->prog_if = (class_reg >> 8) & 0xFF;
+                    return 0;
+                }
+
+                // Single function devices only decode function 0
+                uint32_t header = pci_read_config(bus, slot, function, PCI_HEADER_TYPE);
+                if (function == 0 && !((header >> 16) & PCI_HEADER_MULTI_FUNCTION))
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    return -EIO;
+}
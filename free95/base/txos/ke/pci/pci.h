@@ -0,0 +1,49 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+#define PCI_MAX_BUSES 256
+#define PCI_MAX_DEVICES 32
+#define PCI_MAX_FUNCTIONS 8
+
+// Configuration space offsets
+#define PCI_VENDOR_ID 0x00
+#define PCI_COMMAND 0x04
+#define PCI_CLASS 0x08
+#define PCI_HEADER_TYPE 0x0C
+#define PCI_BAR0 0x10
+
+#define PCI_COMMAND_IO_SPACE 0x0001
+#define PCI_COMMAND_BUS_MASTER 0x0004
+
+#define PCI_HEADER_MULTI_FUNCTION 0x80
+#define PCI_BAR_IO_SPACE 0x01
+
+#define PCI_CLASS_MASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+
+struct pci_device
+{
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t function;
+
+    uint16_t vendor_id;
+    uint16_t device_id;
+
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+};
+
+uint32_t pci_read(struct pci_device* device, uint8_t offset);
+void pci_write(struct pci_device* device, uint8_t offset, uint32_t value);
+uint32_t pci_read_bar(struct pci_device* device, int index);
+void pci_enable_bus_master(struct pci_device* device);
+int pci_find_class(uint8_t class_code, uint8_t subclass, struct pci_device* device_out);
+
+#endif
@@ -0,0 +1,90 @@
+;++
+;
+; Free95 20x Assembly
+;
+; You may only use this code if you agree to the terms of the Free95 Source Code License agreement (GNU GPL v3) (see LICENSE).
+; If you do not agree to the terms, do not use the code.
+;
+;
+; Module Name:
+;
+;    smp.asm
+;
+; Abstract:
+;
+;    This module implements the code the other CPUs start in.
+;    smp_start() copies it below 1MB, a startup IPI enters it in real
+;    mode and it continues in smp_ap_main() with paging enabled.
+;
+;--
+
+; Has to match FREE95_SMP_TRAMPOLINE_ADDRESS in config.h
+SMP_TRAMPOLINE_ADDRESS equ 0x70000
+
+; Offsets of struct smp_trampoline_params
+SMP_PARAMS_CR0 equ 6
+SMP_PARAMS_CR3 equ 10
+SMP_PARAMS_CR4 equ 14
+SMP_PARAMS_STACK equ 18
+SMP_PARAMS_CPU equ 22
+
+section .asm
+
+global smp_trampoline
+global smp_trampoline_params
+global smp_trampoline_end
+
+extern smp_ap_main
+
+[BITS 16]
+
+; The startup IPI starts the CPU here with CS at the segment of the copy and IP 0
+smp_trampoline:
+    cli
+    mov ax, cs
+    mov ds, ax
+
+    ; The GDT of the BSP, the limit and base are the first 6 bytes of the parameters
+    o32 lgdt [smp_trampoline_params - smp_trampoline]
+
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp dword 0x08:(SMP_TRAMPOLINE_ADDRESS + smp_trampoline_32 - smp_trampoline)
+
+[BITS 32]
+
+smp_trampoline_32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; Paging as the BSP runs it, the copy is identity mapped
+    mov ebx, SMP_TRAMPOLINE_ADDRESS + smp_trampoline_params - smp_trampoline
+    mov eax, [ebx+SMP_PARAMS_CR4]
+    mov cr4, eax
+    mov eax, [ebx+SMP_PARAMS_CR3]
+    mov cr3, eax
+    mov eax, [ebx+SMP_PARAMS_CR0]
+    mov cr0, eax
+
+    mov esp, [ebx+SMP_PARAMS_STACK]
+    push dword [ebx+SMP_PARAMS_CPU]
+
+    ; Absolute, the kernel is not where this code runs
+    mov eax, smp_ap_main
+    call eax
+
+.halt:
+    cli
+    hlt
+    jmp .halt
+
+align 4
+smp_trampoline_params:
+    times 26 db 0
+
+smp_trampoline_end:
@@ -0,0 +1,575 @@
+/*++
+
+Free95 20x/TX Kernel
+
+You may only use this code if you agree to the terms of the Free95 Source Code License agreement (GNU GPL v3) (see LICENSE).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    smp.c
+
+Abstract:
+
+    This module implements multiprocessor support.
+    The CPUs are found through the ACPI MADT or the MP table and started
+    with INIT-SIPI-SIPI. Each one gets a TSS, a local APIC timer and an
+    idle task, and runs tasks from its own ready queues. The kernel lock
+    lets one CPU at a time into the kernel code that is not guarded by
+    locks of its own.
+
+--*/
+
+#include "smp.h"
+#include "../status.h"
+#include "../memory/memory.h"
+#include "../memory/heap/kheap.h"
+#include "../memory/paging/paging.h"
+#include "../gdt/gdt.h"
+#include "../idt/idt.h"
+#include "../task/task.h"
+#include "../task/tss.h"
+#include "../timer/pit.h"
+#include "../sync/sync.h"
+#include "../../init/kernel.h"
+
+// Real mode code in smp.asm that brings a CPU into protected mode with paging
+extern char smp_trampoline[];
+extern char smp_trampoline_params[];
+extern char smp_trampoline_end[];
+
+extern struct tss tss;
+extern struct gdt gdt_real[];
+extern struct gdt_structured gdt_structured[];
+
+// What the trampoline loads, it is filled in before every CPU is started
+struct smp_trampoline_params
+{
+    uint16_t gdt_limit;
+    uint32_t gdt_base;
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t stack;
+    uint32_t cpu;
+} __attribute__((packed));
+
+struct acpi_rsdp
+{
+    char signature[8];
+    uint8_t checksum;
+    char oem[6];
+    uint8_t revision;
+    uint32_t rsdt;
+} __attribute__((packed));
+
+struct acpi_header
+{
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem[6];
+    char oem_table[8];
+    uint32_t oem_revision;
+    uint32_t creator;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt
+{
+    struct acpi_header header;
+    uint32_t apic;
+    uint32_t flags;
+} __attribute__((packed));
+
+// Type 0 entries of the MADT
+struct acpi_madt_apic
+{
+    uint8_t type;
+    uint8_t length;
+    uint8_t processor;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct mp_floating
+{
+    char signature[4];
+    uint32_t config;
+    uint8_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    uint8_t features[5];
+} __attribute__((packed));
+
+struct mp_config
+{
+    char signature[4];
+    uint16_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem[8];
+    char product[12];
+    uint32_t oem_table;
+    uint16_t oem_size;
+    uint16_t entries;
+    uint32_t apic;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} __attribute__((packed));
+
+// Type 0 entries of the MP table, the other types are 8 bytes long
+struct mp_processor
+{
+    uint8_t type;
+    uint8_t apic_id;
+    uint8_t apic_version;
+    uint8_t flags;
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+} __attribute__((packed));
+
+static struct cpu smp_cpus[FREE95_MAX_CPUS];
+static int smp_cpu_count = 1;
+static volatile uint32_t* smp_apic = 0;
+// CPU index of every APIC ID
+static uint8_t smp_apic_to_cpu[256];
+// Local APIC timer counts per scheduler tick
+static uint32_t smp_timer_count = 0;
+
+// The kernel lock, the CPU that holds it may take it again
+static KSPIN_LOCK smp_kernel_spinlock = 0;
+static volatile int smp_kernel_owner = -1;
+static int smp_kernel_depth = 0;
+
+static uint32_t smp_apic_read(uint32_t reg)
+{
+    return smp_apic[reg / 4];
+}
+
+static void smp_apic_write(uint32_t reg, uint32_t value)
+{
+    smp_apic[reg / 4] = value;
+}
+
+struct cpu* smp_current_cpu()
+{
+    if (smp_cpu_count == 1 || !smp_apic)
+    {
+        return &smp_cpus[0];
+    }
+
+    return &smp_cpus[smp_apic_to_cpu[smp_apic_read(APIC_ID) >> 24]];
+}
+
+struct cpu* smp_get_cpu(int id)
+{
+    return &smp_cpus[id];
+}
+
+int smp_get_cpu_count()
+{
+    return smp_cpu_count;
+}
+
+void smp_apic_eoi()
+{
+    smp_apic_write(APIC_EOI, 0);
+}
+
+static bool smp_checksum(void* data, uint32_t length)
+{
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++)
+    {
+        sum += ((uint8_t*)data)[i];
+    }
+
+    return sum == 0;
+}
+
+static void* smp_scan(uint32_t start, uint32_t length, char* signature, int size, int total)
+{
+    for (uint32_t address = start; address + total <= start + length; address += 16)
+    {
+        if (memcmp((void*)address, signature, size) == 0 && smp_checksum((void*)address, total))
+        {
+            return (void*)address;
+        }
+    }
+
+    return 0;
+}
+
+// The tables are in the first KB of the EBDA or in the BIOS area
+static void* smp_find(char* signature, int size, int total)
+{
+    void* found = 0;
+    uint32_t ebda = *(uint16_t*)0x40E << 4;
+    if (ebda)
+    {
+        found = smp_scan(ebda, 1024, signature, size, total);
+    }
+
+    if (!found)
+    {
+        found = smp_scan(0xE0000, 0x20000, signature, size, total);
+    }
+
+    return found;
+}
+
+static void smp_add_cpu(uint32_t apic_id)
+{
+    // The BSP is already in the table
+    if (apic_id == smp_cpus[0].apic_id || smp_cpu_count == FREE95_MAX_CPUS || apic_id > 0xFF)
+    {
+        return;
+    }
+
+    struct cpu* cpu = &smp_cpus[smp_cpu_count];
+    cpu->id = smp_cpu_count;
+    cpu->apic_id = apic_id;
+    smp_apic_to_cpu[apic_id] = smp_cpu_count;
+    smp_cpu_count++;
+}
+
+// Returns the local APIC address from the MADT, 0 without ACPI
+static uint32_t smp_detect_acpi()
+{
+    struct acpi_rsdp* rsdp = smp_find("RSD PTR ", 8, sizeof(struct acpi_rsdp));
+    if (!rsdp)
+    {
+        return 0;
+    }
+
+    struct acpi_header* rsdt = (struct acpi_header*)rsdp->rsdt;
+    uint32_t* tables = (uint32_t*)(rsdt + 1);
+    int total = (rsdt->length - sizeof(struct acpi_header)) / sizeof(uint32_t);
+    for (int i = 0; i < total; i++)
+    {
+        struct acpi_madt* madt = (struct acpi_madt*)tables[i];
+        if (memcmp(madt->header.signature, "APIC", 4) != 0)
+        {
+            continue;
+        }
+
+        uint8_t* entry = (uint8_t*)(madt + 1);
+        uint8_t* end = (uint8_t*)madt + madt->header.length;
+        while (entry < end && entry[1])
+        {
+            struct acpi_madt_apic* apic = (struct acpi_madt_apic*)entry;
+            if (apic->type == 0 && (apic->flags & 1))
+            {
+                smp_add_cpu(apic->apic_id);
+            }
+            entry += entry[1];
+        }
+
+        return madt->apic;
+    }
+
+    return 0;
+}
+
+// Returns the local APIC address from the MP table, machines with a default configuration are not supported
+static uint32_t smp_detect_mp()
+{
+    struct mp_floating* floating = smp_find("_MP_", 4, sizeof(struct mp_floating));
+    if (!floating || !floating->config)
+    {
+        return 0;
+    }
+
+    struct mp_config* config = (struct mp_config*)floating->config;
+    if (memcmp(config->signature, "PCMP", 4) != 0)
+    {
+        return 0;
+    }
+
+    uint8_t* entry = (uint8_t*)(config + 1);
+    for (int i = 0; i < config->entries; i++)
+    {
+        if (entry[0] != 0)
+        {
+            entry += 8;
+            continue;
+        }
+
+        struct mp_processor* processor = (struct mp_processor*)entry;
+        if (processor->flags & 1)
+        {
+            smp_add_cpu(processor->apic_id);
+        }
+        entry += sizeof(struct mp_processor);
+    }
+
+    return config->apic;
+}
+
+/**
+ * Finds the other CPUs and maps the local APIC. Runs before paging is
+ * enabled, the firmware tables are read where they are.
+ */
+int smp_init()
+{
+    int res = 0;
+    smp_cpus[0].id = 0;
+    smp_cpus[0].started = true;
+    smp_cpus[0].tss = &tss;
+
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    if (!(edx & (1 << 9)))
+    {
+        res = -EIO;
+        goto out;
+    }
+
+    // The initial APIC ID, the local APIC is not mapped yet
+    smp_cpus[0].apic_id = ebx >> 24;
+    uint32_t apic = smp_detect_acpi();
+    if (!apic)
+    {
+        apic = smp_detect_mp();
+    }
+
+    if (!apic)
+    {
+        smp_cpu_count = 1;
+        res = -EIO;
+        goto out;
+    }
+
+    res = paging_identity_map((void*)apic, (void*)(apic + PAGING_PAGE_SIZE));
+    if (res < 0)
+    {
+        smp_cpu_count = 1;
+        goto out;
+    }
+
+    smp_apic = (uint32_t*)apic;
+    smp_apic_to_cpu[smp_cpus[0].apic_id] = 0;
+    res = smp_cpu_count;
+out:
+    return res;
+}
+
+static void smp_apic_enable(bool bsp)
+{
+    uint32_t low, high;
+    asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(APIC_BASE_MSR));
+    asm volatile("wrmsr" : : "a"(low | APIC_BASE_ENABLE), "d"(high), "c"(APIC_BASE_MSR));
+
+    smp_apic_write(APIC_SVR, APIC_SVR_ENABLE | FREE95_APIC_SPURIOUS_VECTOR);
+    smp_apic_write(APIC_TPR, 0);
+
+    // The PIC only reaches the BSP, through LINT0 like in virtual wire mode
+    smp_apic_write(APIC_LVT_LINT0, bsp ? APIC_DELIVERY_EXTINT : APIC_LVT_MASKED);
+    smp_apic_write(APIC_LVT_LINT1, APIC_DELIVERY_NMI);
+}
+
+static void smp_wait_ticks(uint32_t ticks)
+{
+    uint32_t start = pit_get_ticks();
+    while (pit_get_ticks() - start < ticks)
+    {
+        asm volatile("hlt");
+    }
+}
+
+// Counts how far the local APIC timer gets in a few PIT ticks, every CPU runs its timer at this rate
+static void smp_apic_calibrate()
+{
+    smp_apic_write(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    smp_apic_write(APIC_LVT_TIMER, APIC_LVT_MASKED);
+
+    // Start right after a tick
+    smp_wait_ticks(1);
+    uint32_t start = pit_get_ticks();
+    smp_apic_write(APIC_TIMER_INITIAL, 0xFFFFFFFF);
+    while (pit_get_ticks() - start < FREE95_SMP_CALIBRATION_TICKS)
+    {
+        asm volatile("hlt");
+    }
+
+    uint32_t elapsed = 0xFFFFFFFF - smp_apic_read(APIC_TIMER_CURRENT);
+    smp_apic_write(APIC_TIMER_INITIAL, 0);
+    smp_timer_count = elapsed / FREE95_SMP_CALIBRATION_TICKS;
+}
+
+static void smp_send_ipi(uint32_t apic_id, uint32_t command)
+{
+    smp_apic_write(APIC_ICR_HIGH, apic_id << 24);
+    smp_apic_write(APIC_ICR_LOW, command);
+    while (smp_apic_read(APIC_ICR_LOW) & APIC_ICR_PENDING)
+    {
+        asm volatile("pause");
+    }
+}
+
+/**
+ * Where the trampoline leaves an AP, on its boot stack with paging
+ * enabled. It continues in its idle task and never returns.
+ */
+void smp_ap_main(struct cpu* cpu)
+{
+    asm volatile("fninit");
+    idt_init_cpu();
+
+    // A TSS that is in use is marked busy, so every CPU loads one of its own
+    int index = FREE95_TOTAL_GDT_SEGMENTS - FREE95_MAX_CPUS + cpu->id;
+    cpu->tss->ss0 = KERNEL_DATA_SELECTOR;
+    gdt_structured[index].base = (uint32_t)cpu->tss;
+    gdt_structured[index].limit = sizeof(struct tss);
+    gdt_structured[index].type = 0xE9;
+    gdt_structured_to_gdt(&gdt_real[index], &gdt_structured[index], 1);
+    tss_load(index * sizeof(struct gdt));
+
+    smp_apic_enable(false);
+    smp_apic_write(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    smp_apic_write(APIC_LVT_TIMER, APIC_LVT_PERIODIC | FREE95_APIC_TIMER_VECTOR);
+    smp_apic_write(APIC_TIMER_INITIAL, smp_timer_count);
+
+    cpu->started = true;
+    task_cpu_run(cpu);
+}
+
+static int smp_start_cpu(struct cpu* cpu, struct smp_trampoline_params* params)
+{
+    int res = 0;
+    cpu->tss = kzalloc(sizeof(struct tss));
+    cpu->boot_stack = kzalloc(FREE95_SMP_BOOT_STACK_SIZE);
+    if (!cpu->tss || !cpu->boot_stack)
+    {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    res = task_cpu_init(cpu);
+    if (res < 0)
+    {
+        goto out;
+    }
+
+    params->stack = (uint32_t)cpu->boot_stack + FREE95_SMP_BOOT_STACK_SIZE;
+    params->cpu = (uint32_t)cpu;
+
+    // INIT, then the startup IPI with the page of the trampoline, sent twice as the specification asks
+    smp_send_ipi(cpu->apic_id, APIC_ICR_INIT);
+    smp_wait_ticks(2);
+    for (int i = 0; i < 2 && !cpu->started; i++)
+    {
+        smp_send_ipi(cpu->apic_id, APIC_ICR_STARTUP | (FREE95_SMP_TRAMPOLINE_ADDRESS >> 12));
+        smp_wait_ticks(1);
+    }
+
+    uint32_t start = pit_get_ticks();
+    while (!cpu->started && pit_get_ticks() - start < FREE95_SCHED_HZ)
+    {
+        asm volatile("hlt");
+    }
+
+    // A CPU that comes up late still finds its stacks, they are not freed
+    if (!cpu->started)
+    {
+        res = -EIO;
+    }
+
+out:
+    return res;
+}
+
+/**
+ * Starts the other CPUs one after the other, returns how many CPUs run.
+ * Called by the BSP once the scheduler and the PIT run.
+ */
+int smp_start()
+{
+    if (!smp_apic || smp_cpu_count == 1)
+    {
+        return 1;
+    }
+
+    smp_apic_enable(true);
+    smp_apic_calibrate();
+
+    memcpy((void*)FREE95_SMP_TRAMPOLINE_ADDRESS, smp_trampoline, smp_trampoline_end - smp_trampoline);
+    struct smp_trampoline_params* params = (struct smp_trampoline_params*)(FREE95_SMP_TRAMPOLINE_ADDRESS + (smp_trampoline_params - smp_trampoline));
+    params->gdt_limit = sizeof(struct gdt) * FREE95_TOTAL_GDT_SEGMENTS - 1;
+    params->gdt_base = (uint32_t)gdt_real;
+    asm volatile("mov %%cr0, %0" : "=r"(params->cr0));
+    asm volatile("mov %%cr3, %0" : "=r"(params->cr3));
+    asm volatile("mov %%cr4, %0" : "=r"(params->cr4));
+
+    int started = 1;
+    for (int i = 1; i < smp_cpu_count; i++)
+    {
+        if (smp_start_cpu(&smp_cpus[i], params) < 0)
+        {
+            DbgPrint("CPU %d did not start\n", i);
+            continue;
+        }
+        started++;
+    }
+
+    return started;
+}
+
+/**
+ * Takes the kernel lock, system calls, page faults and device interrupts
+ * run with it. Called with interrupts disabled.
+ */
+void smp_lock_kernel()
+{
+    int id = smp_current_cpu()->id;
+    if (smp_kernel_owner != id)
+    {
+        KeAcquireSpinLock(&smp_kernel_spinlock);
+        smp_kernel_owner = id;
+    }
+    smp_kernel_depth++;
+}
+
+void smp_unlock_kernel()
+{
+    if (--smp_kernel_depth == 0)
+    {
+        smp_kernel_owner = -1;
+        KeReleaseSpinLock(&smp_kernel_spinlock, 0);
+    }
+}
+
+/**
+ * Lets go of the kernel lock before the current task is switched out,
+ * returns what smp_restore_kernel_lock() takes back once it runs again.
+ */
+int smp_drop_kernel_lock()
+{
+    int depth = 0;
+    if (smp_kernel_owner == smp_current_cpu()->id)
+    {
+        depth = smp_kernel_depth;
+        smp_kernel_depth = 0;
+        smp_kernel_owner = -1;
+        KeReleaseSpinLock(&smp_kernel_spinlock, 0);
+    }
+
+    return depth;
+}
+
+void smp_restore_kernel_lock(int depth)
+{
+    if (depth == 0)
+    {
+        return;
+    }
+
+    KeAcquireSpinLock(&smp_kernel_spinlock);
+    smp_kernel_owner = smp_current_cpu()->id;
+    smp_kernel_depth = depth;
+}
@@ -0,0 +1,75 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../config.h"
+
+struct task;
+struct tss;
+
+// Local APIC registers, relative to its base address
+#define APIC_ID 0x020
+#define APIC_TPR 0x080
+#define APIC_EOI 0x0B0
+#define APIC_SVR 0x0F0
+#define APIC_ICR_LOW 0x300
+#define APIC_ICR_HIGH 0x310
+#define APIC_LVT_TIMER 0x320
+#define APIC_LVT_LINT0 0x350
+#define APIC_LVT_LINT1 0x360
+#define APIC_TIMER_INITIAL 0x380
+#define APIC_TIMER_CURRENT 0x390
+#define APIC_TIMER_DIVIDE 0x3E0
+
+#define APIC_SVR_ENABLE 0x100
+#define APIC_LVT_MASKED 0x10000
+#define APIC_LVT_PERIODIC 0x20000
+#define APIC_DELIVERY_NMI 0x400
+#define APIC_DELIVERY_EXTINT 0x700
+#define APIC_ICR_INIT 0x4500
+#define APIC_ICR_STARTUP 0x4600
+#define APIC_ICR_PENDING 0x1000
+#define APIC_TIMER_DIVIDE_16 0x3
+
+#define APIC_BASE_MSR 0x1B
+#define APIC_BASE_ENABLE 0x800
+
+struct cpu
+{
+    // Index in the CPU table, the BSP is 0
+    int id;
+    uint32_t apic_id;
+    volatile bool started;
+
+    // Ring 3 interrupts on this CPU enter at tss->esp0
+    struct tss* tss;
+    void* boot_stack;
+
+    // Scheduler state of the CPU, guarded by the dispatcher lock
+    struct task* current_task;
+    struct task* idle_task;
+    // A task that exited, freed by the next task that runs on this CPU
+    struct task* dead_task;
+    // Ready tasks of every priority, bit n of the summary is set while queue n is not empty
+    struct task* ready_head[FREE95_PRIORITY_LEVELS];
+    struct task* ready_tail[FREE95_PRIORITY_LEVELS];
+    uint32_t ready_summary;
+
+    // Nesting of interrupt handlers running on this CPU
+    int interrupt_depth;
+};
+
+int smp_init();
+int smp_start();
+struct cpu* smp_current_cpu();
+struct cpu* smp_get_cpu(int id);
+int smp_get_cpu_count();
+void smp_apic_eoi();
+
+void smp_lock_kernel();
+void smp_unlock_kernel();
+int smp_drop_kernel_lock();
+void smp_restore_kernel_lock(int depth);
+
+#endif
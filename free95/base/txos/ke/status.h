@@ -8,6 +8,7 @@
 #define EBADPATH 4
 #define EFSNOTUS 5
 #define ERDONLY 6
+#define ENOENT 7
 #define EISTKN 8
 
 #endif
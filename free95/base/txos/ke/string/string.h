@@ -15,6 +15,7 @@ int strcmp(const char *str1, const char *str2);
 int istrncmp(const char* s1, const char* s2, int n);
 int strnlen_terminator(const char* str, int max, char terminator);
 char tolower(char s1);
+char toupper(char s1);
 char *strtok(char *str, const char *delim);
 char *strchr(const char *str, int ch);
 
@@ -0,0 +1,410 @@
+/*++
+
+Free95 20x/TX Kernel
+
+You may only use this code if you agree to the terms of the Free95 Source Code License agreement (GNU GPL v3) (see LICENSE).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    sync.c
+
+Abstract:
+
+    This module implements the dispatcher objects tasks wait for.
+    Events, mutexes and semaphores share a header with a signal state
+    and a FIFO list of waiting tasks. A task that waits for an object
+    that is not signaled leaves the ready queues until the object is
+    signaled or its timeout expires on a timer tick. Interrupt handlers
+    and code that runs before the scheduler cannot wait, they only take
+    objects that are already signaled. The objects and the ready queues
+    of every CPU are guarded by one spinlock, the dispatcher lock.
+
+--*/
+
+#include "sync.h"
+#include "../config.h"
+#include "../task/task.h"
+#include "../timer/pit.h"
+#include "../smp/smp.h"
+
+KSPIN_LOCK KiDispatcherLock = 0;
+
+// Tasks waiting with a timeout, checked on every timer tick
+static struct task* sync_timer_head = 0;
+
+ULONG KeDisableInterrupts()
+{
+    ULONG flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+VOID KeRestoreInterrupts(ULONG Flags)
+{
+    if (Flags & 0x200)
+    {
+        asm volatile("sti" : : : "memory");
+    }
+}
+
+VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock)
+{
+    *SpinLock = 0;
+}
+
+/**
+ * Disables interrupts and spins until the lock is free, returns the flags
+ * KeReleaseSpinLock() restores.
+ */
+ULONG KeAcquireSpinLock(PKSPIN_LOCK SpinLock)
+{
+    ULONG flags = KeDisableInterrupts();
+    while (__sync_lock_test_and_set(SpinLock, 1))
+    {
+        // Read only while it is taken, so the cache line is not bounced between the waiters
+        while (*SpinLock)
+        {
+            asm volatile("pause");
+        }
+    }
+
+    return flags;
+}
+
+VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, ULONG Flags)
+{
+    __sync_lock_release(SpinLock);
+    KeRestoreInterrupts(Flags);
+}
+
+// Interrupt handlers run on the stack of the interrupted task and must not switch away from it
+VOID KeEnterInterrupt()
+{
+    smp_current_cpu()->interrupt_depth++;
+}
+
+VOID KeLeaveInterrupt()
+{
+    smp_current_cpu()->interrupt_depth--;
+}
+
+/**
+ * True if the caller may block, which takes a task other than the idle
+ * task outside of an interrupt handler.
+ */
+BOOLEAN KeCanWait()
+{
+    struct cpu* cpu = smp_current_cpu();
+    return cpu->current_task && cpu->current_task != cpu->idle_task && cpu->interrupt_depth == 0;
+}
+
+static BOOLEAN sync_is_signaled(DISPATCHER_HEADER* header, struct task* task)
+{
+    if (header->Type == MutexObject)
+    {
+        return header->SignalState > 0 || ((PKMUTEX)header)->OwnerThread == task;
+    }
+
+    return header->SignalState > 0;
+}
+
+// Takes what the waiter gets from the object, notification events stay signaled for everyone
+static VOID sync_satisfy(DISPATCHER_HEADER* header, struct task* task)
+{
+    switch (header->Type)
+    {
+        case SynchronizationEventObject:
+            header->SignalState = 0;
+            break;
+
+        case MutexObject:
+            header->SignalState--;
+            ((PKMUTEX)header)->OwnerThread = task;
+            break;
+
+        case SemaphoreObject:
+            header->SignalState--;
+            break;
+    }
+}
+
+static VOID sync_timer_insert(struct task* task)
+{
+    task->timer_prev = 0;
+    task->timer_next = sync_timer_head;
+    if (sync_timer_head)
+    {
+        sync_timer_head->timer_prev = task;
+    }
+    sync_timer_head = task;
+}
+
+static VOID sync_timer_remove(struct task* task)
+{
+    if (!task->timer_prev && sync_timer_head != task)
+    {
+        return;
+    }
+
+    if (task->timer_prev)
+    {
+        task->timer_prev->timer_next = task->timer_next;
+    }
+    else
+    {
+        sync_timer_head = task->timer_next;
+    }
+
+    if (task->timer_next)
+    {
+        task->timer_next->timer_prev = task->timer_prev;
+    }
+
+    task->timer_next = 0;
+    task->timer_prev = 0;
+}
+
+static VOID sync_wait_insert(DISPATCHER_HEADER* header, struct task* task)
+{
+    task->wait_object = header;
+    task->wait_next = 0;
+    task->wait_prev = header->WaitListTail;
+    if (header->WaitListTail)
+    {
+        header->WaitListTail->wait_next = task;
+    }
+    else
+    {
+        header->WaitListHead = task;
+    }
+    header->WaitListTail = task;
+}
+
+static VOID sync_wait_remove(struct task* task)
+{
+    DISPATCHER_HEADER* header = task->wait_object;
+    if (task->wait_prev)
+    {
+        task->wait_prev->wait_next = task->wait_next;
+    }
+    else
+    {
+        header->WaitListHead = task->wait_next;
+    }
+
+    if (task->wait_next)
+    {
+        task->wait_next->wait_prev = task->wait_prev;
+    }
+    else
+    {
+        header->WaitListTail = task->wait_prev;
+    }
+
+    task->wait_next = 0;
+    task->wait_prev = 0;
+    task->wait_object = 0;
+}
+
+static VOID sync_wake(struct task* task, NTSTATUS status, LONG increment)
+{
+    sync_wait_remove(task);
+    sync_timer_remove(task);
+    task->wait_status = status;
+    task_unblock(task, increment);
+}
+
+/**
+ * Hands the object to its waiters in the order they came for as long as
+ * it stays signaled. Returns true if a task was woken.
+ */
+static BOOLEAN sync_signal(DISPATCHER_HEADER* header, LONG increment)
+{
+    BOOLEAN woken = FALSE;
+    while (header->WaitListHead && sync_is_signaled(header, header->WaitListHead))
+    {
+        struct task* task = header->WaitListHead;
+        sync_satisfy(header, task);
+        sync_wake(task, STATUS_SUCCESS, increment);
+        woken = TRUE;
+    }
+
+    return woken;
+}
+
+// A task that was woken may outrank the caller, interrupt handlers leave that to their exit path
+static VOID sync_dispatch(BOOLEAN woken, BOOLEAN wait)
+{
+    if (woken && !wait && KeCanWait())
+    {
+        task_dispatch();
+    }
+}
+
+VOID KeInitializeEvent(PKEVENT Event, EVENT_TYPE Type, BOOLEAN State)
+{
+    Event->Header.Type = Type == NotificationEvent ? NotificationEventObject : SynchronizationEventObject;
+    Event->Header.SignalState = State ? 1 : 0;
+    Event->Header.WaitListHead = 0;
+    Event->Header.WaitListTail = 0;
+}
+
+/**
+ * Signals the event and wakes its waiters with a priority boost of
+ * Increment. With Wait set the caller is about to wait itself and the
+ * woken tasks run once it does. Returns the previous state.
+ */
+LONG KeSetEvent(PKEVENT Event, LONG Increment, BOOLEAN Wait)
+{
+    ULONG flags = KeAcquireSpinLock(&KiDispatcherLock);
+    LONG state = Event->Header.SignalState;
+    Event->Header.SignalState = 1;
+    BOOLEAN woken = sync_signal(&Event->Header, Increment);
+    sync_dispatch(woken, Wait);
+    KeReleaseSpinLock(&KiDispatcherLock, flags);
+    return state;
+}
+
+LONG KeResetEvent(PKEVENT Event)
+{
+    ULONG flags = KeAcquireSpinLock(&KiDispatcherLock);
+    LONG state = Event->Header.SignalState;
+    Event->Header.SignalState = 0;
+    KeReleaseSpinLock(&KiDispatcherLock, flags);
+    return state;
+}
+
+VOID KeClearEvent(PKEVENT Event)
+{
+    ULONG flags = KeAcquireSpinLock(&KiDispatcherLock);
+    Event->Header.SignalState = 0;
+    KeReleaseSpinLock(&KiDispatcherLock, flags);
+}
+
+LONG KeReadStateEvent(PKEVENT Event)
+{
+    return Event->Header.SignalState;
+}
+
+VOID KeInitializeMutex(PKMUTEX Mutex)
+{
+    Mutex->Header.Type = MutexObject;
+    Mutex->Header.SignalState = 1;
+    Mutex->Header.WaitListHead = 0;
+    Mutex->Header.WaitListTail = 0;
+    Mutex->OwnerThread = 0;
+}
+
+/**
+ * Undoes one acquisition by the owner, the last one passes the mutex to
+ * the first waiter. Returns the previous signal state.
+ */
+LONG KeReleaseMutex(PKMUTEX Mutex, BOOLEAN Wait)
+{
+    ULONG flags = KeAcquireSpinLock(&KiDispatcherLock);
+    LONG state = Mutex->Header.SignalState;
+    BOOLEAN woken = FALSE;
+    if (Mutex->OwnerThread == task_current() && state <= 0)
+    {
+        Mutex->Header.SignalState++;
+        if (Mutex->Header.SignalState == 1)
+        {
+            Mutex->OwnerThread = 0;
+            woken = sync_signal(&Mutex->Header, 0);
+        }
+    }
+    sync_dispatch(woken, Wait);
+    KeReleaseSpinLock(&KiDispatcherLock, flags);
+    return state;
+}
+
+VOID KeInitializeSemaphore(PKSEMAPHORE Semaphore, LONG Count, LONG Limit)
+{
+    Semaphore->Header.Type = SemaphoreObject;
+    Semaphore->Header.SignalState = Count;
+    Semaphore->Header.WaitListHead = 0;
+    Semaphore->Header.WaitListTail = 0;
+    Semaphore->Limit = Limit;
+}
+
+/**
+ * Adds Adjustment to the count, which may not go over the limit, and
+ * wakes as many waiters as it allows. Returns the previous count.
+ */
+LONG KeReleaseSemaphore(PKSEMAPHORE Semaphore, LONG Increment, LONG Adjustment, BOOLEAN Wait)
+{
+    ULONG flags = KeAcquireSpinLock(&KiDispatcherLock);
+    LONG state = Semaphore->Header.SignalState;
+    BOOLEAN woken = FALSE;
+    if (Adjustment > 0 && state <= Semaphore->Limit - Adjustment)
+    {
+        Semaphore->Header.SignalState += Adjustment;
+        woken = sync_signal(&Semaphore->Header, Increment);
+    }
+    sync_dispatch(woken, Wait);
+    KeReleaseSpinLock(&KiDispatcherLock, flags);
+    return state;
+}
+
+/**
+ * Waits until the object is signaled and takes it. Timeout is relative
+ * in milliseconds, a null Timeout waits forever and 0 only checks the
+ * object. Returns STATUS_SUCCESS or STATUS_TIMEOUT.
+ */
+NTSTATUS KeWaitForSingleObject(PVOID Object, PULONG Timeout)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    DISPATCHER_HEADER* header = Object;
+    ULONG flags = KeAcquireSpinLock(&KiDispatcherLock);
+    struct task* task = task_current();
+    if (sync_is_signaled(header, task))
+    {
+        sync_satisfy(header, task);
+        goto out;
+    }
+
+    if ((Timeout && *Timeout == 0) || !KeCanWait())
+    {
+        status = STATUS_TIMEOUT;
+        goto out;
+    }
+
+    sync_wait_insert(header, task);
+    if (Timeout)
+    {
+        // Round up so the task never wakes early, the tick in progress counts as partly gone
+        uint32_t ticks = (*Timeout * FREE95_SCHED_HZ + 999) / 1000 + 1;
+        task->wait_until = pit_get_ticks() + ticks;
+        sync_timer_insert(task);
+    }
+
+    // Returns once sync_wake() made the task ready again and it was picked
+    task_block();
+    status = task->wait_status;
+
+out:
+    KeReleaseSpinLock(&KiDispatcherLock, flags);
+    return status;
+}
+
+/**
+ * Called by the timer interrupt, wakes the tasks whose timeout expired.
+ */
+VOID KeClockTick()
+{
+    ULONG flags = KeAcquireSpinLock(&KiDispatcherLock);
+    uint32_t now = pit_get_ticks();
+    struct task* task = sync_timer_head;
+    while (task)
+    {
+        struct task* next = task->timer_next;
+        if ((int32_t)(now - task->wait_until) >= 0)
+        {
+            sync_wake(task, STATUS_TIMEOUT, 0);
+        }
+        task = next;
+    }
+    KeReleaseSpinLock(&KiDispatcherLock, flags);
+}
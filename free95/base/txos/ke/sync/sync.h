@@ -0,0 +1,84 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include "../base.h"
+#include <stdint.h>
+
+struct task;
+
+typedef enum _EVENT_TYPE
+{
+    // Stays signaled and releases every waiter until it is reset
+    NotificationEvent,
+    // Releases one waiter and resets itself
+    SynchronizationEvent
+} EVENT_TYPE;
+
+enum
+{
+    NotificationEventObject,
+    SynchronizationEventObject,
+    MutexObject,
+    SemaphoreObject
+};
+
+// Common to every object a task can wait for, the waiters queue in FIFO order
+typedef struct _DISPATCHER_HEADER
+{
+    UCHAR Type;
+    LONG SignalState;
+    struct task* WaitListHead;
+    struct task* WaitListTail;
+} DISPATCHER_HEADER;
+
+typedef struct _KEVENT
+{
+    DISPATCHER_HEADER Header;
+} KEVENT, *PKEVENT;
+
+// SignalState is 1 while nobody owns the mutex, the owner may acquire it again
+typedef struct _KMUTEX
+{
+    DISPATCHER_HEADER Header;
+    struct task* OwnerThread;
+} KMUTEX, *PKMUTEX;
+
+typedef struct _KSEMAPHORE
+{
+    DISPATCHER_HEADER Header;
+    LONG Limit;
+} KSEMAPHORE, *PKSEMAPHORE;
+
+// Held with interrupts disabled, for as short as possible
+typedef volatile ULONG KSPIN_LOCK, *PKSPIN_LOCK;
+
+// Guards the dispatcher objects and the ready queues of every CPU
+extern KSPIN_LOCK KiDispatcherLock;
+
+VOID KeInitializeEvent(PKEVENT Event, EVENT_TYPE Type, BOOLEAN State);
+LONG KeSetEvent(PKEVENT Event, LONG Increment, BOOLEAN Wait);
+LONG KeResetEvent(PKEVENT Event);
+VOID KeClearEvent(PKEVENT Event);
+LONG KeReadStateEvent(PKEVENT Event);
+
+VOID KeInitializeMutex(PKMUTEX Mutex);
+LONG KeReleaseMutex(PKMUTEX Mutex, BOOLEAN Wait);
+
+VOID KeInitializeSemaphore(PKSEMAPHORE Semaphore, LONG Count, LONG Limit);
+LONG KeReleaseSemaphore(PKSEMAPHORE Semaphore, LONG Increment, LONG Adjustment, BOOLEAN Wait);
+
+NTSTATUS KeWaitForSingleObject(PVOID Object, PULONG Timeout);
+
+BOOLEAN KeCanWait();
+VOID KeEnterInterrupt();
+VOID KeLeaveInterrupt();
+VOID KeClockTick();
+
+ULONG KeDisableInterrupts();
+VOID KeRestoreInterrupts(ULONG Flags);
+
+VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock);
+ULONG KeAcquireSpinLock(PKSPIN_LOCK SpinLock);
+VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, ULONG Flags);
+
+#endif
@@ -6,22 +6,25 @@
 #include "../string/string.h"
 #include "../fs/file.h"
 #include "../memory/heap/kheap.h"
+#include "../memory/frame/frame.h"
 #include "../memory/paging/paging.h"
+#include "../sync/sync.h"
 #include "../../init/kernel.h"
 
-// The current process that is running
-struct process* current_process = 0;
-
 static struct process* processes[FREE95_MAX_PROCESSES] = {};
+// Guards the slots of the process table, loaders on other CPUs may race for the same one
+static KSPIN_LOCK process_lock = 0;
 
 static void process_init(struct process* process)
 {
     memset(process, 0, sizeof(struct process));
 }
 
+// The process of the task running on this CPU
 struct process* process_current()
 {
-    return current_process;
+    struct task* task = task_current();
+    return task ? task->process : 0;
 }
 
 struct process* process_get(int process_id)
@@ -92,12 +95,7 @@ int process_load_for_slot(const char* filename, struct process** process, int pr
     struct task* task = 0;
     struct process* _process;
     void* program_stack_ptr = 0;
-
-    if (process_get(process_slot) != 0)
-    {
-        res = -EISTKN;
-        goto out;
-    }
+    ULONG flags;
 
     _process = kzalloc(sizeof(struct process));
     if (!_process)
@@ -107,13 +105,26 @@ int process_load_for_slot(const char* filename, struct process** process, int pr
     }
 
     process_init(_process);
+
+    // Claim the slot before loading, a free slot may be taken by the time the process is ready
+    flags = KeAcquireSpinLock(&process_lock);
+    if (process_slot < 0 || process_slot >= FREE95_MAX_PROCESSES || processes[process_slot] != 0)
+    {
+        KeReleaseSpinLock(&process_lock, flags);
+        kfree(_process);
+        _process = 0;
+        res = -EISTKN;
+        goto out;
+    }
+    processes[process_slot] = _process;
+    KeReleaseSpinLock(&process_lock, flags);
     res = process_load_data(filename, _process);
     if (res < 0)
     {
         goto out;
     }
 
-    program_stack_ptr = kzalloc(FREE95_USER_PROGRAM_STACK_SIZE);
+    program_stack_ptr = frame_zalloc(FREE95_USER_PROGRAM_STACK_SIZE);
     if (!program_stack_ptr)
     {
         res = -ENOMEM;
@@ -141,9 +152,6 @@ int process_load_for_slot(const char* filename, struct process** process, int pr
 
     *process = _process;
 
-    // Add the process to the array
-    processes[process_slot] = _process;
-
 out:
     if (ISERR(res))
     {
@@ -152,6 +160,13 @@ out:
             task_free(_process->task);
         }
 
+        if (_process)
+        {
+            flags = KeAcquireSpinLock(&process_lock);
+            processes[process_slot] = 0;
+            KeReleaseSpinLock(&process_lock, flags);
+        }
+
        // Free the process data
     }
     return res;
@@ -0,0 +1,104 @@
+;++
+;
+; Free95 20x Assembly
+;
+; You may only use this code if you agree to the terms of the Free95 Source Code License agreement (GNU GPL v3) (see LICENSE).
+; If you do not agree to the terms, do not use the code.
+;
+;
+; Module Name:
+;
+;    task.asm
+;
+; Abstract:
+;
+;    This module implements the task switching code.
+;
+;--
+
+[BITS 32]
+
+section .asm
+
+global task_switch_context
+global task_return
+global task_idle_loop
+global task_fxsave
+global task_fxrstor
+
+; void task_switch_context(uint32_t* old_esp, uint32_t new_esp)
+; Saves the callee saved registers on the current kernel stack and continues on the other one
+task_switch_context:
+    mov eax, [esp+4]
+    mov edx, [esp+8]
+
+    push ebp
+    push ebx
+    push esi
+    push edi
+
+    mov [eax], esp
+    mov esp, edx
+
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
+
+; void task_return(struct registers* registers)
+; Enters a task from its saved registers, iret only switches the stack when going to ring 3
+task_return:
+    mov ebx, [esp+4]
+    test dword [ebx+32], 3
+    jz .kernel
+
+    push dword [ebx+44] ; ss
+    push dword [ebx+40] ; esp
+    push dword [ebx+36] ; flags
+    push dword [ebx+32] ; cs
+    push dword [ebx+28] ; ip
+
+    mov ax, [ebx+44]
+    jmp .segments
+
+.kernel:
+    mov esp, [ebx+40]
+    push dword [ebx+36] ; flags
+    push dword [ebx+32] ; cs
+    push dword [ebx+28] ; ip
+
+    mov ax, [ebx+44]
+
+.segments:
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    mov edi, [ebx]
+    mov esi, [ebx+4]
+    mov ebp, [ebx+8]
+    mov edx, [ebx+16]
+    mov ecx, [ebx+20]
+    mov eax, [ebx+24]
+    mov ebx, [ebx+12]
+    iretd
+
+; Runs when no task is ready, the next interrupt wakes it up
+task_idle_loop:
+    sti
+    hlt
+    jmp task_idle_loop
+
+; void task_fxsave(void* area)
+task_fxsave:
+    mov eax, [esp+4]
+    fxsave [eax]
+    ret
+
+; void task_fxrstor(void* area)
+task_fxrstor:
+    mov eax, [esp+4]
+    fxrstor [eax]
+    ret
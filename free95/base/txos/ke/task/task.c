@@ -13,6 +13,15 @@ Module Name:
 Abstract:
 
     This module implements the task management system.
+    Ready tasks wait in one queue per priority, a bitmap of the non-empty
+    queues finds the highest priority with a single bsr. Tasks of equal
+    priority take turns when the PIT ends their quantum, every task has a
+    kernel stack of its own and task_switch_context() swaps them. Tasks
+    waiting for a dispatcher object leave the queues until it wakes them.
+    Every CPU has queues and an idle task of its own, a CPU that runs out
+    of ready tasks takes one from the others before it halts. The queues
+    of all CPUs are guarded by the dispatcher lock, which is held across
+    task_switch_context() and released by the task that runs next.
 
 --*/
 
@@ -21,20 +30,143 @@ Abstract:
 #include "../status.h"
 #include "../memory/heap/kheap.h"
 #include "../memory/memory.h"
+#include "../memory/frame/frame.h"
 #include "process.h"
+#include "tss.h"
+#include "../idt/idt.h"
+#include "../timer/pit.h"
+#include "../smp/smp.h"
+#include "../sync/sync.h"
 
-// The current task that is running
-struct task* current_task = 0;
+void task_switch_context(uint32_t* old_esp, uint32_t new_esp);
+void task_return(struct registers* registers);
+void task_idle_loop();
+void task_fxsave(void* area);
+void task_fxrstor(void* area);
 
-// Task linked list
+// Threads return into this ring 3 stub, it ends them with a system call
+void KiThreadExit();
+
+// Task linked list, guarded by the dispatcher lock
 struct task* task_tail = 0;
 struct task* task_head = 0;
 
 int task_init(struct task* task, struct process* process);
+static void task_first_run();
 
 struct task* task_current()
 {
-    return current_task;
+    return smp_current_cpu()->current_task;
+}
+
+static void task_list_append(struct task* task)
+{
+    if (task_head == 0)
+    {
+        task_head = task;
+        task_tail = task;
+        return;
+    }
+
+    task_tail->next = task;
+    task->prev = task_tail;
+    task_tail = task;
+}
+
+// Queues the task on the CPU it belongs to
+static void task_ready_insert(struct task* task)
+{
+    struct cpu* cpu = task->cpu;
+    int priority = task->priority;
+    task->state = TASK_STATE_READY;
+    task->ready_next = 0;
+    task->ready_prev = cpu->ready_tail[priority];
+    if (cpu->ready_tail[priority])
+    {
+        cpu->ready_tail[priority]->ready_next = task;
+    }
+    else
+    {
+        cpu->ready_head[priority] = task;
+    }
+    cpu->ready_tail[priority] = task;
+    cpu->ready_summary |= 1 << priority;
+}
+
+static void task_ready_remove(struct task* task)
+{
+    struct cpu* cpu = task->cpu;
+    int priority = task->priority;
+    if (task->ready_prev)
+    {
+        task->ready_prev->ready_next = task->ready_next;
+    }
+    else
+    {
+        cpu->ready_head[priority] = task->ready_next;
+    }
+
+    if (task->ready_next)
+    {
+        task->ready_next->ready_prev = task->ready_prev;
+    }
+    else
+    {
+        cpu->ready_tail[priority] = task->ready_prev;
+    }
+
+    task->ready_next = 0;
+    task->ready_prev = 0;
+    if (!cpu->ready_head[priority])
+    {
+        cpu->ready_summary &= ~(1 << priority);
+    }
+}
+
+// Highest priority with a ready task on the CPU, -1 when none is ready
+static int task_ready_highest(struct cpu* cpu)
+{
+    if (!cpu->ready_summary)
+    {
+        return -1;
+    }
+
+    uint32_t priority;
+    asm volatile("bsr %1, %0" : "=r"(priority) : "rm"(cpu->ready_summary));
+    return priority;
+}
+
+static void* task_fpu_state(struct task* task)
+{
+    return (void*)(((uint32_t)task->fpu_state + 15) & ~15);
+}
+
+/**
+ * Gives the task a kernel stack that starts out in task_first_run() the
+ * first time task_switch_context() switches to it.
+ */
+static int task_init_kernel_stack(struct task* task)
+{
+    task->kernel_stack = kzalloc(FREE95_TASK_KERNEL_STACK_SIZE);
+    if (!task->kernel_stack)
+    {
+        return -ENOMEM;
+    }
+
+    // task_switch_context() pops edi, esi, ebx and ebp, then returns
+    uint32_t* stack = (uint32_t*)((char*)task->kernel_stack + FREE95_TASK_KERNEL_STACK_SIZE);
+    *--stack = (uint32_t)task_first_run;
+    *--stack = 0;
+    *--stack = 0;
+    *--stack = 0;
+    *--stack = 0;
+    task->kernel_esp = (uint32_t)stack;
+
+    // Control word and MXCSR as fninit and a reset leave them
+    char* fpu = task_fpu_state(task);
+    *(uint16_t*)fpu = 0x037F;
+    *(uint32_t*)(fpu + 24) = 0x1F80;
+    return 0;
 }
 
 struct task* task_new(struct process* process)
@@ -53,16 +185,11 @@ struct task* task_new(struct process* process)
         goto out;
     }
 
-    if (task_head == 0)
-    {
-        task_head = task;
-        task_tail = task;
-        goto out;
-    }
-
-    task_tail->next = task;
-    task->prev = task_tail;
-    task_tail = task;
+    ULONG flags = KeAcquireSpinLock(&KiDispatcherLock);
+    task->cpu = smp_current_cpu();
+    task_list_append(task);
+    task_ready_insert(task);
+    KeReleaseSpinLock(&KiDispatcherLock, flags);
 
 out:    
     if (ISERR(res))
@@ -76,12 +203,13 @@ out:
 
 struct task* task_get_next()
 {
-    if (!current_task->next)
+    struct task* current = task_current();
+    if (!current->next)
     {
         return task_head;
     }
 
-    return current_task->next;
+    return current->next;
 }
 
 static void task_list_remove(struct task* task)
@@ -91,6 +219,11 @@ static void task_list_remove(struct task* task)
         task->prev->next = task->next;
     }
 
+    if (task->next)
+    {
+        task->next->prev = task->prev;
+    }
+
     if (task == task_head)
     {
         task_head = task->next;
@@ -100,17 +233,33 @@ static void task_list_remove(struct task* task)
     {
         task_tail = task->prev;
     }
-
-    if (task == current_task)
-    {
-        current_task = task_get_next();
-    }
 }
 
 int task_free(struct task* task)
 {
-    paging_free_4gb(task->page_directory);
+    // Tasks that never got a CPU were never queued
+    ULONG flags = KeAcquireSpinLock(&KiDispatcherLock);
+    if (task->cpu && task->state == TASK_STATE_READY && !task_is_idle(task))
+    {
+        task_ready_remove(task);
+    }
     task_list_remove(task);
+    KeReleaseSpinLock(&KiDispatcherLock, flags);
+
+    if (task->page_directory && !task->shared_directory)
+    {
+        paging_free_4gb(task->page_directory);
+    }
+
+    if (task->kernel_stack)
+    {
+        kfree(task->kernel_stack);
+    }
+
+    if (task->stack)
+    {
+        frame_free(task->stack);
+    }
 
     // Finally free the task data
     kfree(task);
@@ -120,18 +269,527 @@ int task_free(struct task* task)
 int task_init(struct task* task, struct process* process)
 {
     memset(task, 0, sizeof(struct task));
-    // Map the entire 4GB address space to its self
     task->page_directory = paging_new_4gb(PAGING_IS_PRESENT | PAGING_ACCESS_FROM_ALL);
     if (!task->page_directory)
     {
         return -EIO;
     }
 
+    int res = task_init_kernel_stack(task);
+    if (res < 0)
+    {
+        return res;
+    }
+
     task->registers.ip = FREE95_PROGRAM_VIRTUAL_ADDRESS;
+    task->registers.cs = USER_CODE_SEGMENT;
+    task->registers.flags = 0x202;
     task->registers.ss = USER_DATA_SEGMENT;
     task->registers.esp = FREE95_PROGRAM_VIRTUAL_STACK_ADDRESS_START;
 
     task->process = process;
+    task->base_priority = FREE95_PRIORITY_NORMAL;
+    task->priority = FREE95_PRIORITY_NORMAL;
+
+    return 0;
+}
+
+/**
+ * Starts entry(argc, argv) as a ring 3 thread in the address space of the
+ * current task, returning from entry ends the thread through KiThreadExit.
+ */
+struct task* task_new_thread(void* entry, int argc, char* argv)
+{
+    int res = 0;
+    struct task* task = kzalloc(sizeof(struct task));
+    if (!task)
+    {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    res = task_init_kernel_stack(task);
+    if (res < 0)
+    {
+        goto out;
+    }
+
+    // Like process stacks, user stacks come from the frame allocator and not the kernel heap
+    task->stack = frame_zalloc(FREE95_USER_PROGRAM_STACK_SIZE);
+    if (!task->stack)
+    {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    uint32_t* stack = (uint32_t*)((char*)task->stack + FREE95_USER_PROGRAM_STACK_SIZE);
+    *--stack = (uint32_t)argv;
+    *--stack = argc;
+    *--stack = (uint32_t)KiThreadExit;
+
+    task->registers.ip = (uint32_t)entry;
+    task->registers.cs = USER_CODE_SEGMENT;
+    task->registers.flags = 0x202;
+    task->registers.esp = (uint32_t)stack;
+    task->registers.ss = USER_DATA_SEGMENT;
+
+    task->page_directory = task_current()->page_directory;
+    task->shared_directory = true;
+    task->base_priority = FREE95_PRIORITY_NORMAL;
+    task->priority = FREE95_PRIORITY_NORMAL;
+
+    ULONG flags = KeAcquireSpinLock(&KiDispatcherLock);
+    task->cpu = smp_current_cpu();
+    task_list_append(task);
+    task_ready_insert(task);
+    KeReleaseSpinLock(&KiDispatcherLock, flags);
+
+out:
+    if (ISERR(res))
+    {
+        if (task)
+        {
+            task_free(task);
+        }
+        return ERROR(res);
+    }
+
+    return task;
+}
+
+// Frees the task that exited on this CPU, its page directory goes back under the kernel lock
+static void task_reap()
+{
+    struct cpu* cpu = smp_current_cpu();
+    struct task* task = cpu->dead_task;
+    if (task)
+    {
+        cpu->dead_task = 0;
+        smp_lock_kernel();
+        task_free(task);
+        smp_unlock_kernel();
+    }
+}
+
+static void task_first_run()
+{
+    // The task that switched here left the dispatcher lock held
+    KeReleaseSpinLock(&KiDispatcherLock, 0);
+    task_reap();
+    task_return(&task_current()->registers);
+}
+
+/**
+ * Copies what the interrupt stub pushed into the registers of the current task.
+ */
+void task_current_save_state(struct interrupt_frame* frame)
+{
+    struct task* task = task_current();
+    if (!task)
+    {
+        return;
+    }
+
+    struct registers* registers = &task->registers;
+    registers->edi = frame->edi;
+    registers->esi = frame->esi;
+    registers->ebp = frame->ebp;
+    registers->ebx = frame->ebx;
+    registers->edx = frame->edx;
+    registers->ecx = frame->ecx;
+    registers->eax = frame->eax;
+    registers->ip = frame->ip;
+    registers->cs = frame->cs;
+    registers->flags = frame->flags;
+
+    if (frame->cs & 3)
+    {
+        registers->esp = frame->esp;
+        registers->ss = frame->ss;
+    }
+    else
+    {
+        // Without a privilege change the interrupted code continues right above the frame
+        registers->esp = (uint32_t)&frame->esp;
+        registers->ss = KERNEL_DATA_SELECTOR;
+    }
+}
+
+/**
+ * Moves the first task of the highest priority another CPU has queued to
+ * this CPU, called when it has nothing left to run. Returns 0 when every
+ * queue is empty.
+ */
+static struct task* task_steal(struct cpu* cpu)
+{
+    struct task* task = 0;
+    int best = -1;
+    for (int i = 0; i < smp_get_cpu_count(); i++)
+    {
+        struct cpu* other = smp_get_cpu(i);
+        int highest = other == cpu ? -1 : task_ready_highest(other);
+        if (highest > best)
+        {
+            best = highest;
+            task = other->ready_head[highest];
+        }
+    }
+
+    if (task)
+    {
+        task_ready_remove(task);
+        task->cpu = cpu;
+        task_ready_insert(task);
+    }
+
+    return task;
+}
+
+/**
+ * Picks the first task of the highest priority queue. The current task
+ * keeps the CPU over queued tasks of lower priority, and over those of
+ * equal priority unless its quantum ran out, unless it yielded or cannot run.
+ */
+static struct task* task_pick_next(struct cpu* cpu, bool quantum_end)
+{
+    struct task* current = cpu->current_task;
+    bool runnable = current != cpu->idle_task && current->state == TASK_STATE_RUNNING && !current->yielded;
+    int highest = task_ready_highest(cpu);
+    if (highest < 0)
+    {
+        if (runnable)
+        {
+            return current;
+        }
+
+        struct task* stolen = task_steal(cpu);
+        return stolen ? stolen : cpu->idle_task;
+    }
+
+    if (runnable && (current->priority > highest || (current->priority == highest && !quantum_end)))
+    {
+        return current;
+    }
+
+    return cpu->ready_head[highest];
+}
+
+static void task_switch(struct cpu* cpu, struct task* prev, struct task* next)
+{
+    if (prev->state == TASK_STATE_RUNNING && prev != cpu->idle_task)
+    {
+        task_ready_insert(prev);
+    }
+    else if (prev == cpu->idle_task)
+    {
+        prev->state = TASK_STATE_READY;
+    }
+
+    if (next != cpu->idle_task)
+    {
+        task_ready_remove(next);
+    }
+    next->state = TASK_STATE_RUNNING;
+    cpu->current_task = next;
+
+    cpu->tss->esp0 = (uint32_t)next->kernel_stack + FREE95_TASK_KERNEL_STACK_SIZE;
+    if (next->page_directory && next->page_directory->directory_entry != paging_current_directory())
+    {
+        paging_switch(next->page_directory->directory_entry);
+    }
+
+    task_fxsave(task_fpu_state(prev));
+    task_fxrstor(task_fpu_state(next));
+    task_switch_context(&prev->kernel_esp, next->kernel_esp);
+}
+
+/**
+ * Switches to the task that should run on this CPU, called and returning
+ * with the dispatcher lock held. Other CPUs cannot take prev from the
+ * queues before it is switched out, the lock is only released once the
+ * next task runs.
+ */
+static void task_schedule_locked(bool quantum_end)
+{
+    struct cpu* cpu = smp_current_cpu();
+    struct task* prev = cpu->current_task;
+    if (!prev)
+    {
+        // The scheduler has not started yet
+        return;
+    }
+
+    struct task* next = task_pick_next(cpu, quantum_end);
+    prev->yielded = false;
+    if (next == prev)
+    {
+        if (quantum_end)
+        {
+            next->quantum = FREE95_SCHED_QUANTUM;
+        }
+        return;
+    }
+
+    // The kernel lock belongs to the task, not to the CPU
+    next->quantum = FREE95_SCHED_QUANTUM;
+    int depth = smp_drop_kernel_lock();
+    task_switch(cpu, prev, next);
+
+    // prev runs again, possibly on another CPU, and takes back its locks in the order they nest
+    KeReleaseSpinLock(&KiDispatcherLock, 0);
+    task_reap();
+    smp_restore_kernel_lock(depth);
+    KeAcquireSpinLock(&KiDispatcherLock);
+}
+
+/**
+ * Switches to a task of higher priority if one is ready, returns once the
+ * current task is picked again. Runs with interrupts disabled.
+ */
+void task_schedule()
+{
+    ULONG flags = KeAcquireSpinLock(&KiDispatcherLock);
+    task_schedule_locked(false);
+    KeReleaseSpinLock(&KiDispatcherLock, flags);
+}
+
+// task_schedule() for callers that already hold the dispatcher lock
+void task_dispatch()
+{
+    task_schedule_locked(false);
+}
+
+// Boosted tasks drop one level every time they use up a quantum or give up the CPU
+static void task_decay(struct task* task)
+{
+    if (task->priority > task->base_priority)
+    {
+        task->priority--;
+    }
+}
 
+/**
+ * Called by the timer interrupt, the current task is preempted once its
+ * quantum is used up or a task of higher priority became ready.
+ */
+void task_tick(struct interrupt_frame* frame)
+{
+    ULONG flags = KeAcquireSpinLock(&KiDispatcherLock);
+    struct cpu* cpu = smp_current_cpu();
+    struct task* task = cpu->current_task;
+    if (!task)
+    {
+        goto out;
+    }
+
+    task_current_save_state(frame);
+    if (task != cpu->idle_task && task->quantum > 1)
+    {
+        task->quantum--;
+        task_schedule_locked(false);
+        goto out;
+    }
+
+    if (task != cpu->idle_task)
+    {
+        task_decay(task);
+    }
+    task_schedule_locked(true);
+
+out:
+    KeReleaseSpinLock(&KiDispatcherLock, flags);
+}
+
+void task_yield()
+{
+    ULONG flags = KeAcquireSpinLock(&KiDispatcherLock);
+    struct task* task = task_current();
+    task_decay(task);
+    task->yielded = true;
+    task_schedule_locked(true);
+    KeReleaseSpinLock(&KiDispatcherLock, flags);
+}
+
+void task_exit()
+{
+    KeAcquireSpinLock(&KiDispatcherLock);
+    struct cpu* cpu = smp_current_cpu();
+    struct task* task = cpu->current_task;
+    task->state = TASK_STATE_DEAD;
+    cpu->dead_task = task;
+
+    // Never returns, the next task on this CPU frees this one
+    task_schedule_locked(true);
+}
+
+/**
+ * Raises the priority of the task by increment above its base, like NT
+ * does for threads whose I/O completed. Realtime priorities are not boosted.
+ */
+void task_boost(struct task* task, int increment)
+{
+    if (!task || task_is_idle(task) || task->state == TASK_STATE_DEAD || task->base_priority >= FREE95_PRIORITY_REALTIME)
+    {
+        return;
+    }
+
+    int priority = task->base_priority + increment;
+    if (priority >= FREE95_PRIORITY_REALTIME)
+    {
+        priority = FREE95_PRIORITY_REALTIME - 1;
+    }
+
+    if (priority <= task->priority)
+    {
+        return;
+    }
+
+    // A queued task moves to the queue of its new priority
+    if (task->state == TASK_STATE_READY)
+    {
+        task_ready_remove(task);
+        task->priority = priority;
+        task_ready_insert(task);
+    }
+    else
+    {
+        task->priority = priority;
+    }
+    task->quantum = FREE95_SCHED_QUANTUM;
+}
+
+/**
+ * Takes the current task off the CPU until task_unblock(), used by the
+ * dispatcher objects in ke/sync. Runs with the dispatcher lock held.
+ */
+void task_block()
+{
+    task_current()->state = TASK_STATE_WAITING;
+    task_schedule_locked(false);
+}
+
+/**
+ * Makes a waiting task ready again with a boost of increment on the CPU
+ * it last ran on, it runs once it is picked like any other ready task.
+ */
+void task_unblock(struct task* task, int increment)
+{
+    if (task->state != TASK_STATE_WAITING)
+    {
+        return;
+    }
+
+    task_boost(task, increment);
+    task_ready_insert(task);
+}
+
+bool task_is_idle(struct task* task)
+{
+    return task->cpu && task->cpu->idle_task == task;
+}
+
+/**
+ * Creates the idle task of the CPU, it halts in ring 0 whenever the CPU
+ * has nothing to run. It is not in the task list.
+ */
+int task_cpu_init(struct cpu* cpu)
+{
+    struct task* task = kzalloc(sizeof(struct task));
+    if (!task)
+    {
+        return -ENOMEM;
+    }
+
+    int res = task_init_kernel_stack(task);
+    if (res < 0)
+    {
+        kfree(task);
+        return res;
+    }
+
+    task->registers.ip = (uint32_t)task_idle_loop;
+    task->registers.cs = KERNEL_CODE_SELECTOR;
+    task->registers.flags = 0x202;
+    task->registers.esp = (uint32_t)task->kernel_stack + FREE95_TASK_KERNEL_STACK_SIZE;
+    task->registers.ss = KERNEL_DATA_SELECTOR;
+    task->state = TASK_STATE_READY;
+    task->cpu = cpu;
+    cpu->idle_task = task;
     return 0;
 }
+
+/**
+ * Leaves the boot stack of a CPU that just started for its idle task,
+ * which takes tasks from the other CPUs from then on. Never returns.
+ */
+void task_cpu_run(struct cpu* cpu)
+{
+    KeAcquireSpinLock(&KiDispatcherLock);
+    struct task* task = cpu->idle_task;
+    task->state = TASK_STATE_RUNNING;
+    cpu->current_task = task;
+    cpu->tss->esp0 = (uint32_t)task->kernel_stack + FREE95_TASK_KERNEL_STACK_SIZE;
+    task_fxrstor(task_fpu_state(task));
+
+    // task_first_run() releases the lock
+    uint32_t boot_esp;
+    task_switch_context(&boot_esp, task->kernel_esp);
+}
+
+/**
+ * Turns the running code into the first task, creates the idle task and
+ * starts the timer that preempts them.
+ */
+int task_scheduler_init(struct paging_4gb_chunk* directory)
+{
+    int res = 0;
+    struct task* task = 0;
+    struct cpu* cpu = smp_current_cpu();
+    res = task_cpu_init(cpu);
+    if (res < 0)
+    {
+        goto out;
+    }
+
+    task = kzalloc(sizeof(struct task));
+    if (!task)
+    {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    res = task_init_kernel_stack(task);
+    if (res < 0)
+    {
+        goto out;
+    }
+
+    task->page_directory = directory;
+    task->shared_directory = true;
+    task->base_priority = FREE95_PRIORITY_NORMAL;
+    task->priority = FREE95_PRIORITY_NORMAL;
+    task->state = TASK_STATE_RUNNING;
+    task->quantum = FREE95_SCHED_QUANTUM;
+    task->cpu = cpu;
+    task_list_append(task);
+    cpu->current_task = task;
+
+    cpu->tss->esp0 = (uint32_t)task->kernel_stack + FREE95_TASK_KERNEL_STACK_SIZE;
+    pit_init(FREE95_SCHED_HZ);
+
+out:
+    if (res < 0)
+    {
+        if (task)
+        {
+            task_free(task);
+        }
+
+        if (cpu->idle_task)
+        {
+            task_free(cpu->idle_task);
+            cpu->idle_task = 0;
+        }
+    }
+    return res;
+}
@@ -3,6 +3,7 @@
 
 #include "../config.h"
 #include "../memory/paging/paging.h"
+#include <stdbool.h>
 
 struct registers
 {
@@ -21,7 +22,21 @@ struct registers
     uint32_t ss;
 };
 
+typedef unsigned int TASK_STATE;
+enum
+{
+    TASK_STATE_READY,
+    TASK_STATE_RUNNING,
+    TASK_STATE_WAITING,
+    TASK_STATE_DEAD
+};
+
+// Size of the fxsave area, it has to be 16 byte aligned so the task keeps 16 spare bytes
+#define TASK_FPU_STATE_SIZE 512
+
+struct interrupt_frame;
 struct process;
+struct cpu;
 struct task
 {
     /**
@@ -35,6 +50,47 @@ struct task
 	// Process
 	struct process* process;
 
+    // Threads run in the address space of the task that started them and do not free it
+    bool shared_directory;
+
+    // User stack of threads, processes map their own
+    void* stack;
+
+    // Interrupts from ring 3 enter at the top of this stack
+    void* kernel_stack;
+    // Stack pointer of the kernel context while the task is switched out
+    uint32_t kernel_esp;
+
+    // FPU and SSE registers, saved with fxsave while the task is switched out
+    char fpu_state[TASK_FPU_STATE_SIZE + 16];
+
+    TASK_STATE state;
+    // The CPU whose ready queues the task is in, or that runs it
+    struct cpu* cpu;
+    // Timer ticks left before the task is preempted
+    uint32_t quantum;
+
+    // 0 to 31, higher runs first. priority is base_priority plus what is left of a boost
+    int base_priority;
+    int priority;
+
+    // Links in the ready queue of the task's priority
+    struct task* ready_next;
+    struct task* ready_prev;
+    // The task gave up the CPU and waits for the next tick even if nothing else is ready
+    bool yielded;
+
+    // The dispatcher object the task waits for and its place among the other waiters, see sync.c
+    void* wait_object;
+    struct task* wait_next;
+    struct task* wait_prev;
+    // Tick at which a wait with a timeout gives up, and the links of the tasks that have one
+    uint32_t wait_until;
+    struct task* timer_next;
+    struct task* timer_prev;
+    // What KeWaitForSingleObject() returns once the task is woken
+    uint32_t wait_status;
+
     // The next task in the linked list
     struct task* next;
 
@@ -45,9 +101,24 @@ struct task
 typedef struct task Thread;
 
 struct task* task_new(struct process* process);
+struct task* task_new_thread(void* entry, int argc, char* argv);
 struct task* task_current();
 struct task* task_get_next();
 int task_free(struct task* task);
 
+int task_scheduler_init(struct paging_4gb_chunk* directory);
+void task_current_save_state(struct interrupt_frame* frame);
+void task_tick(struct interrupt_frame* frame);
+void task_schedule();
+void task_dispatch();
+void task_yield();
+void task_exit();
+void task_boost(struct task* task, int increment);
+void task_block();
+void task_unblock(struct task* task, int increment);
+bool task_is_idle(struct task* task);
+int task_cpu_init(struct cpu* cpu);
+void task_cpu_run(struct cpu* cpu);
+
 
 #endif
@@ -0,0 +1,52 @@
+/*++
+
+Free95 20x/TX Kernel
+
+You may only use this code if you agree to the terms of the Free95 Source Code License agreement (GNU GPL v3) (see LICENSE).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    pit.c
+
+Abstract:
+
+    This module implements the Programmable Interval Timer driver.
+    Channel 0 raises IRQ0 at a fixed rate, the scheduler uses it to
+    preempt tasks.
+
+--*/
+
+#include "pit.h"
+#include "../io/io.h"
+
+static volatile uint32_t pit_ticks = 0;
+
+/**
+ * Programs channel 0 to interrupt frequency times a second and unmasks IRQ0.
+ */
+void pit_init(uint32_t frequency)
+{
+    uint32_t divisor = PIT_BASE_FREQUENCY / frequency;
+    if (divisor > 0xFFFF)
+    {
+        divisor = 0xFFFF;
+    }
+
+    outb(PIT_COMMAND, PIT_MODE_SQUARE_WAVE);
+    outb(PIT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
+
+    outb(0x21, insb(0x21) & ~0x01);
+}
+
+void pit_tick()
+{
+    pit_ticks++;
+}
+
+uint32_t pit_get_ticks()
+{
+    return pit_ticks;
+}
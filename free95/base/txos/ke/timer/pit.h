@@ -0,0 +1,19 @@
+#ifndef PIT_H
+#define PIT_H
+
+#include <stdint.h>
+
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND 0x43
+
+// Input clock of the PIT in Hz
+#define PIT_BASE_FREQUENCY 1193182
+
+// Channel 0, low then high byte of the divisor, square wave generator
+#define PIT_MODE_SQUARE_WAVE 0x36
+
+void pit_init(uint32_t frequency);
+void pit_tick();
+uint32_t pit_get_ticks();
+
+#endif
@@ -0,0 +1,289 @@
+/*++
+
+Free95 20x/TX Tools
+
+You may only use this code if you agree to the terms of the Free95 Source Code License agreement (GNU GPL v3) (see LICENSE).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    heapbench.c
+
+Abstract:
+
+    This module implements a hosted benchmark for the kernel heap.
+    heap.c, slab.c and kheap.c are linked unmodified into a Linux program
+    with the spinlocks of synchost.c, the heap is backed by an mmap'd
+    region at FREE95_HEAP_ADDRESS and randomized alloc/free traces are
+    replayed against kmalloc()/kfree().
+
+    Usage: heapbench [ops] [seed]
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "ke/config.h"
+#include "ke/memory/heap/heap.h"
+#include "ke/memory/heap/kheap.h"
+#include "ke/memory/heap/slab.h"
+
+#define HEAPBENCH_MAX_LIVE 8192
+#define HEAPBENCH_SAMPLE_INTERVAL 64
+
+extern struct heap kernel_heap;
+extern struct slab_allocator kernel_slab;
+
+struct workload
+{
+    const char* name;
+    // Percentage of allocations that take whole heap blocks
+    int large_percent;
+    // Largest allocation in blocks
+    int max_blocks;
+    // Percentage of steps that allocate while below the live limit
+    int alloc_percent;
+    int max_live;
+};
+
+static const struct workload workloads[] =
+{
+    { "small",  0,   0, 55, HEAPBENCH_MAX_LIVE },
+    { "pages",  100, 16, 55, 2048 },
+    { "mixed",  20,  64, 55, 2048 },
+    { "churn",  10,  8,  50, 512 },
+};
+
+struct live_object
+{
+    void* ptr;
+    size_t size;
+};
+
+static struct live_object live[HEAPBENCH_MAX_LIVE];
+static uint64_t* alloc_ns;
+static uint64_t* free_ns;
+
+// Called by kheap.c on failure
+void print(const char* str)
+{
+    fputs(str, stderr);
+}
+
+static uint64_t rng_state;
+
+static uint64_t rng_next()
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t* samples, size_t count, int pct)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    size_t index = (count * pct) / 100;
+    if (index >= count)
+    {
+        index = count - 1;
+    }
+    return samples[index];
+}
+
+static size_t workload_size(const struct workload* w)
+{
+    if ((int)(rng_next() % 100) < w->large_percent)
+    {
+        return ((rng_next() % w->max_blocks) + 1) * FREE95_HEAP_BLOCK_SIZE - (rng_next() % 64);
+    }
+
+    // Skew towards the small kernel structures that dominate real traces
+    size_t limit = FREE95_SLAB_MAX_OBJECT_SIZE >> (rng_next() % 8);
+    return (rng_next() % limit) + 1;
+}
+
+static double heap_fragmentation(struct heap_stats* stats)
+{
+    if (stats->free_blocks == 0)
+    {
+        return 0.0;
+    }
+
+    return 1.0 - ((double)stats->largest_free_run / (double)stats->free_blocks);
+}
+
+static void run_workload(const struct workload* w, size_t ops)
+{
+    size_t live_count = 0;
+    size_t allocs = 0;
+    size_t frees = 0;
+    size_t failed = 0;
+    double peak_fragmentation = 0.0;
+    size_t smallest_largest_run = (size_t)-1;
+    uint64_t elapsed = 0;
+
+    for (size_t i = 0; i < ops; i++)
+    {
+        int do_alloc = live_count == 0 || (live_count < (size_t)w->max_live && (int)(rng_next() % 100) < w->alloc_percent);
+        if (do_alloc)
+        {
+            size_t size = workload_size(w);
+            uint64_t start = now_ns();
+            void* ptr = kmalloc(size);
+            uint64_t taken = now_ns() - start;
+            elapsed += taken;
+
+            if (!ptr)
+            {
+                failed++;
+                continue;
+            }
+
+            // Touch both ends so overlapping allocations would show up as corruption
+            ((char*)ptr)[0] = (char)i;
+            ((char*)ptr)[size - 1] = (char)i;
+            live[live_count].ptr = ptr;
+            live[live_count].size = size;
+            live_count++;
+            alloc_ns[allocs++] = taken;
+        }
+        else
+        {
+            size_t index = rng_next() % live_count;
+            void* ptr = live[index].ptr;
+            uint64_t start = now_ns();
+            kfree(ptr);
+            uint64_t taken = now_ns() - start;
+            elapsed += taken;
+
+            live[index] = live[--live_count];
+            free_ns[frees++] = taken;
+        }
+
+        if ((i % HEAPBENCH_SAMPLE_INTERVAL) == 0)
+        {
+            struct heap_stats stats;
+            heap_get_stats(&kernel_heap, &stats);
+            double fragmentation = heap_fragmentation(&stats);
+            if (fragmentation > peak_fragmentation)
+            {
+                peak_fragmentation = fragmentation;
+            }
+            if (stats.largest_free_run < smallest_largest_run)
+            {
+                smallest_largest_run = stats.largest_free_run;
+            }
+        }
+    }
+
+    // Return everything so the next workload starts from an empty heap
+    for (size_t i = 0; i < live_count; i++)
+    {
+        kfree(live[i].ptr);
+    }
+
+    qsort(alloc_ns, allocs, sizeof(uint64_t), compare_u64);
+    qsort(free_ns, frees, sizeof(uint64_t), compare_u64);
+
+    double seconds = elapsed / 1e9;
+    printf("%-8s %12.0f %8llu %8llu %10llu %8llu %8llu %10llu %9.2f%% %11zu %7zu\n",
+           w->name,
+           seconds > 0 ? (allocs + frees) / seconds : 0.0,
+           (unsigned long long)percentile(alloc_ns, allocs, 50),
+           (unsigned long long)percentile(alloc_ns, allocs, 99),
+           (unsigned long long)(allocs ? alloc_ns[allocs - 1] : 0),
+           (unsigned long long)percentile(free_ns, frees, 50),
+           (unsigned long long)percentile(free_ns, frees, 99),
+           (unsigned long long)(frees ? free_ns[frees - 1] : 0),
+           peak_fragmentation * 100.0,
+           smallest_largest_run,
+           failed);
+}
+
+static void print_slab_stats()
+{
+    printf("\n%-8s %10s %10s %10s %8s\n", "class", "allocs", "peak", "slabs", "per-slab");
+    for (int i = 0; i < FREE95_SLAB_TOTAL_CLASSES; i++)
+    {
+        struct slab_cache* cache = slab_get_cache(&kernel_slab, i);
+        printf("%-8zu %10u %10u %10u %8u\n", cache->object_size, cache->stats.allocs,
+               cache->stats.peak_objects, cache->stats.slabs, cache->objects_per_slab);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    size_t ops = argc > 1 ? strtoull(argv[1], 0, 0) : 1000000;
+    rng_state = argc > 2 ? strtoull(argv[2], 0, 0) : 0x95;
+    if (rng_state == 0)
+    {
+        rng_state = 0x95;
+    }
+
+    void* heap = mmap((void*)FREE95_HEAP_ADDRESS, FREE95_HEAP_SIZE_BYTES, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    size_t table_size = FREE95_HEAP_SIZE_BYTES / FREE95_HEAP_BLOCK_SIZE;
+    void* table = mmap((void*)FREE95_HEAP_TABLE_ADDRESS, table_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (heap != (void*)FREE95_HEAP_ADDRESS || table != (void*)FREE95_HEAP_TABLE_ADDRESS)
+    {
+        fprintf(stderr, "heapbench: could not map the heap at 0x%lx\n", (unsigned long)FREE95_HEAP_ADDRESS);
+        return 1;
+    }
+
+    alloc_ns = malloc(ops * sizeof(uint64_t));
+    free_ns = malloc(ops * sizeof(uint64_t));
+    if (!alloc_ns || !free_ns)
+    {
+        fprintf(stderr, "heapbench: out of memory\n");
+        return 1;
+    }
+
+    uint64_t start = now_ns();
+    kheap_init();
+    printf("kheap_init: %llu us, %zu ops per workload, seed 0x%llx\n\n",
+           (unsigned long long)(now_ns() - start) / 1000, ops, (unsigned long long)rng_state);
+
+    printf("%-8s %12s %8s %8s %10s %8s %8s %10s %10s %11s %7s\n",
+           "workload", "ops/sec", "a-p50ns", "a-p99ns", "a-maxns", "f-p50ns", "f-p99ns", "f-maxns",
+           "peak-frag", "min-largest", "failed");
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        run_workload(&workloads[i], ops);
+    }
+
+    struct heap_stats stats;
+    heap_get_stats(&kernel_heap, &stats);
+    printf("\nheap after run: %zu/%zu blocks free in %zu runs, largest run %zu blocks\n",
+           stats.free_blocks, stats.total_blocks, stats.free_runs, stats.largest_free_run);
+
+    print_slab_stats();
+    return 0;
+}
@@ -0,0 +1,41 @@
+/*++
+
+Free95 20x/TX Tools
+
+You may only use this code if you agree to the terms of the Free95 Source Code License agreement (GNU GPL v3) (see LICENSE).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    synchost.c
+
+Abstract:
+
+    This module implements the spinlocks kheap.c takes for the hosted
+    benchmark. The benchmark runs on one thread and cannot disable
+    interrupts, so the lock is only taken and released and the flags
+    are ignored.
+
+--*/
+
+#include "ke/sync/sync.h"
+
+VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock)
+{
+    *SpinLock = 0;
+}
+
+ULONG KeAcquireSpinLock(PKSPIN_LOCK SpinLock)
+{
+    while (__sync_lock_test_and_set(SpinLock, 1))
+    {
+    }
+
+    return 0;
+}
+
+VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, ULONG Flags)
+{
+    __sync_lock_release(SpinLock);
+}
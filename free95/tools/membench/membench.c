@@ -0,0 +1,198 @@
+/*++
+
+Free95 20x/TX Tools
+
+You may only use this code if you agree to the terms of the Free95 Source Code License agreement (GNU GPL v3) (see LICENSE).
+If you do not agree to the terms, do not use the code.
+
+
+Module Name:
+
+    membench.c
+
+Abstract:
+
+    This module implements a hosted benchmark for the kernel memory services.
+    memory.c is linked with its functions renamed so they do not clash with
+    the C library, and every implementation memory_set_features() can select
+    is timed over a range of sizes and alignments and checked for correctness.
+
+    Usage: membench [bytes per size]
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "ke/memory/memory.h"
+
+#define MEMBENCH_BUFFER_SIZE (2 * 1024 * 1024)
+
+struct variant
+{
+    const char* name;
+    unsigned int features;
+};
+
+static const struct variant variants[] =
+{
+    { "bytes", 0 },
+    { "rep",   MEMORY_FEATURE_REP_STRING },
+    { "sse2",  MEMORY_FEATURE_REP_STRING | MEMORY_FEATURE_SSE2 },
+};
+
+static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 65536, 1228800 };
+
+static unsigned char* source;
+static unsigned char* destination;
+
+// The kernel enables SSE in memory_init(), a hosted process already has it
+void memory_enable_sse()
+{
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int check_variant()
+{
+    // Every size and misalignment up to a few SSE blocks, against plain loops
+    for (size_t size = 0; size < 600; size += (size < 80 ? 1 : 37))
+    {
+        for (int offset = 0; offset < 8; offset++)
+        {
+            for (size_t i = 0; i < size + 64; i++)
+            {
+                source[i] = (unsigned char)(i * 7 + 1);
+                destination[i] = 0xEE;
+            }
+
+            memcpy(destination + offset, source + 3, size);
+            for (size_t i = 0; i < size; i++)
+            {
+                if (destination[offset + i] != source[3 + i])
+                {
+                    return -1;
+                }
+            }
+
+            if (destination[offset + size] != 0xEE || memcmp(destination + offset, source + 3, size) != 0)
+            {
+                return -1;
+            }
+
+            memset(destination + offset, 0x5A, size);
+            for (size_t i = 0; i < size; i++)
+            {
+                if (destination[offset + i] != 0x5A)
+                {
+                    return -1;
+                }
+            }
+
+            // Overlapping move in both directions
+            memmove(source + offset + 5, source + offset, size);
+            memmove(source + offset, source + offset + 5, size);
+            for (size_t i = 0; i < size; i++)
+            {
+                if (source[offset + i] != (unsigned char)((i + offset) * 7 + 1))
+                {
+                    return -1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+static double bench(int op, size_t size, size_t total)
+{
+    size_t rounds = total / size;
+    if (rounds == 0)
+    {
+        rounds = 1;
+    }
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < rounds; i++)
+    {
+        switch (op)
+        {
+            case 0:
+                memset(destination, (int)i, size);
+                break;
+            case 1:
+                memcpy(destination, source, size);
+                break;
+            case 2:
+                memmove(destination + 1, destination, size);
+                break;
+            case 3:
+                if (memcmp(destination, source, size) == 2)
+                {
+                    abort();
+                }
+                break;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    // MB/s
+    return elapsed ? ((double)rounds * size * 1000.0) / elapsed : 0.0;
+}
+
+int main(int argc, char** argv)
+{
+    static const char* ops[] = { "memset", "memcpy", "memmove", "memcmp" };
+    size_t total = argc > 1 ? strtoull(argv[1], 0, 0) : 256 * 1024 * 1024;
+
+    source = malloc(MEMBENCH_BUFFER_SIZE);
+    destination = malloc(MEMBENCH_BUFFER_SIZE);
+    if (!source || !destination)
+    {
+        fprintf(stderr, "membench: out of memory\n");
+        return 1;
+    }
+
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++)
+    {
+        memory_set_features(variants[v].features);
+        if (check_variant() < 0)
+        {
+            fprintf(stderr, "membench: %s produced wrong results\n", variants[v].name);
+            return 1;
+        }
+    }
+
+    printf("MB/s, %zu bytes per size\n\n%-8s %-6s", total, "op", "impl");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        printf(" %10zu", sizes[s]);
+    }
+    printf("\n");
+
+    for (int op = 0; op < 4; op++)
+    {
+        for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++)
+        {
+            memory_set_features(variants[v].features);
+            printf("%-8s %-6s", ops[op], variants[v].name);
+            for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+            {
+                // memcmp needs equal buffers to walk the whole size
+                memcpy(destination, source, sizes[s]);
+                printf(" %10.0f", bench(op, sizes[s], total));
+            }
+            printf("\n");
+        }
+    }
+
+    return 0;
+}